@@ -36,32 +36,52 @@ static int bufferFIFO_stageStalled(struct bufferFIFO *bf, int stage)
 	return 0;
 }
 
+//
+// Stage completions may run in interrupt context. They only update the indexes and flags
+// of their own stage and then flag BUFFER_FIFO_WORK so that bufferFIFO_idle() starts the
+// next stages from the main loop. Each field has a single writer so interrupts don't
+// need to be masked. The barriers make sure the main loop never sees a stage as idle
+// before its indexes have advanced.
+//
 void bufferFIFO_stallStage(struct bufferFIFO *bf, int stageIdx)
 {
-	__disable_irq();
-	bf->_stageProcessing[stageIdx] = 0;
 	bf->_stalled[stageIdx] = 1;
-	__enable_irq();
+	__DMB();
+	bf->_stageProcessing[stageIdx] = 0;
 }
 
 void bufferFIFO_processingComplete(struct bufferFIFO *bf, int stageIdx, int writeLen, u32 bufferData)
 {
-	__disable_irq();
 	if (writeLen >= 0) {
 		int i = bf->_stageWriteIndex[stageIdx] % bf->bufferCount;
 		bf->_bufferSize[i] = writeLen;
 		bf->_bufferData[i] = bufferData;
 	}
-	int nextStageIdx = (stageIdx + 1) % bf->numStages;
-	//Advance read/write indexes
-	bf->_stageProcessing[stageIdx] = 0;
+	__DMB();
 	bf->_stageWriteIndex[stageIdx]++;
 	bf->_stageReadIndex[stageIdx]++;
-	//Process the next buffer if we aren't stalled by the next stage
-	if (!bufferFIFO_stageStalled(bf, stageIdx))
-		bufferFIFO_execStage(bf, stageIdx);
-	if (!bufferFIFO_stageStalled(bf, nextStageIdx))
-		bufferFIFO_execStage(bf, nextStageIdx);
+	__DMB();
+	bf->_stageProcessing[stageIdx] = 0;
+	BEGIN_WORK(BUFFER_FIFO_WORK);
+}
+
+int bufferFIFO_idle_ready(struct bufferFIFO *bf)
+{
+	return (g_work_to_do & BUFFER_FIFO_WORK) ? 1 : 0;
+}
+
+void bufferFIFO_idle(struct bufferFIFO *bf)
+{
+	if (!bufferFIFO_idle_ready(bf))
+		return;
+	END_WORK(BUFFER_FIFO_WORK);
+	__DMB();
+	for (int i = 0; i < bf->numStages; i++) {
+		if (!bufferFIFO_stageStalled(bf, i))
+			bufferFIFO_execStage(bf, i);
+		else if (bf->_processing && !bf->_stageProcessing[i] && !bf->_stalled[i])
+			bf->stallCount[i]++;
+	}
 	if (bf->_processing) {
 		while (bf->_stall_index < bf->numStages) {
 			if (bf->_stageProcessing[bf->_stall_index] || !bf->_stalled[bf->_stall_index])
@@ -73,39 +93,58 @@ void bufferFIFO_processingComplete(struct bufferFIFO *bf, int stageIdx, int writ
 			bf->processingComplete(bf);
 		}
 	}
-	__enable_irq();
+}
+
+//
+// Split the arena into buffers sized for a transfer of transferLen bytes. Buffers are
+// made small enough that the transfer spans at least one buffer per stage so all stages
+// can run concurrently, and small enough that the arena holds one buffer per stage plus
+// one for each stage that isn't in-place.
+// The remaining arena space is used to deepen the pipeline. Must be called after
+// numStages is set and before bufferFIFO_start()
+//
+void bufferFIFO_configure(struct bufferFIFO *bf, int transferLen)
+{
+	int depth = bf->numStages;
+	for (int i = 1; i < (bf->numStages - 1); i++) {
+		if (!bf->inPlace[i])
+			depth++;
+	}
+	int bufferSize = BUFFER_FIFO_MAX_BUFFER_SIZE;
+	while (bufferSize > BUFFER_FIFO_MIN_BUFFER_SIZE && (bufferSize * depth) > bf->arenaSize)
+		bufferSize >>= 1;
+	while (bufferSize > BUFFER_FIFO_MIN_BUFFER_SIZE && (bufferSize * depth) > transferLen)
+		bufferSize >>= 1;
+	bf->maxBufferSize = bufferSize;
+	bf->bufferCount = bf->arenaSize / bufferSize;
+	if (bf->bufferCount > BUFFER_FIFO_MAX_BUFFERS)
+		bf->bufferCount = BUFFER_FIFO_MAX_BUFFERS;
 }
 
 void bufferFIFO_start(struct bufferFIFO *bf, int firstBufferSize)
 {
-	__disable_irq();
 	bf->_processing = 1;
 	bf->_stall_index = 0;
 	for (int i = 0; i < bf->bufferCount; i++) {
 		bf->_bufferSize[i] = 0;
 	}
-	for (int i = 0; i < bf->numStages; i++) {
+	//
+	// Work back from the last stage. Each intermediate stage writes to the buffer
+	// the next stage reads. A stage that isn't in-place reads from the buffer after
+	// that one, while an in-place stage reads and writes the same buffer.
+	//
+	int idx = 0;
+	for (int i = bf->numStages - 1; i >= 0; i--) {
 		bf->_stageProcessing[i] = 0;
 		bf->_stalled[i] = 0;
-		if (bf->numStages > 2) {
-			if (i == 0) {
-				bf->_stageReadIndex[i] = bf->numStages - 2;
-				bf->_stageWriteIndex[i] = bf->numStages - 2;
-			} else if (i == (bf->numStages - 1)) {
-				bf->_stageReadIndex[i] = 0;
-				bf->_stageWriteIndex[i] = 0;
-			} else {
-				bf->_stageReadIndex[i] = bf->numStages - 2 - i + 1;
-				bf->_stageWriteIndex[i] = bf->numStages - 2 - i;
-			}
-		} else if (bf->numStages == 2) {
-			bf->_stageReadIndex[i] = 0;
-			bf->_stageWriteIndex[i] = 0;
-		}
+		bf->_stageWriteIndex[i] = idx;
+		if (i != 0 && i != (bf->numStages - 1) && !bf->inPlace[i])
+			idx++;
+		bf->_stageReadIndex[i] = idx;
 	}
 	bf->_bufferSize[bf->_stageWriteIndex[0]] = firstBufferSize;
-	bufferFIFO_execStage(bf, 0);
-	__enable_irq();
+	__DMB();
+	BEGIN_WORK(BUFFER_FIFO_WORK);
 }
 
 
@@ -5,28 +5,39 @@
 #define BUFFER_FIFO_MAX_STAGES 4
 #define BUFFER_FIFO_MAX_BUFFERS 16
 
+//Range of buffer sizes bufferFIFO_configure() will split the arena into
+#define BUFFER_FIFO_MIN_BUFFER_SIZE (1<<12)
+#define BUFFER_FIFO_MAX_BUFFER_SIZE (1<<16)
+
 struct bufferFIFO {
-	int maxBufferSize;
-	int bufferCount;
+	int maxBufferSize; //Size of each buffer for the current transfer
+	int bufferCount; //Number of buffers for the current transfer
+	int arenaSize;
 	uint8_t *bufferStorage;
 	int numStages;
 	void ((*processStage[BUFFER_FIFO_MAX_STAGES])(struct bufferFIFO *bf, int readSize, u32 readData, const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx));
 
+	int inPlace[BUFFER_FIFO_MAX_STAGES]; //Stage writes its output back into the buffer it reads
+
 	void (*processingComplete)(struct bufferFIFO *bf);
+	u32 stallCount[BUFFER_FIFO_MAX_STAGES]; //Times each stage was left waiting on a neighbouring stage
 	int _bufferSize[BUFFER_FIFO_MAX_BUFFERS];
 	u32 _bufferData[BUFFER_FIFO_MAX_BUFFERS];
 
-	int _stageWriteIndex[BUFFER_FIFO_MAX_STAGES];
-	int _stageReadIndex[BUFFER_FIFO_MAX_STAGES];
+	volatile int _stageWriteIndex[BUFFER_FIFO_MAX_STAGES];
+	volatile int _stageReadIndex[BUFFER_FIFO_MAX_STAGES];
 
-	int _stalled[BUFFER_FIFO_MAX_STAGES];
-	int _stageProcessing[BUFFER_FIFO_MAX_STAGES];
+	volatile int _stalled[BUFFER_FIFO_MAX_STAGES];
+	volatile int _stageProcessing[BUFFER_FIFO_MAX_STAGES];
 	int _processing;
 	int _stall_index;
 };
 
 void bufferFIFO_processingComplete(struct bufferFIFO *bf, int stageIdx, int writeLen, u32 bufferData);
+void bufferFIFO_configure(struct bufferFIFO *bf, int transferLen);
 void bufferFIFO_start(struct bufferFIFO *bf, int firstBufferSize);
 void bufferFIFO_stallStage(struct bufferFIFO *bf, int stageIdx);
+int bufferFIFO_idle_ready(struct bufferFIFO *bf);
+void bufferFIFO_idle(struct bufferFIFO *bf);
 
 #endif
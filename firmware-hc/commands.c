@@ -27,6 +27,8 @@
 #endif
 
 #include "usbd_hid.h"
+#include "usb_raw_hid.h"
+#include "usbd_cmd_bulk.h"
 
 //
 // Globals
@@ -51,13 +53,13 @@ enum root_block_sync_state g_root_block_sync_state = ROOT_BLOCK_SYNCED;
 
 enum device_state g_device_state = DS_DISCONNECTED;
 
-static enum command_subsystem s_device_system_owner = NO_SUBSYSTEM;
-static int s_ctap_subsystem_waiting = 0;
-static int s_signet_subsystem_waiting = 0;
-static int s_subsystem_release_requested = 1;
+static enum command_subsystem s_resource_owner[NUM_RESOURCES] = {[0 ... NUM_RESOURCES - 1] = NO_SUBSYSTEM};
+static int s_resources_wanted[NO_SUBSYSTEM];
+static int s_root_page_release_requested = 0;
 
 // Incoming buffer for next command request
-u8 cmd_packet_buf[CMD_PACKET_BUF_SIZE] __attribute__((aligned(16)));
+u8 cmd_packet_buf[CMD_PACKET_BUF_SIZE] __attribute__((aligned(32)));
+enum cmd_transport g_cmd_transport = CMD_TRANSPORT_HID;
 
 //Paramaters and temporary state for the command currently being
 //executed
@@ -100,28 +102,72 @@ extern MMC_HandleTypeDef hmmc1;
 
 volatile enum emmc_user g_emmc_user = EMMC_USER_NONE;
 
+//
+// eMMC request scheduling. Each user has at most one request pending, since its state
+// lives in that user's globals. The user with the highest priority class runs next
+// unless another user has waited longer than its deadline, in which case the user
+// that has waited longest runs first. This lets DB reads run ahead of a bulk storage
+// transfer without starving it. The SDMMC has no busy end interrupt so a card that
+// is still programming is polled with CMD13 from the main loop.
+//
+struct emmc_user_policy g_emmc_user_policy[EMMC_NUM_USER] = {
+	[EMMC_USER_STORAGE] = {.priority = 1, .max_wait_ms = 20},
+	[EMMC_USER_DB] = {.priority = 2, .max_wait_ms = 0},
+	[EMMC_USER_TEST] = {.priority = 0, .max_wait_ms = 0},
+#if ENABLE_MMC_STANDBY
+	[EMMC_USER_STANDBY] = {.priority = -1, .max_wait_ms = 0},
+#endif
+};
+
 int g_emmc_user_ready[EMMC_NUM_USER];
+static u32 g_emmc_user_queued_ms[EMMC_NUM_USER];
+static int g_emmc_card_busy = 0;
 
 enum db_action {
 	DB_ACTION_NONE,
 	DB_ACTION_READ,
-	DB_ACTION_WRITE
+	DB_ACTION_WRITE,
+	DB_ACTION_TRIM,
+	DB_ACTION_SANITIZE,
+	DB_ACTION_STATUS
 };
 
 static enum db_action g_db_action = DB_ACTION_NONE;
 
-static int g_db_read_idx;
+static u32 g_db_read_addr;
 static u8 *g_db_read_dest;
 
-static int g_db_write_idx;
+static u32 g_db_write_addr;
 static const u8 *g_db_write_src;
+static int g_db_write_count; //Number of consecutive blocks to fill with g_db_write_src
+
+//Keeps a single transfer's data length below the SDMMC's 32MB DLEN limit
+#define DB_WRITE_MAX_BLOCKS (1024)
+
+static u32 g_db_trim_start;
+static u32 g_db_trim_end;
+static int g_db_trim_status;
+
+//CMD6 argument writing 1 to EXT_CSD[165] SANITIZE_START
+#define EMMC_SANITIZE_START_ARG ((0x3 << 24) | (165 << 16) | (1 << 8))
+
+//Card status bit set when the previous CMD6 was refused or failed
+#define EMMC_R1_SWITCH_ERROR (1 << 7)
 
 #include "usbd_msc_scsi.h"
 #include "usbd_msc.h"
+#include "buffer_manager.h"
+
+extern struct bufferFIFO usbBulkBufferFIFO;
 
 void emmc_user_storage_start();
 
 static void read_block_complete();
+#ifdef BOOT_MODE_B
+static void read_blocks_block_ready();
+static void read_block_crcs_iter();
+static void write_block_verify_read_complete();
+#endif
 static void write_block_complete();
 
 void startup_cmd_iter();
@@ -133,45 +179,68 @@ u32 compute_device_data_crc(struct hc_device_data *d);
 void emmc_user_write_storage_tx_dma_complete(MMC_HandleTypeDef *hmmc);
 void emmc_user_write_db_tx_dma_complete(MMC_HandleTypeDef *hmmc);
 
-static void release_device(enum command_subsystem system);
+static void grant_waiting_resources(enum command_subsystem released_by);
 
 extern MMC_HandleTypeDef hmmc1;
 
 static void subsystem_idle_check()
 {
 	if (active_cmd == -1 && n_progress_components == 0) {
-		release_device_request(SIGNET_SUBSYSTEM);
+		release_resources(SIGNET_SUBSYSTEM, ALL_RESOURCES);
 	}
 }
 
 void emmc_user_db_start()
 {
-	HAL_MMC_CardStateTypeDef cardState;
+	//
+	// Trim and sanitize complete as soon as the card accepts the command. The
+	// card then stays busy until it's done, which emmc_user_schedule() waits out
+	//
+	switch (g_db_action) {
+	case DB_ACTION_TRIM:
+		g_db_trim_status = HAL_MMC_EraseType(&hmmc1, g_db_trim_start, g_db_trim_end, MMC_TRIM);
+		g_write_db_tx_complete = 1;
+		BEGIN_WORK(WRITE_DB_TX_WORK);
+		return;
+	case DB_ACTION_SANITIZE:
+		g_db_trim_status = (SDMMC_CmdSwitch(hmmc1.Instance, EMMC_SANITIZE_START_ARG) == SDMMC_ERROR_NONE) ? HAL_OK : HAL_ERROR;
+		g_write_db_tx_complete = 1;
+		BEGIN_WORK(WRITE_DB_TX_WORK);
+		return;
+	case DB_ACTION_STATUS:
+		//Only runs once the card is out of the busy state of the previous command
+		if (SDMMC_CmdSendStatus(hmmc1.Instance, hmmc1.MmcCard.RelCardAdd << 16) != SDMMC_ERROR_NONE ||
+			(SDMMC_GetResponse(hmmc1.Instance, SDMMC_RESP1) & EMMC_R1_SWITCH_ERROR)) {
+			g_db_trim_status = HAL_ERROR;
+		} else {
+			g_db_trim_status = HAL_OK;
+		}
+		g_write_db_tx_complete = 1;
+		BEGIN_WORK(WRITE_DB_TX_WORK);
+		return;
+	default:
+		break;
+	}
+	trace_begin(HC_TRACE_SPAN_EMMC_DMA);
 	switch (g_db_action) {
 	case DB_ACTION_READ: {
-		int idx = g_db_read_idx;
 		u8 *dest = g_db_read_dest;
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
+		//Drop any dirty lines now so they aren't evicted over the DMA data
+		dcache_clean_invalidate(dest, BLK_SIZE);
 		HAL_MMC_ReadBlocks_DMA(&hmmc1,
 		                       dest,
-				       (idx - MIN_DATA_BLOCK + EMMC_DB_FIRST_BLOCK)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ),
+				       g_db_read_addr,
 		                       BLK_SIZE/MSC_MEDIA_PACKET);
 	}
 	break;
 	case DB_ACTION_WRITE: {
-		int idx = g_db_write_idx;
 		const u8 *src = g_db_write_src;
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
-
+		dcache_clean(src, BLK_SIZE);
 		HAL_MMC_WriteBlocks_DMA_Initial(&hmmc1,
 		                                src,
 		                                BLK_SIZE,
-						(idx - MIN_DATA_BLOCK + EMMC_DB_FIRST_BLOCK)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ),
-						BLK_SIZE/MSC_MEDIA_PACKET);
+						g_db_write_addr,
+						g_db_write_count*(BLK_SIZE/MSC_MEDIA_PACKET));
 	}
 	break;
 	default:
@@ -181,14 +250,21 @@ void emmc_user_db_start()
 
 int command_idle_ready()
 {
-	return g_read_db_tx_complete | g_write_db_tx_complete | g_mmc_tx_cplt | g_mmc_tx_dma_cplt | g_mmc_rx_cplt;
+	return g_read_db_tx_complete | g_write_db_tx_complete | g_mmc_tx_cplt | g_mmc_tx_dma_cplt | g_mmc_rx_cplt | g_emmc_card_busy;
 }
 
+static void emmc_user_schedule();
+
 volatile int g_write_test_tx_complete = 0;
 volatile int g_read_test_tx_complete = 0;
 
 void command_idle()
 {
+	if (g_emmc_card_busy) {
+		g_emmc_card_busy = 0;
+		END_WORK(MMC_CARD_BUSY_WORK);
+		emmc_user_schedule();
+	}
 	if (g_read_db_tx_complete) {
 		g_read_db_tx_complete = 0;
 		END_WORK(READ_DB_TX_CPLT_WORK);
@@ -199,7 +275,12 @@ void command_idle()
 		g_write_db_tx_complete = 0;
 		END_WORK(WRITE_DB_TX_WORK);
 		emmc_user_done();
-		write_block_complete();
+		//Flash completions also end in write_block_complete() so staging writes are caught here
+		if (g_device_state == DS_FIRMWARE_UPDATE && firmware_stage_write_complete()) {
+			trace_end(HC_TRACE_SPAN_DB_WRITE_BLOCK);
+		} else {
+			write_block_complete();
+		}
 	}
 	if (g_mmc_tx_cplt) {
 		g_mmc_tx_cplt = 0;
@@ -244,6 +325,7 @@ void command_idle()
 			emmc_user_read_storage_rx_complete();
 			break;
 		case EMMC_USER_DB:
+			dcache_invalidate(g_db_read_dest, BLK_SIZE);
 			g_read_db_tx_complete = 1;
 			BEGIN_WORK(READ_DB_TX_CPLT_WORK);
 			break;
@@ -268,6 +350,59 @@ static void emmc_user_standby_end()
 }
 #endif
 
+struct hc_io_stats g_io_stats;
+static u32 s_io_stats_reset_ms;
+
+void io_stats_reset()
+{
+	memset(&g_io_stats, 0, sizeof(g_io_stats));
+	memset(usbBulkBufferFIFO.stallCount, 0, sizeof(usbBulkBufferFIFO.stallCount));
+	s_io_stats_reset_ms = HAL_GetTick();
+}
+
+static void io_stats_emmc_wait(enum emmc_user user, u32 wait_ms)
+{
+	struct hc_emmc_wait_stats *st;
+	switch (user) {
+	case EMMC_USER_STORAGE:
+		st = &g_io_stats.emmc_storage_wait;
+		break;
+	case EMMC_USER_DB:
+		st = &g_io_stats.emmc_db_wait;
+		break;
+	default:
+		return;
+	}
+	st->count++;
+	st->total_ms += wait_ms;
+	if (wait_ms > st->max_ms)
+		st->max_ms = wait_ms;
+}
+
+static enum emmc_user emmc_user_next()
+{
+	u32 now = HAL_GetTick();
+	enum emmc_user next = EMMC_USER_NONE;
+	u32 next_wait = 0;
+	int next_overdue = 0;
+	for (int user = EMMC_USER_NONE + 1; user < EMMC_NUM_USER; user++) {
+		if (!g_emmc_user_ready[user])
+			continue;
+		const struct emmc_user_policy *policy = g_emmc_user_policy + user;
+		u32 wait = now - g_emmc_user_queued_ms[user];
+		int overdue = policy->max_wait_ms && wait >= policy->max_wait_ms;
+		if (next == EMMC_USER_NONE ||
+			(overdue && !next_overdue) ||
+			(overdue && next_overdue && wait > next_wait) ||
+			(!overdue && !next_overdue && policy->priority > g_emmc_user_policy[next].priority)) {
+			next = user;
+			next_wait = wait;
+			next_overdue = overdue;
+		}
+	}
+	return next;
+}
+
 static void emmc_user_schedule()
 {
 #if ENABLE_MMC_STANDBY
@@ -277,30 +412,43 @@ static void emmc_user_schedule()
 		return;
 	}
 #endif
-	if (g_emmc_user == EMMC_USER_NONE) {
+	if (g_emmc_user != EMMC_USER_NONE || g_emmc_card_busy)
+		return;
 #if ENABLE_MMC_STANDBY
-		g_emmc_idle_ms = HAL_GetTick();
-		BEGIN_WORK(MMC_IDLE_WORK);
+	g_emmc_idle_ms = HAL_GetTick();
+	BEGIN_WORK(MMC_IDLE_WORK);
 #endif
-		if (g_emmc_user_ready[EMMC_USER_DB]) {
-			g_emmc_user = EMMC_USER_DB;
-			g_emmc_user_ready[g_emmc_user] = 0;
-			emmc_user_db_start();
-		} else if (g_emmc_user_ready[EMMC_USER_STORAGE]) {
-			g_emmc_user = EMMC_USER_STORAGE;
-			g_emmc_user_ready[g_emmc_user] = 0;
-			emmc_user_storage_start();
-		} else if (g_emmc_user_ready[EMMC_USER_TEST]) {
-			g_emmc_user = EMMC_USER_TEST;
-			g_emmc_user_ready[g_emmc_user] = 0;
-		}
+	enum emmc_user user = emmc_user_next();
+	if (user == EMMC_USER_NONE)
+		return;
+
+	//
+	// The card stays busy after a write while it programs the data. Rather than
+	// spinning here, retry from the main loop so other work can run meanwhile
+	//
+	if (user != EMMC_USER_TEST && HAL_MMC_GetCardState(&hmmc1) != HAL_MMC_CARD_TRANSFER) {
+		g_emmc_card_busy = 1;
+		BEGIN_WORK(MMC_CARD_BUSY_WORK);
+		return;
+	}
+	g_emmc_user = user;
+	g_emmc_user_ready[user] = 0;
+	io_stats_emmc_wait(user, HAL_GetTick() - g_emmc_user_queued_ms[user]);
+	g_emmc_user_queued_ms[user] = HAL_GetTick();
+	switch (user) {
+	case EMMC_USER_DB:
+		emmc_user_db_start();
+		break;
+	case EMMC_USER_STORAGE:
+		emmc_user_storage_start();
+		break;
 #if ENABLE_MMC_STANDBY
-		else if (g_emmc_user_ready[EMMC_USER_STANDBY]) {
-			g_emmc_user = EMMC_USER_STANDBY;
-			g_emmc_user_ready[EMMC_USER_STANDBY] = 0;
-			emmc_user_standby_start();
-		}
+	case EMMC_USER_STANDBY:
+		emmc_user_standby_start();
+		break;
 #endif
+	default:
+		break;
 	}
 }
 
@@ -312,48 +460,262 @@ void emmc_user_done()
 
 void emmc_user_queue(enum emmc_user user)
 {
+	//Each user keeps the state of its one outstanding request in globals
 	assert(!g_emmc_user_ready[user]);
 	g_emmc_user_ready[user] = 1;
+	g_emmc_user_queued_ms[user] = HAL_GetTick();
 	emmc_user_schedule();
 }
 
 void read_data_block (int idx, u8 *dest)
 {
+	trace_begin(HC_TRACE_SPAN_DB_READ_BLOCK);
 	if (idx == ROOT_DATA_BLOCK) {
 		memcpy(dest, (u8 *)_root_page, BLK_SIZE);
 		read_block_complete();
 	} else {
 		g_db_action = DB_ACTION_READ;
-		g_db_read_idx = idx;
+		g_db_read_addr = (idx - MIN_DATA_BLOCK + EMMC_DB_FIRST_BLOCK)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
 		g_db_read_dest = dest;
 		emmc_user_queue(EMMC_USER_DB);
 	}
 }
 
+//Blocks of the firmware update area ahead of the DB. Completion is the same as for data blocks
+void read_firmware_stage_block (int idx, u8 *dest)
+{
+	trace_begin(HC_TRACE_SPAN_DB_READ_BLOCK);
+	g_db_action = DB_ACTION_READ;
+	g_db_read_addr = (EMMC_DB_FIRMWARE_UPDATE_BLOCK + idx)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
+	g_db_read_dest = dest;
+	emmc_user_queue(EMMC_USER_DB);
+}
+
+void write_firmware_stage_block (int idx, const u8 *src)
+{
+	trace_begin(HC_TRACE_SPAN_DB_WRITE_BLOCK);
+	g_db_action = DB_ACTION_WRITE;
+	g_db_write_addr = (EMMC_DB_FIRMWARE_UPDATE_BLOCK + idx)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
+	g_db_write_src = src;
+	g_db_write_count = 1;
+	emmc_user_queue(EMMC_USER_DB);
+}
+
 void write_data_block (int idx, const u8 *src)
 {
+	write_data_blocks(idx, 1, src);
+}
+
+//
+// Writes the same block of data to 'count' consecutive data blocks starting
+// at 'idx' as a single multi-block transfer. The DMA is restarted on 'src'
+// for each block so only one block of memory is needed.
+//
+void write_data_blocks (int idx, int count, const u8 *src)
+{
+	trace_begin(HC_TRACE_SPAN_DB_WRITE_BLOCK);
 #ifdef BOOT_MODE_B
-	invalidate_data_block_cache(idx);
+	for (int i = idx; i < (idx + count); i++) {
+		invalidate_data_block_cache(i);
+	}
 #endif
 	if (idx == ROOT_DATA_BLOCK) {
 		write_root_block(src, BLK_SIZE);
 	} else {
 		g_db_action = DB_ACTION_WRITE;
-		g_db_write_idx = idx;
+		g_db_write_addr = (idx - MIN_DATA_BLOCK + EMMC_DB_FIRST_BLOCK)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
 		g_db_write_src = src;
+		g_db_write_count = count;
 		emmc_user_queue(EMMC_USER_DB);
 	}
 }
 
+#ifdef BOOT_MODE_B
+//
+// Wipes every eMMC sector from the start of the DB to the end of the card in
+// STORAGE_REGION_SIZE steps. Each step is trimmed. If the card refuses then
+// the rest is overwritten with zeros using multi-block writes. After trimming
+// the card is asked to sanitize so the trimmed data is physically purged. If
+// it can't then the whole area is zero filled and the host is told the wipe
+// wasn't a purge.
+//
+#define WIPE_STEP_SECTORS (STORAGE_REGION_SIZE/EMMC_SUB_BLOCK_SZ)
+
+enum wipe_phase {
+	WIPE_ROOT_BLOCK,
+	WIPE_TRIM,
+	WIPE_ZERO_FILL,
+	WIPE_SANITIZE,
+	WIPE_SANITIZE_STATUS
+};
+
+//Number of blocks the next zero fill write covers
+static int wipe_fill_count()
+{
+	u32 n = (cmd_data.wipe_data.step_end - cmd_data.wipe_data.sector)/(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
+	return (n > DB_WRITE_MAX_BLOCKS) ? DB_WRITE_MAX_BLOCKS : n;
+}
+
+static void wipe_issue()
+{
+	trace_begin(HC_TRACE_SPAN_DB_WRITE_BLOCK);
+	switch (cmd_data.wipe_data.phase) {
+	case WIPE_TRIM:
+		g_db_action = DB_ACTION_TRIM;
+		g_db_trim_start = cmd_data.wipe_data.sector;
+		g_db_trim_end = cmd_data.wipe_data.step_end - 1;
+		break;
+	case WIPE_ZERO_FILL:
+		g_db_action = DB_ACTION_WRITE;
+		g_db_write_addr = cmd_data.wipe_data.sector;
+		g_db_write_src = cmd_data.wipe_data.block;
+		g_db_write_count = wipe_fill_count();
+		break;
+	case WIPE_SANITIZE:
+		g_db_action = DB_ACTION_SANITIZE;
+		break;
+	case WIPE_SANITIZE_STATUS:
+		g_db_action = DB_ACTION_STATUS;
+		break;
+	default:
+		return;
+	}
+	emmc_user_queue(EMMC_USER_DB);
+}
+
+static void wipe_done()
+{
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		invalidate_data_block_cache(i);
+	}
+	g_progress_level[0] = progress_maximum[0];
+	get_progress_check();
+	g_uninitialized_wiped = 1;
+	enter_state(DS_UNINITIALIZED);
+	usbd_scsi_storage_wiped();
+	if (cmd_data.wipe_data.not_purged) {
+		cmd_event_send(HC_EVENT_WIPE_NOT_PURGED, NULL, 0);
+	}
+}
+
+static u32 wipe_first_sector()
+{
+	return EMMC_DB_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
+}
+
+static u32 wipe_n_steps()
+{
+	u32 n_sectors = cmd_data.wipe_data.end_sector - wipe_first_sector();
+	return (n_sectors + WIPE_STEP_SECTORS - 1)/WIPE_STEP_SECTORS;
+}
+
+static void wipe_next_step()
+{
+	if (cmd_data.wipe_data.sector >= cmd_data.wipe_data.end_sector) {
+		//Regions trimmed before a zero fill took over still need purging
+		if (!cmd_data.wipe_data.not_purged) {
+			cmd_data.wipe_data.phase = WIPE_SANITIZE;
+			wipe_issue();
+		} else {
+			wipe_done();
+		}
+		return;
+	}
+	cmd_data.wipe_data.step_end = cmd_data.wipe_data.sector + WIPE_STEP_SECTORS;
+	if (cmd_data.wipe_data.step_end > cmd_data.wipe_data.end_sector)
+		cmd_data.wipe_data.step_end = cmd_data.wipe_data.end_sector;
+	wipe_issue();
+}
+
+//The card can't sanitize. Overwrite everything that was trimmed instead
+static void wipe_sanitize_failed()
+{
+	cmd_data.wipe_data.not_purged = 1;
+	cmd_data.wipe_data.phase = WIPE_ZERO_FILL;
+	cmd_data.wipe_data.sector = wipe_first_sector();
+	progress_maximum[0] += wipe_n_steps();
+	get_progress_check();
+	wipe_next_step();
+}
+
+static void wipe_begin()
+{
+	u32 sectors_per_block = HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ;
+	cmd_data.wipe_data.phase = WIPE_ROOT_BLOCK;
+	cmd_data.wipe_data.sector = wipe_first_sector();
+	cmd_data.wipe_data.end_sector = hmmc1.MmcCard.BlockNbr & ~(sectors_per_block - 1);
+	cmd_data.wipe_data.step_end = cmd_data.wipe_data.sector;
+	cmd_data.wipe_data.not_purged = 0;
+	memset(cmd_data.wipe_data.block, 0, BLK_SIZE);
+
+	//One step per region plus the sanitize. Entering DS_WIPING hides every volume
+	int temp[] = {wipe_n_steps() + 1};
+	enter_progressing_state(DS_WIPING, 1, temp);
+	write_data_block(ROOT_DATA_BLOCK, cmd_data.wipe_data.block);
+}
+
+static void wipe_iter()
+{
+	switch (cmd_data.wipe_data.phase) {
+	case WIPE_ROOT_BLOCK:
+		cmd_data.wipe_data.phase = WIPE_TRIM;
+		wipe_next_step();
+		break;
+	case WIPE_TRIM:
+		if (g_db_trim_status != HAL_OK) {
+			cmd_data.wipe_data.phase = WIPE_ZERO_FILL;
+			wipe_issue();
+		} else {
+			cmd_data.wipe_data.sector = cmd_data.wipe_data.step_end;
+			g_progress_level[0]++;
+			get_progress_check();
+			wipe_next_step();
+		}
+		break;
+	case WIPE_ZERO_FILL:
+		cmd_data.wipe_data.sector += wipe_fill_count() * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ);
+		if (cmd_data.wipe_data.sector < cmd_data.wipe_data.step_end) {
+			wipe_issue();
+		} else {
+			g_progress_level[0]++;
+			get_progress_check();
+			wipe_next_step();
+		}
+		break;
+	case WIPE_SANITIZE:
+		if (g_db_trim_status != HAL_OK) {
+			wipe_sanitize_failed();
+		} else {
+			cmd_data.wipe_data.phase = WIPE_SANITIZE_STATUS;
+			wipe_issue();
+		}
+		break;
+	case WIPE_SANITIZE_STATUS:
+		if (g_db_trim_status != HAL_OK) {
+			wipe_sanitize_failed();
+		} else {
+			wipe_done();
+		}
+		break;
+	}
+}
+#endif
+
 void HAL_MMC_RxCpltCallback(MMC_HandleTypeDef *hmmc1)
 {
+	trace_end(HC_TRACE_SPAN_EMMC_DMA);
 	g_mmc_rx_cplt = 1;
 	BEGIN_WORK(MMC_RX_CPLT_WORK);
 }
 
 void emmc_user_write_db_tx_dma_complete(MMC_HandleTypeDef *hmmc)
 {
-	HAL_MMC_WriteBlocks_DMA_Cont(&hmmc1, NULL, 0);
+	g_db_write_count--;
+	if (g_db_write_count > 0) {
+		HAL_MMC_WriteBlocks_DMA_Cont(&hmmc1, g_db_write_src, BLK_SIZE);
+	} else {
+		HAL_MMC_WriteBlocks_DMA_Cont(&hmmc1, NULL, 0);
+	}
 }
 
 void MMC_DMATXTransmitComplete(MMC_HandleTypeDef *hmmc)
@@ -376,6 +738,7 @@ void HAL_MMC_AbortCallback(MMC_HandleTypeDef *hmmc)
 
 void HAL_MMC_TxCpltCallback(MMC_HandleTypeDef *hmmc1)
 {
+	trace_end(HC_TRACE_SPAN_EMMC_DMA);
 	g_mmc_tx_cplt = 1;
 	BEGIN_WORK(MMC_TX_CPLT_WORK);
 }
@@ -431,8 +794,13 @@ void delete_cmd_complete();
 void get_data_cmd_complete();
 void set_data_cmd_complete();
 void initialize_cmd_complete();
+void volume_cmd_complete();
 void enter_progressing_state (enum device_state state, int _n_progress_components, int *_progress_maximum)
 {
+	if (state != g_device_state && state != DS_DISCONNECTED) {
+		u8 state_byte = state;
+		cmd_event_send(HC_EVENT_STATE_CHANGED, &state_byte, 1);
+	}
 	g_device_state = state;
 	usbd_scsi_device_state_change(g_device_state);
 	g_progress_check = 0;
@@ -451,28 +819,36 @@ void enter_state (enum device_state state)
 	enter_progressing_state(state, 0, NULL);
 }
 
+//
+// Commands that only need the DB don't take the button until they wait for a
+// press. If another subsystem has it the wait starts once it is granted
+//
 void begin_button_press_wait()
 {
 	waiting_for_button_press = 1;
-	start_blinking(500, 10000);
+	if (request_resources(SIGNET_SUBSYSTEM, RESOURCE_MASK(RESOURCE_BUTTON)))
+		start_blinking(500, 10000);
 }
 
 void begin_long_button_press_wait()
 {
 	waiting_for_long_button_press = 1;
-	start_blinking(1000, 10000);
+	if (request_resources(SIGNET_SUBSYSTEM, RESOURCE_MASK(RESOURCE_BUTTON)))
+		start_blinking(1000, 10000);
 }
 
 void end_button_press_wait()
 {
 	waiting_for_button_press = 0;
-	stop_blinking();
+	if (s_resource_owner[RESOURCE_BUTTON] == SIGNET_SUBSYSTEM)
+		stop_blinking();
 }
 
 void end_long_button_press_wait()
 {
 	waiting_for_long_button_press = 0;
-	stop_blinking();
+	if (s_resource_owner[RESOURCE_BUTTON] == SIGNET_SUBSYSTEM)
+		stop_blinking();
 }
 
 int get_total_progress()
@@ -522,24 +898,52 @@ void get_progress_check ()
 	}
 }
 
-u8 cmd_resp[CMD_PACKET_BUF_SIZE] __attribute__((aligned(16)));
+//Large enough to hold any response in raw HID packet layout
+#define CMD_RESP_BUF_SIZE (((CMD_PACKET_BUF_SIZE + RAW_HID_PAYLOAD_SIZE - 1) / RAW_HID_PAYLOAD_SIZE) * RAW_HID_PACKET_SIZE)
+u8 cmd_resp[CMD_RESP_BUF_SIZE] __attribute__((aligned(16)));
+static int s_cmd_resp_sending = 0;
+
+//Responses to commands answered while the active command waits for a button
+static u8 s_side_resp[CMD_PACKET_HEADER_SIZE + CMD_PACKET_TAG_SIZE + sizeof(struct hc_io_stats)] __attribute__((aligned(16)));
+static int s_side_resp_sending = 0;
+
+//Tag of the active command or zero if the host didn't tag it
+static int s_cmd_tag = 0;
 
 void finish_command_multi (enum command_responses resp, int messages_remaining, const u8 *payload, int payload_len)
 {
-	int full_length = payload_len + CMD_PACKET_HEADER_SIZE;
-	cmd_resp[0] = full_length & 0xff;
-	cmd_resp[1] = (full_length >> 8) & 0xff;
-	cmd_resp[2] = resp;
-	cmd_resp[3] = messages_remaining & 0xff;
-	cmd_resp[4] = (messages_remaining >> 8) & 0xff;
-	cmd_resp[5] = g_device_state;
-	if (payload) {
-		memcpy(cmd_resp + CMD_PACKET_HEADER_SIZE, payload, payload_len);
-	}
+	u8 header[CMD_PACKET_HEADER_SIZE + CMD_PACKET_TAG_SIZE];
+	int header_size = CMD_PACKET_HEADER_SIZE;
+	if (s_cmd_tag) {
+		header_size += CMD_PACKET_TAG_SIZE;
+		resp |= CMD_RESP_TAGGED;
+		header[CMD_PACKET_HEADER_SIZE] = s_cmd_tag;
+	}
+	int full_length = payload_len + header_size;
+	header[0] = full_length & 0xff;
+	header[1] = (full_length >> 8) & 0xff;
+	header[2] = resp;
+	header[3] = messages_remaining & 0xff;
+	header[4] = (messages_remaining >> 8) & 0xff;
+	header[5] = g_device_state;
 	if (!messages_remaining && !cmd_messages_remaining) {
 		active_cmd = -1;
 	}
-	cmd_packet_send(cmd_resp, full_length);
+	s_cmd_resp_sending = 1;
+	if (g_cmd_transport == CMD_TRANSPORT_HID) {
+		//Build the response in packet layout so it's sent without a copy
+		raw_hid_packed_write(cmd_resp, 0, header, header_size);
+		if (payload) {
+			raw_hid_packed_write(cmd_resp, header_size, payload, payload_len);
+		}
+		cmd_packet_send_packed(cmd_resp, full_length);
+	} else {
+		memcpy(cmd_resp, header, header_size);
+		if (payload) {
+			memcpy(cmd_resp + header_size, payload, payload_len);
+		}
+		cmd_packet_send(cmd_resp, full_length);
+	}
 	subsystem_idle_check();
 }
 
@@ -686,6 +1090,7 @@ extern int block_read_cache_updating;
 
 static void read_block_complete()
 {
+	trace_end(HC_TRACE_SPAN_DB_READ_BLOCK);
 #ifdef BOOT_MODE_B
 	if (db3_read_block_complete())
 		return;
@@ -694,63 +1099,85 @@ static void read_block_complete()
 	case READ_BLOCK_HC:
 		finish_command(OKAY, cmd_data.read_block.block, BLK_SIZE);
 		return;
+	case FLASH_STAGED_FIRMWARE_HC:
+		flash_staged_read_complete();
+		return;
+#ifdef BOOT_MODE_B
+	case READ_BLOCKS_HC:
+		read_blocks_block_ready();
+		return;
+	case READ_BLOCK_CRCS_HC:
+		read_block_crcs_iter();
+		return;
+	case WRITE_BLOCK_VERIFY_HC:
+		write_block_verify_read_complete();
+		return;
+#endif
 	default:
 		break;
 	}
 }
 
-#ifdef BOOT_MODE_B
+//
+// Every data block starts out identical so the template prepared in
+// initialize_cmd_complete() is written INIT_WRITE_BATCH_BLOCKS at a time
+//
+#define INIT_WRITE_BATCH_BLOCKS (64)
 
+static void initializing_write_blocks()
+{
+	int n = NUM_DATA_BLOCKS - cmd_data.init_data.blocks_written;
+	if (n > INIT_WRITE_BATCH_BLOCKS) n = INIT_WRITE_BATCH_BLOCKS;
+	cmd_data.init_data.blocks_writing = n;
+	write_data_blocks(cmd_data.init_data.blocks_written + MIN_DATA_BLOCK, n, cmd_data.init_data.block);
+}
+
+#ifdef BOOT_MODE_B
 static void initializing_iter()
 {
-	cmd_data.init_data.blocks_written++;
+	cmd_data.init_data.blocks_written += cmd_data.init_data.blocks_writing;
+	cmd_data.init_data.blocks_writing = 1;
 	g_progress_level[0] = cmd_data.init_data.blocks_written;
 	if (g_progress_level[0] > progress_maximum[0]) g_progress_level[0] = progress_maximum[0];
 	g_progress_level[1] = cmd_data.init_data.random_data_gathered;
 	get_progress_check();
 
 	if (cmd_data.init_data.blocks_written < NUM_DATA_BLOCKS) {
-		struct block *blk = db3_initialize_block(cmd_data.init_data.blocks_written + MIN_DATA_BLOCK, (struct block *)cmd_data.init_data.block);
-		write_data_block(cmd_data.init_data.blocks_written + MIN_DATA_BLOCK, (u8 *)blk);
+		initializing_write_blocks();
 	} else if (cmd_data.init_data.blocks_written == NUM_DATA_BLOCKS) {
 		finalize_root_page_check();
 	} else {
 		g_root_block_version = ROOT_BLOCK_FORMAT_CURRENT;
 		g_db_version = DB_FORMAT_CURRENT;
 		g_root_page_valid = 1;
-		db3_startup_scan(cmd_data.init_data.block, &cmd_data.init_data.blk_info);
+		db3_formatted_scan(cmd_data.init_data.block);
+		enter_state(DS_LOGGED_OUT);
 	}
 }
 #endif
 
 static void write_block_complete()
 {
+	trace_end(HC_TRACE_SPAN_DB_WRITE_BLOCK);
 #ifdef BOOT_MODE_B
 	if (g_root_block_sync_state == ROOT_BLOCK_WRITING) {
 		g_root_block_sync_state = ROOT_BLOCK_SYNCED;
 		END_WORK(SYNC_ROOT_BLOCK_WORK);
-		if (s_subsystem_release_requested) {
-			s_subsystem_release_requested = 0;
-			release_device(s_device_system_owner);
+		if (s_root_page_release_requested) {
+			s_root_page_release_requested = 0;
+			release_resources(s_resource_owner[RESOURCE_ROOT_PAGE], RESOURCE_MASK(RESOURCE_ROOT_PAGE));
 		}
 	}
 	if (db3_write_block_complete())
 		return;
+#endif
+#ifdef BOOT_MODE_B
 	switch (g_device_state) {
 	case DS_INITIALIZING:
 		initializing_iter();
 		break;
 	case DS_WIPING:
-		cmd_data.wipe_data.block_idx++;
-		g_progress_level[0] = cmd_data.wipe_data.block_idx;
-		get_progress_check();
-		if (cmd_data.wipe_data.block_idx == NUM_STORAGE_BLOCKS) {
-			g_uninitialized_wiped = 1;
-			enter_state(DS_UNINITIALIZED);
-		} else {
-			memset(cmd_data.wipe_data.block, 0, BLK_SIZE);
-			write_data_block(cmd_data.wipe_data.block_idx, cmd_data.wipe_data.block);
-		}
+		wipe_iter();
 		break;
 	default:
 		break;
@@ -763,9 +1190,17 @@ static void write_block_complete()
 	case ERASE_BLOCK_HC:
 		finish_command_resp(OKAY);
 		break;
+#ifdef BOOT_MODE_B
+	case WRITE_BLOCK_VERIFY_HC:
+		read_data_block(cmd_data.write_block_verify.block_idx, cmd_data.write_block_verify.read_back);
+		break;
+#endif
 	case WRITE_FLASH:
 		write_flash_cmd_complete();
 		break;
+	case WRITE_FIRMWARE_STAGE_HC:
+		finish_command_resp(OKAY);
+		break;
 	case STARTUP:
 		startup_cmd_iter();
 		break;
@@ -797,12 +1232,48 @@ void blink_timeout()
 	}
 }
 
-void cmd_packet_sent()
+static int cmd_queue_pending();
+
+void cmd_packet_sent(const u8 *data)
 {
+	if (data == s_side_resp) {
+		s_side_resp_sending = 0;
+	}
+	if (data == cmd_resp) {
+		s_cmd_resp_sending = 0;
 #ifdef BOOT_MODE_B
-	switch(active_cmd) {
-	case READ_ALL_UIDS:
-		read_all_uids_cmd_complete();
+		switch(active_cmd) {
+		case READ_ALL_UIDS:
+			read_all_uids_cmd_complete();
+			break;
+		case READ_BLOCKS_HC:
+			BEGIN_WORK(CMD_STREAM_WORK);
+			break;
+		}
+#endif
+	}
+	if (cmd_queue_pending()) {
+		BEGIN_WORK(CMD_RX_WORK);
+	}
+	if (usbd_cmd_bulk_rx_held()) {
+		BEGIN_WORK(CMD_BULK_RX_WORK);
+	}
+}
+
+#ifdef BOOT_MODE_B
+static void read_blocks_send();
+#endif
+
+//Sends the next message of a streaming command once the previous one has gone
+void cmd_stream_idle()
+{
+	END_WORK(CMD_STREAM_WORK);
+#ifdef BOOT_MODE_B
+	switch (active_cmd) {
+	case READ_BLOCKS_HC:
+		if (cmd_data.read_blocks.block_ready && !s_cmd_resp_sending) {
+			read_blocks_send();
+		}
 		break;
 	}
 #endif
@@ -825,16 +1296,10 @@ void long_button_press()
 			update_firmware_cmd_complete();
 			break;
 #ifdef BOOT_MODE_B
-		case WIPE: {
+		case WIPE:
 			finish_command_resp(OKAY);
-			cmd_data.wipe_data.block_idx = ROOT_DATA_BLOCK;
-			memset(cmd_data.wipe_data.block, 0, BLK_SIZE);
-			write_data_block(cmd_data.wipe_data.block_idx,
-					cmd_data.wipe_data.block);
-			int temp[] = {NUM_STORAGE_BLOCKS};
-			enter_progressing_state(DS_WIPING, 1, temp);
-		}
-		break;
+			wipe_begin();
+			break;
 		case BACKUP_DEVICE:
 			finish_command_resp(OKAY);
 			state_data.backup.prev_state = g_device_state;
@@ -847,6 +1312,11 @@ void long_button_press()
 		case INITIALIZE:
 			initialize_cmd_complete();
 			break;
+		case CREATE_VOLUME:
+		case RESIZE_VOLUME:
+		case DELETE_VOLUME:
+			volume_cmd_complete();
+			break;
 		case CHANGE_MASTER_PASSWORD:
 			switch (root_page.format) {
 			case ROOT_BLOCK_FORMAT_CURRENT:
@@ -1001,7 +1471,7 @@ void button_press_unprompted()
 		//button_press_disconnected();
 		break;
 	default:
-		cmd_event_send(1, NULL, 0);
+		cmd_event_send(HC_EVENT_BUTTON_PRESS, NULL, 0);
 		break;
 	}
 }
@@ -1128,8 +1598,8 @@ void initialize_cmd_complete()
 	cmd_data.init_data.random_data_gathered = 0;
 	cmd_data.init_data.root_block_finalized = 0;
 
-	struct block *blk = db3_initialize_block(cmd_data.init_data.blocks_written + MIN_DATA_BLOCK, (struct block *)cmd_data.init_data.block);
-	write_data_block(cmd_data.init_data.blocks_written + MIN_DATA_BLOCK, (u8 *)blk);
+	db3_initialize_block(MIN_DATA_BLOCK, (struct block *)cmd_data.init_data.block);
+	initializing_write_blocks();
 	finish_command_resp(OKAY);
 	cmd_data.init_data.rand_avail_init = rand_avail();
 	cmd_data.init_data.random_data_needed = INIT_RAND_DATA_SZ/4;
@@ -1186,6 +1656,95 @@ void read_block_cmd (u8 *data, int data_len)
 	read_data_block(cmd_data.read_block.block_idx, cmd_data.read_block.block);
 }
 
+#ifdef BOOT_MODE_B
+//
+// Streams blocks back to back. The next block is read from the eMMC while the
+// previous one is being sent. Unallocated blocks aren't read at all and blocks
+// matching the CRC manifest are sent as a record without their contents.
+//
+static void read_blocks_iter()
+{
+	int idx = cmd_data.read_blocks.next_block;
+	struct hc_block_record *rec = (struct hc_block_record *)(cmd_data.read_blocks.resp + 1);
+	rec->block_idx = idx;
+	if (idx != ROOT_DATA_BLOCK && db3_block_unoccupied(idx)) {
+		rec->status = HC_BLOCK_EMPTY;
+		rec->crc = INVALID_CRC;
+		cmd_data.read_blocks.block_ready = 1;
+		BEGIN_WORK(CMD_STREAM_WORK);
+	} else {
+		rec->status = HC_BLOCK_DATA;
+		read_data_block(idx, (u8 *)(rec + 1));
+	}
+}
+
+static void read_blocks_block_ready()
+{
+	struct hc_block_record *rec = (struct hc_block_record *)(cmd_data.read_blocks.resp + 1);
+	const u8 *block = (const u8 *)(rec + 1);
+	const struct db_block_header *header = (const struct db_block_header *)block;
+	int idx = rec->block_idx;
+	if (idx == ROOT_DATA_BLOCK) {
+		rec->crc = crc_32(block, BLK_SIZE);
+	} else if (header->part_size == INVALID_PART_SIZE) {
+		rec->status = HC_BLOCK_EMPTY;
+		rec->crc = INVALID_CRC;
+	} else {
+		rec->crc = header->crc;
+	}
+	if (rec->status == HC_BLOCK_DATA && cmd_data.read_blocks.has_manifest &&
+		cmd_data.read_blocks.manifest[idx - cmd_data.read_blocks.first_block] == rec->crc) {
+		rec->status = HC_BLOCK_UNCHANGED;
+	}
+	cmd_data.read_blocks.block_ready = 1;
+	BEGIN_WORK(CMD_STREAM_WORK);
+}
+
+static void read_blocks_send()
+{
+	struct hc_block_record *rec = (struct hc_block_record *)(cmd_data.read_blocks.resp + 1);
+	int len = sizeof(*rec);
+	if (rec->status == HC_BLOCK_DATA) {
+		len += BLK_SIZE;
+	}
+	cmd_data.read_blocks.block_ready = 0;
+	cmd_data.read_blocks.next_block++;
+	int remaining = cmd_data.read_blocks.end_block - cmd_data.read_blocks.next_block;
+	finish_command_multi(OKAY, remaining, (const u8 *)rec, len);
+	if (remaining) {
+		read_blocks_iter();
+	}
+}
+
+void read_blocks_cmd(u8 *data, int data_len)
+{
+	if (data_len < 4) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	int first = data[0] + (data[1] << 8);
+	int count = data[2] + (data[3] << 8);
+	if (!count || (first + count) > NUM_STORAGE_BLOCKS) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	if (data_len == 4) {
+		cmd_data.read_blocks.has_manifest = 0;
+	} else if (data_len == (4 + count * 4)) {
+		cmd_data.read_blocks.has_manifest = 1;
+		memcpy(cmd_data.read_blocks.manifest, data + 4, count * 4);
+	} else {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	cmd_data.read_blocks.first_block = first;
+	cmd_data.read_blocks.next_block = first;
+	cmd_data.read_blocks.end_block = first + count;
+	cmd_data.read_blocks.block_ready = 0;
+	read_blocks_iter();
+}
+#endif
+
 void write_block_cmd(u8 *data, int data_len)
 {
 	if (data_len != (2 + BLK_SIZE)) {
@@ -1218,6 +1777,70 @@ void erase_block_cmd(u8 *data, int data_len)
 	write_data_block(idx, cmd_data.erase_block.block);
 }
 
+#ifdef BOOT_MODE_B
+static void read_block_crcs_iter()
+{
+	int idx = cmd_data.read_block_crcs.next_block;
+	if (idx != cmd_data.read_block_crcs.first_block) {
+		int i = idx - 1 - cmd_data.read_block_crcs.first_block;
+		cmd_data.read_block_crcs.crc[i] = crc_32(cmd_data.read_block_crcs.block, BLK_SIZE);
+	}
+	if (idx == cmd_data.read_block_crcs.end_block) {
+		int count = cmd_data.read_block_crcs.end_block - cmd_data.read_block_crcs.first_block;
+		finish_command(OKAY, (const u8 *)cmd_data.read_block_crcs.crc, count * 4);
+		return;
+	}
+	cmd_data.read_block_crcs.next_block++;
+	read_data_block(idx, cmd_data.read_block_crcs.block);
+}
+
+void read_block_crcs_cmd(u8 *data, int data_len)
+{
+	if (data_len != 4) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	int first = data[0] + (data[1] << 8);
+	int count = data[2] + (data[3] << 8);
+	if (!count || (first + count) > NUM_STORAGE_BLOCKS) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	cmd_data.read_block_crcs.first_block = first;
+	cmd_data.read_block_crcs.next_block = first;
+	cmd_data.read_block_crcs.end_block = first + count;
+	read_block_crcs_iter();
+}
+
+static void write_block_verify_read_complete()
+{
+	u32 crc = crc_32(cmd_data.write_block_verify.read_back, BLK_SIZE);
+	finish_command((crc == cmd_data.write_block_verify.crc) ? OKAY : WRITE_FAILED, (const u8 *)&crc, sizeof(crc));
+}
+
+void write_block_verify_cmd(u8 *data, int data_len)
+{
+	if (data_len != (HC_BLOCK_VERIFY_HEADER_SIZE + BLK_SIZE)) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	int idx = data[0] + (data[1] << 8);
+	if (idx >= NUM_STORAGE_BLOCKS) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	memcpy(&cmd_data.write_block_verify.crc, data + 2, sizeof(u32));
+	memcpy(cmd_data.write_block_verify.block, data + HC_BLOCK_VERIFY_HEADER_SIZE, BLK_SIZE);
+	//Don't write a block that was corrupted on the way here
+	if (crc_32(cmd_data.write_block_verify.block, BLK_SIZE) != cmd_data.write_block_verify.crc) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	cmd_data.write_block_verify.block_idx = idx;
+	write_data_block(idx, cmd_data.write_block_verify.block);
+}
+#endif
+
 void get_device_capacity_cmd(u8 *data, int data_len)
 {
 	//
@@ -1266,15 +1889,145 @@ void change_master_password_cmd(u8 *data, int data_len)
 	begin_long_button_press_wait();
 }
 
+static void cmd_queue_flush();
+
 void cmd_disconnect()
 {
 	//Cancel commands waiting for button press
 	end_button_press_wait();
 	end_long_button_press_wait();
 	active_cmd = -1;
+	cmd_queue_flush();
 	enter_state(DS_DISCONNECTED);
 }
 
+void create_volume_cmd(u8 *data, int data_len)
+{
+	if (data_len < sizeof(struct hc_volume)) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	memcpy(&cmd_data.volume.volume, data, sizeof(struct hc_volume));
+	cmd_data.volume.vol = -1;
+	for (int i = VOL_CLIENT_STORAGE; i < MAX_VOLUMES; i++) {
+		if (!(root_page.volumes[i].flags & HC_VOLUME_FLAG_VALID)) {
+			cmd_data.volume.vol = i;
+			break;
+		}
+	}
+	cmd_data.volume.n_regions = cmd_data.volume.volume.n_regions;
+	if (cmd_data.volume.vol < 0 ||
+		(cmd_data.volume.volume.flags & ~HC_VOLUME_FLAGS_SUPPORTED) ||
+		cmd_data.volume.n_regions == 0 ||
+		cmd_data.volume.n_regions > root_page.volumes[VOL_FREE_SPACE].n_regions) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	begin_long_button_press_wait();
+}
+
+void resize_volume_cmd(u8 *data, int data_len)
+{
+	if (data_len < 5) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	int vol = data[0];
+	u32 n_regions = data[1] | (data[2] << 8) | (data[3] << 16) | (data[4] << 24);
+	if (vol < VOL_PRIMARY_VIRTUAL || vol >= MAX_VOLUMES ||
+		!(root_page.volumes[vol].flags & HC_VOLUME_FLAG_VALID) ||
+		n_regions == 0 ||
+		(n_regions > root_page.volumes[vol].n_regions &&
+		 (n_regions - root_page.volumes[vol].n_regions) > root_page.volumes[VOL_FREE_SPACE].n_regions)) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	cmd_data.volume.vol = vol;
+	cmd_data.volume.n_regions = n_regions;
+	begin_long_button_press_wait();
+}
+
+void delete_volume_cmd(u8 *data, int data_len)
+{
+	if (data_len < 1) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	int vol = data[0];
+	if (vol <= VOL_PRIMARY_VIRTUAL || vol >= MAX_VOLUMES ||
+		!(root_page.volumes[vol].flags & HC_VOLUME_FLAG_VALID)) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	cmd_data.volume.vol = vol;
+	cmd_data.volume.n_regions = 0;
+	begin_long_button_press_wait();
+}
+
+void volume_cmd_complete()
+{
+	int vol = cmd_data.volume.vol;
+	struct hc_volume *v = root_page.volumes + vol;
+	switch (active_cmd) {
+	case CREATE_VOLUME:
+		memcpy(v->volume_name, cmd_data.volume.volume.volume_name, MAX_VOLUME_NAME_LEN);
+		v->flags = cmd_data.volume.volume.flags | HC_VOLUME_FLAG_VALID;
+		v->n_regions = 0;
+		break;
+	case RESIZE_VOLUME:
+		break;
+	case DELETE_VOLUME:
+		v->flags = 0;
+		break;
+	}
+	if (usbd_scsi_volume_resize(&root_page, vol, cmd_data.volume.n_regions)) {
+		finish_command_resp(INVALID_STATE);
+		return;
+	}
+	sync_root_block();
+	usbd_scsi_volumes_changed();
+	if (active_cmd == CREATE_VOLUME) {
+		u8 resp = vol;
+		finish_command(OKAY, &resp, 1);
+	} else {
+		finish_command_resp(OKAY);
+	}
+}
+
+void read_trace_cmd(u8 *data, int data_len)
+{
+	int len = trace_read(cmd_data.read_trace.data, sizeof(cmd_data.read_trace.data));
+	if (len < 0) {
+		finish_command_resp(INVALID_STATE);
+		return;
+	}
+	//A non-zero first byte clears the trace once it has been read
+	if (data_len >= 1 && data[0]) {
+		trace_reset();
+	}
+	finish_command(OKAY, cmd_data.read_trace.data, len);
+}
+
+static void io_stats_read(struct hc_io_stats *st, const u8 *data, int data_len)
+{
+	memcpy(st, &g_io_stats, sizeof(*st));
+	st->ms_since_reset = HAL_GetTick() - s_io_stats_reset_ms;
+	st->cpu_hz = SystemCoreClock;
+	for (int i = 0; i < HC_IO_STATS_MAX_STAGES && i < BUFFER_FIFO_MAX_STAGES; i++) {
+		st->fifo_stalls[i] = usbBulkBufferFIFO.stallCount[i];
+	}
+	//A non-zero first byte clears the statistics once they have been read
+	if (data_len >= 1 && data[0]) {
+		io_stats_reset();
+	}
+}
+
+void read_io_stats_cmd(u8 *data, int data_len)
+{
+	io_stats_read(&cmd_data.read_io_stats, data, data_len);
+	finish_command(OKAY, (const u8 *)&cmd_data.read_io_stats, sizeof(cmd_data.read_io_stats));
+}
+
 void get_rand_bits_cmd_check()
 {
 	if (rand_avail() >= cmd_data.get_rand_bits.sz) {
@@ -1541,6 +2294,21 @@ int logged_in_state(int cmd, u8 *data, int data_len)
 	case GET_RAND_BITS:
 		get_rand_bits_cmd(data, data_len);
 		break;
+	case CREATE_VOLUME:
+		create_volume_cmd(data, data_len);
+		break;
+	case RESIZE_VOLUME:
+		resize_volume_cmd(data, data_len);
+		break;
+	case DELETE_VOLUME:
+		delete_volume_cmd(data, data_len);
+		break;
+	case READ_TRACE:
+		read_trace_cmd(data, data_len);
+		break;
+	case READ_IO_STATS:
+		read_io_stats_cmd(data, data_len);
+		break;
 	case READ_UID: {
 		if (data_len < 3) {
 			finish_command_resp(INVALID_INPUT);
@@ -1640,6 +2408,11 @@ int backing_up_device_state (int cmd, u8 *data, int data_len)
 	case READ_BLOCK_HC:
 		read_block_cmd(data, data_len);
 		break;
+#ifdef BOOT_MODE_B
+	case READ_BLOCKS_HC:
+		read_blocks_cmd(data, data_len);
+		break;
+#endif
 	case BACKUP_DEVICE_DONE:
 		enter_state(state_data.backup.prev_state);
 		finish_command_resp(OKAY);
@@ -1659,6 +2432,14 @@ int restoring_device_state(int cmd, u8 *data, int data_len)
 	case ERASE_BLOCK_HC:
 		erase_block_cmd(data, data_len);
 		break;
+#ifdef BOOT_MODE_B
+	case READ_BLOCK_CRCS_HC:
+		read_block_crcs_cmd(data, data_len);
+		break;
+	case WRITE_BLOCK_VERIFY_HC:
+		write_block_verify_cmd(data, data_len);
+		break;
+#endif
 	case RESTORE_DEVICE_DONE:
 		enter_state(DS_DISCONNECTED);
 		finish_command_resp(OKAY);
@@ -1766,6 +2547,7 @@ void cmd_init()
 		memset(&root_page, 0, sizeof(root_page));
 		g_root_page_valid = 0;
 	}
+	usbd_scsi_root_page_loaded();
 }
 
 void startup_cmd (u8 *data, int data_len)
@@ -1779,86 +2561,261 @@ void startup_cmd (u8 *data, int data_len)
 	startup_cmd_iter();
 }
 
-int request_device(enum command_subsystem system)
+//
+// Device resources are owned separately so a subsystem only blocks the other
+// on the resources it actually uses. A request is granted all at once or not
+// at all. When it can't be granted it is remembered and granted as soon as the
+// resources are released. CTAP takes all of its resources up front and never
+// uses the DB, and Signet commands either take everything or only the DB plus
+// the button later on, so a wait can't go in a circle.
+//
+int request_resources(enum command_subsystem system, int resources)
 {
 	__disable_irq();
-	if (s_device_system_owner == system) {
-		__enable_irq();
-		return 1;
+	int busy = (system == CTAP_SUBSYSTEM && !is_ctap_initialized());
+	for (int r = 0; r < NUM_RESOURCES; r++) {
+		if ((resources & RESOURCE_MASK(r)) && s_resource_owner[r] != NO_SUBSYSTEM && s_resource_owner[r] != system) {
+			busy = 1;
+		}
 	}
-	if (s_device_system_owner == NO_SUBSYSTEM && (system != CTAP_SUBSYSTEM || is_ctap_initialized())) {
-		s_device_system_owner = system;
+	if (busy) {
+		s_resources_wanted[system] |= resources;
 		__enable_irq();
-		return 1;
+		return 0;
 	}
-	switch (system) {
-	case SIGNET_SUBSYSTEM:
-		s_signet_subsystem_waiting = 1;
-		break;
-	case CTAP_SUBSYSTEM:
-		s_ctap_subsystem_waiting = 1;
-		break;
-	default:
-		break;
+	for (int r = 0; r < NUM_RESOURCES; r++) {
+		if (resources & RESOURCE_MASK(r)) {
+			s_resource_owner[r] = system;
+		}
 	}
+	s_resources_wanted[system] &= ~resources;
 	__enable_irq();
-	return 0;
+	return 1;
 }
 
 static int restart_signet_command();
+static void cmd_rx_resume();
 
-enum command_subsystem device_subsystem_owner()
+enum command_subsystem resource_owner(enum device_resource resource)
 {
-	return s_device_system_owner;
+	return s_resource_owner[resource];
 }
 
-int release_device_request(enum command_subsystem system)
+int resources_idle()
 {
-	__disable_irq();
-	//
-	//Do nothing if we don't own the device or the root block
-	//needs updating
-	//
-	if (system != s_device_system_owner) {
-		__enable_irq();
-		return 0;
-	}
-	if (g_root_block_sync_state != ROOT_BLOCK_SYNCED) {
-		//Wait until the root block is synchronized to release the device
-		s_subsystem_release_requested = 1;
-		__enable_irq();
-		return 0;
+	for (int r = 0; r < NUM_RESOURCES; r++) {
+		if (s_resource_owner[r] != NO_SUBSYSTEM)
+			return 0;
 	}
-	release_device(system);
 	return 1;
 }
 
-static void release_device(enum command_subsystem system)
+void release_resources(enum command_subsystem system, int resources)
 {
 	__disable_irq();
+	s_resources_wanted[system] &= ~resources;
+	if ((resources & RESOURCE_MASK(RESOURCE_ROOT_PAGE)) &&
+		s_resource_owner[RESOURCE_ROOT_PAGE] == system &&
+		g_root_block_sync_state != ROOT_BLOCK_SYNCED) {
+		//Keep the root page until it has been written back
+		s_root_page_release_requested = 1;
+		resources &= ~RESOURCE_MASK(RESOURCE_ROOT_PAGE);
+	}
+	for (int r = 0; r < NUM_RESOURCES; r++) {
+		if ((resources & RESOURCE_MASK(r)) && s_resource_owner[r] == system) {
+			s_resource_owner[r] = NO_SUBSYSTEM;
+		}
+	}
+	__enable_irq();
+	grant_waiting_resources(system);
+}
+
+static void grant_signet_resources()
+{
+	int wanted = s_resources_wanted[SIGNET_SUBSYSTEM];
+	if (!wanted || !request_resources(SIGNET_SUBSYSTEM, wanted))
+		return;
+	if (waiting_for_button_press) {
+		start_blinking(500, 10000);
+	} else if (waiting_for_long_button_press) {
+		start_blinking(1000, 10000);
+	} else if (!restart_signet_command()) {
+		cmd_rx_resume();
+	}
+}
+
+static void grant_ctap_resources()
+{
 #ifdef ENABLE_FIDO2
-	if (s_ctap_subsystem_waiting && system != CTAP_SUBSYSTEM && is_ctap_initialized() ) {
-		s_ctap_subsystem_waiting = 0;
-		s_device_system_owner = CTAP_SUBSYSTEM;
-		__enable_irq();
+	int wanted = s_resources_wanted[CTAP_SUBSYSTEM];
+	if (wanted && request_resources(CTAP_SUBSYSTEM, wanted)) {
 		ctaphid_idle();
-	} else
+	}
 #endif
-	if (s_signet_subsystem_waiting && system != SIGNET_SUBSYSTEM) {
-		s_signet_subsystem_waiting = 0;
-		s_device_system_owner = SIGNET_SUBSYSTEM;
-		__enable_irq();
-		if (!restart_signet_command()) {
+}
+
+static void grant_waiting_resources(enum command_subsystem released_by)
+{
+	//Give the other subsystem the first chance so neither can starve
+	if (released_by == CTAP_SUBSYSTEM) {
+		grant_signet_resources();
+		grant_ctap_resources();
+	} else {
+		grant_ctap_resources();
+		grant_signet_resources();
+	}
+}
+
+//
+// Resources a Signet command takes before it starts. Commands that only read
+// the DB can run alongside CTAP requests
+//
+static int signet_cmd_resources(int cmd)
+{
+	switch (cmd) {
+#ifdef BOOT_MODE_B
+	case READ_UID:
+	case READ_ALL_UIDS:
+	case READ_TRACE:
+	case READ_IO_STATS:
+	case READ_BLOCKS_HC:
+#endif
+	case READ_BLOCK_HC:
+	case GET_PROGRESS:
+	case BUTTON_WAIT:
+		return RESOURCE_MASK(RESOURCE_DB);
+	default:
+		return ALL_RESOURCES;
+	}
+}
+
+//
+// Tagged commands that arrive while another command is running wait here
+// until it has finished. The packet buffer belongs to the running command so
+// only single packet messages are queued. Longer messages hold the endpoint.
+//
+static u8 s_cmd_queue[CMD_QUEUE_DEPTH][RAW_HID_PAYLOAD_SIZE];
+static int s_cmd_queue_head = 0;
+static int s_cmd_queue_count = 0;
+
+//Set while the endpoint is held for the packet in cmd_packet_buf
+static int s_cmd_rx_held = 0;
+
+static void cmd_packet_dispatch();
+
+static void cmd_rx_resume()
+{
+	if (s_cmd_rx_held) {
+		s_cmd_rx_held = 0;
+		if (g_cmd_transport == CMD_TRANSPORT_BULK) {
+			usbd_cmd_bulk_rx_resume();
+		} else {
 			USBD_HID_rx_resume(INTERFACE_CMD);
 		}
-	} else {
-		s_device_system_owner = NO_SUBSYSTEM;
-		__enable_irq();
 	}
-	return;
+}
+
+int cmd_busy()
+{
+	return active_cmd != -1 || s_cmd_resp_sending || s_cmd_queue_count;
+}
+
+static int cmd_queue_pending()
+{
+	return s_cmd_queue_count || usb_raw_hid_rx_deferred();
+}
+
+static void cmd_queue_flush()
+{
+	s_cmd_queue_head = 0;
+	s_cmd_queue_count = 0;
+}
+
+void cmd_queue_next()
+{
+	if (active_cmd != -1 || s_cmd_resp_sending || !s_cmd_queue_count)
+		return;
+	memcpy(cmd_packet_buf, s_cmd_queue[s_cmd_queue_head], RAW_HID_PAYLOAD_SIZE);
+	s_cmd_queue_head = (s_cmd_queue_head + 1) % CMD_QUEUE_DEPTH;
+	s_cmd_queue_count--;
+	cmd_packet_dispatch();
+}
+
+//
+// Commands that don't touch cmd_data or the DB can be answered while the
+// active command is parked waiting for a button press. UID lookups aren't
+// among them since they read the DB into cmd_data
+//
+static int cmd_side_command(const u8 *packet)
+{
+	u8 *resp = s_side_resp + CMD_PACKET_HEADER_SIZE + CMD_PACKET_TAG_SIZE;
+	int resp_code = OKAY;
+	int resp_len = 0;
+
+	if (!(waiting_for_button_press || waiting_for_long_button_press) ||
+		s_cmd_resp_sending || s_side_resp_sending) {
+		return 0;
+	}
+	switch (packet[2]) {
+	case GET_DEVICE_STATE:
+		resp[0] = g_device_state;
+		resp_len = 1;
+		break;
+#ifdef BOOT_MODE_B
+	case READ_IO_STATS:
+		if (g_device_state != DS_LOGGED_IN) {
+			resp_code = INVALID_STATE;
+			break;
+		}
+		io_stats_read((struct hc_io_stats *)resp, packet + CMD_PACKET_HEADER_SIZE,
+			packet[0] + (packet[1] << 8) - CMD_PACKET_HEADER_SIZE);
+		resp_len = sizeof(struct hc_io_stats);
+		break;
+#endif
+	default:
+		return 0;
+	}
+	int full_length = resp_len + CMD_PACKET_HEADER_SIZE + CMD_PACKET_TAG_SIZE;
+	s_side_resp[0] = full_length & 0xff;
+	s_side_resp[1] = (full_length >> 8) & 0xff;
+	s_side_resp[2] = resp_code | CMD_RESP_TAGGED;
+	s_side_resp[3] = 0;
+	s_side_resp[4] = 0;
+	s_side_resp[5] = g_device_state;
+	s_side_resp[CMD_PACKET_HEADER_SIZE] = packet[5];
+	s_side_resp_sending = 1;
+	cmd_packet_send(s_side_resp, full_length);
+	return 1;
+}
+
+//
+// Called for the first packet of each message. Returns 1 if the message was
+// consumed, 0 if it should be received normally and -1 if the endpoint must
+// be held until the running command finishes.
+//
+int cmd_packet_queue(const u8 *packet, int last)
+{
+	int cmd = packet[2];
+	if (!packet[5] || !cmd_busy() || cmd == CANCEL_BUTTON_PRESS || cmd == DISCONNECT)
+		return 0;
+	if (!last)
+		return -1;
+	if (cmd_side_command(packet))
+		return 1;
+	if (s_cmd_queue_count == CMD_QUEUE_DEPTH)
+		return -1;
+	memcpy(s_cmd_queue[(s_cmd_queue_head + s_cmd_queue_count) % CMD_QUEUE_DEPTH], packet, RAW_HID_PAYLOAD_SIZE);
+	s_cmd_queue_count++;
+	return 1;
 }
 
 void cmd_packet_recv()
+{
+	s_cmd_rx_held = 1;
+	cmd_packet_dispatch();
+}
+
+static void cmd_packet_dispatch()
 {
 	u8 *data = cmd_packet_buf;
 	int data_len = data[0] + (data[1] << 8) - CMD_PACKET_HEADER_SIZE;
@@ -1871,28 +2828,29 @@ void cmd_packet_recv()
 
 	if (next_active_cmd == DISCONNECT) {
 		cmd_disconnect();
-		USBD_HID_rx_resume(INTERFACE_CMD);
+		cmd_rx_resume();
 		return;
 	}
 
 	if (prev_active_cmd != -1 && next_active_cmd == CANCEL_BUTTON_PRESS && !waiting_for_a_button_press) {
 		//Ignore button cancel requests with no button press waiting
-		USBD_HID_rx_resume(INTERFACE_CMD);
+		cmd_rx_resume();
 		return;
 	}
 
 	if (prev_active_cmd != -1 && waiting_for_a_button_press && next_active_cmd == CANCEL_BUTTON_PRESS) {
 		end_button_press_wait();
 		finish_command_resp(BUTTON_PRESS_CANCELED);
-		USBD_HID_rx_resume(INTERFACE_CMD);
+		cmd_rx_resume();
 		return;
 	}
 	if (active_cmd != next_active_cmd) {
 		cmd_iter_count = 0;
 	}
 	active_cmd = next_active_cmd;
+	s_cmd_tag = cmd_packet_buf[5];
 	if (restart_signet_command() == 0) {
-		USBD_HID_rx_resume(INTERFACE_CMD);
+		cmd_rx_resume();
 	}
 }
 
@@ -1902,7 +2860,7 @@ static int restart_signet_command()
 	int data_len = data[0] + (data[1] << 8) - CMD_PACKET_HEADER_SIZE;
 	int messages_remaining = data[3] + (data[4] << 8);
 	data += CMD_PACKET_HEADER_SIZE;
-	if (!request_device(SIGNET_SUBSYSTEM)) {
+	if (!request_resources(SIGNET_SUBSYSTEM, signet_cmd_resources(active_cmd))) {
 		return 1;
 	}
 	cmd_messages_remaining = messages_remaining;
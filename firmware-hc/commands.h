@@ -3,6 +3,7 @@
 #include "types.h"
 #include "signetdev_common_priv.h"
 #include "db.h"
+#include "memory_layout.h"
 
 void get_progress_cmd(u8 *data, int data_len);
 
@@ -39,6 +40,7 @@ union cmd_data_u {
 		int random_data_gathered;
 		int root_block_finalized;
 		int blocks_written;
+		int blocks_writing;
 		int random_data_needed;
 		int signet_random_data_needed;
 		int ctap_random_data_needed;
@@ -60,12 +62,26 @@ union cmd_data_u {
 	} startup;
 	struct {
 		u8 block[BLK_SIZE];
-		int block_idx;
+		int phase;
+		u32 sector; //Next eMMC sector to wipe
+		u32 step_end;
+		u32 end_sector;
+		int not_purged; //The card couldn't sanitize so the area was zero filled
 	} wipe_data;
 	struct {
 		u8 block[BLK_SIZE];
 		int block_idx;
 	} read_block;
+	struct {
+		//The record is placed so the block contents following it are word aligned
+		u8 resp[1 + sizeof(struct hc_block_record) + BLK_SIZE];
+		u32 manifest[NUM_STORAGE_BLOCKS];
+		int has_manifest;
+		int first_block;
+		int next_block;
+		int end_block;
+		int block_ready;
+	} read_blocks;
 	struct {
 		u8 block[BLK_SIZE];
 		int block_idx;
@@ -74,6 +90,37 @@ union cmd_data_u {
 		u8 block[BLK_SIZE];
 		int block_idx;
 	} erase_block;
+	struct {
+		u8 block[BLK_SIZE];
+		u32 crc[NUM_STORAGE_BLOCKS];
+		int first_block;
+		int next_block;
+		int end_block;
+	} read_block_crcs;
+	struct {
+		u8 block[BLK_SIZE];
+		u8 read_back[BLK_SIZE];
+		int block_idx;
+		u32 crc;
+	} write_block_verify;
+	struct {
+		u8 block[BLK_SIZE];
+	} write_firmware_stage;
+	struct {
+		u8 block[2][BLK_SIZE];
+		struct hc_firmware_file_header header;
+		int phase;
+		u8 *flash_base;
+		int first_block; //First staged block of the image being programmed
+		int n_blocks;
+		u32 crc; //Running CRC of the image being verified
+		u32 A_crc;
+		u32 B_crc;
+		int read_issued;
+		int read_done;
+		int prog_issued;
+		int prog_done;
+	} flash_staged;
 	struct {
 		u8 new_key[AES_256_KEY_SIZE];
 		u8 keystore_key[AES_256_KEY_SIZE];
@@ -142,13 +189,35 @@ union cmd_data_u {
 	struct {
 		int idx;
 	} read_cleartext_password;
+	struct {
+		int vol;
+		u32 n_regions;
+		struct hc_volume volume;
+	} volume;
+	struct {
+		u8 data[BLK_SIZE];
+	} read_trace;
+	struct hc_io_stats read_io_stats;
 } __attribute__((aligned(16)));
 
 extern union cmd_data_u cmd_data;
 void sync_root_block_immediate();
 int sync_root_block_pending();
 
+enum cmd_transport {
+	CMD_TRANSPORT_HID,
+	CMD_TRANSPORT_BULK
+};
+
+//Transport the active command arrived on. Its responses go back the same way
+extern enum cmd_transport g_cmd_transport;
+
 void cmd_packet_recv();
+int cmd_busy();
+int cmd_packet_queue(const u8 *packet, int last);
+void cmd_packet_sent(const u8 *data);
+void cmd_queue_next();
+void cmd_stream_idle();
 void cmd_init();
 void cmd_packet_send(const u8 *data, u16 len);
 void cmd_event_send(int event_num, const u8 *data, int data_len);
@@ -160,6 +229,9 @@ void enter_progressing_state(enum device_state state, int _n_progress_components
 
 void cmd_rand_update();
 void write_data_block(int pg, const u8 *src);
+void write_data_blocks(int pg, int count, const u8 *src);
+void read_firmware_stage_block(int idx, u8 *dest);
+void write_firmware_stage_block(int idx, const u8 *src);
 void read_data_block(int pg, u8 *dest);
 void sync_root_block();
 int sync_root_block_writing();
@@ -173,9 +245,21 @@ enum command_subsystem {
 	NO_SUBSYSTEM
 };
 
-int request_device(enum command_subsystem system);
-int release_device_request(enum command_subsystem system);
-enum command_subsystem device_subsystem_owner();
+enum device_resource {
+	RESOURCE_BUTTON, //Button presses and the blinking prompt
+	RESOURCE_ROOT_PAGE, //Changes to root_page until they are synced
+	RESOURCE_DB, //eMMC DB blocks and the DB block cache
+	RESOURCE_CRYPTO, //Random pool and login state
+	NUM_RESOURCES
+};
+
+#define RESOURCE_MASK(r) (1 << (r))
+#define ALL_RESOURCES ((1 << NUM_RESOURCES) - 1)
+
+int request_resources(enum command_subsystem system, int resources);
+void release_resources(enum command_subsystem system, int resources);
+enum command_subsystem resource_owner(enum device_resource resource);
+int resources_idle();
 void button_press_unprompted();
 
 struct hc_device_data;
@@ -193,6 +277,13 @@ enum emmc_user {
 	EMMC_NUM_USER
 };
 
+struct emmc_user_policy {
+	int priority; //Larger values are scheduled first
+	u32 max_wait_ms; //Run ahead of higher priorities after waiting this long. Zero for no deadline
+};
+
+extern struct emmc_user_policy g_emmc_user_policy[];
+
 void emmc_user_queue(enum emmc_user user);
 void emmc_user_done();
 
@@ -218,4 +309,7 @@ enum root_block_sync_state {
 
 extern enum root_block_sync_state g_root_block_sync_state;
 
+extern struct hc_io_stats g_io_stats;
+void io_stats_reset();
+
 #endif
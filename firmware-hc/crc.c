@@ -29,3 +29,16 @@ u32 crc_32_cont(const u8 *din, int count)
 {
 	return ~HAL_CRC_Accumulate(&hcrc, (uint32_t *)din, count);
 }
+
+//
+// Continues a CRC previously returned by crc_32() or crc_32_from(). Unlike
+// crc_32_cont() other CRCs may be computed in between. The unit's register
+// holds the bit reversed complement of the value returned.
+//
+u32 crc_32_from(u32 crc, const u8 *din, int count)
+{
+	hcrc.Instance->INIT = __RBIT(~crc);
+	crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)din, count);
+	hcrc.Instance->INIT = DEFAULT_CRC_INITVALUE;
+	return ~crc;
+}
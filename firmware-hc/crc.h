@@ -7,5 +7,6 @@ void crc_init();
 
 u32 crc_32(const u8 *din, int count);
 u32 crc_32_cont(const u8 *din, int count);
+u32 crc_32_from(u32 crc, const u8 *din, int count);
 
 #endif
@@ -90,8 +90,10 @@ void invalidate_data_block_cache(int idx)
 static const u8 *get_cached_data_block(int idx)
 {
 	if (block_read_cache_idx == idx) {
+		g_io_stats.db_cache_hits++;
 		return block_read_cache;
 	} else {
+		g_io_stats.db_cache_misses++;
 		block_read_cache_idx = idx;
 		block_read_cache_updating = 1;
 		read_data_block(idx, block_read_cache);
@@ -172,6 +174,13 @@ static u8 *get_part(const struct block *block, const struct block_info *info, in
 	return ((u8 *)block) + ((info->part_tbl_offs + (info->part_size * n)) * SUB_BLK_SIZE);
 }
 
+//Returns non-zero if the startup scan found block_num to be unallocated
+int db3_block_unoccupied(int block_num)
+{
+	const struct block_info *blk_info = g_block_info_tbl + block_num;
+	return blk_info->valid && !blk_info->occupied;
+}
+
 static void db3_startup_scan_resume ()
 {
 	int i = db3_startup_scan_blk_num;
@@ -233,6 +242,7 @@ static void db3_startup_scan_resume ()
 		read_data_block(db3_startup_scan_blk_num, (u8 *)block_read);
 	} else {
 		db3_startup_scan_running = 0;
+		trace_end(HC_TRACE_SPAN_DB_STARTUP_SCAN);
 		//HC_TODO: this functionality should be in callbacks
 		if (active_cmd == STARTUP) {
 			enter_state(DS_LOGGED_OUT);
@@ -255,9 +265,33 @@ void db3_startup_scan (u8 *block_read, struct block_info *blk_info_temp)
 	db3_startup_scan_blk_info_temp = blk_info_temp;
 	db3_startup_scan_block_read = (struct block *)block_read;
 	db3_startup_scan_blk_num = MIN_DATA_BLOCK;
+	trace_begin(HC_TRACE_SPAN_DB_STARTUP_SCAN);
 	read_data_block(db3_startup_scan_blk_num, (u8 *)db3_startup_scan_block_read);
 }
 
+//
+// Initializes 'g_block_info_tbl' and 'uid_map' after formatting, when every
+// data block was written with 'block'. This avoids reading the blocks back.
+//
+void db3_formatted_scan(const u8 *block)
+{
+	const struct block *blk = (const struct block *)block;
+	for (int i = MIN_UID; i <= MAX_UID; i++) {
+		uid_map[i] = INVALID_BLOCK;
+	}
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		struct block_info *blk_info = g_block_info_tbl + i;
+		blk_info->part_size = blk->header.part_size;
+		blk_info->valid = 1;
+		blk_info->occupied = (blk_info->part_size != INVALID_PART_SIZE);
+		if (blk_info->occupied) {
+			blk_info->part_occupancy = blk->header.occupancy;
+			blk_info->part_count = get_part_count(blk->header.part_size);
+			blk_info->part_tbl_offs = get_block_header_size(blk_info->part_count);
+		}
+	}
+}
+
 //Return a block that has not been allocated or INVALID_BLOCK if there are no free blocks
 static int find_free_block()
 {
@@ -21,8 +21,10 @@ void update_uid_cmd_complete();
 void update_uid_cmd_write_finished();
 
 void db3_startup_scan(u8 *block_read, struct block_info *blk_info_temp);
+void db3_formatted_scan(const u8 *block);
 struct block *db3_initialize_block(int block_num, struct block *block_temp);
 
+int db3_block_unoccupied(int block_num);
 int db3_read_block_complete();
 int db3_write_block_complete();
 
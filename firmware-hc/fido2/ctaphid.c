@@ -28,6 +28,10 @@
 #include "commands.h"
 #include "usbd_hid.h"
 #include "signetdev_hc_common.h"
+#include "trace.h"
+
+//CTAP requests never touch the DB so they can run alongside Signet DB reads
+#define CTAP_RESOURCES (RESOURCE_MASK(RESOURCE_BUTTON) | RESOURCE_MASK(RESOURCE_ROOT_PAGE) | RESOURCE_MASK(RESOURCE_CRYPTO))
 
 typedef enum
 {
@@ -590,7 +594,7 @@ void ctaphid_handle_packet(uint8_t * pkt_raw)
     ctaphid_processing_packet = 1;
     rand_clear_rewind_point();
 
-    if (request_device(CTAP_SUBSYSTEM)) {
+    if (request_resources(CTAP_SUBSYSTEM, CTAP_RESOURCES)) {
         restart_command();
     }
 }
@@ -604,7 +608,7 @@ static void restart_command()
 	if (!process_ctaphid_packet()) {
 		ctaphid_processing_packet = 0;
 		rand_clear_rewind_point();
-		release_device_request(CTAP_SUBSYSTEM);
+		release_resources(CTAP_SUBSYSTEM, CTAP_RESOURCES);
 		USBD_HID_rx_resume(INTERFACE_FIDO);
 	} else {
 		int rand_req = crypto_random_get_requested();
@@ -721,7 +725,9 @@ static int process_ctaphid_packet()
             }
             is_busy = 1;
             ctap_response_init(&ctap_resp);
+            trace_begin(HC_TRACE_SPAN_CTAP_REQUEST);
             status = ctap_request(ctap_buffer, len, &ctap_resp);
+            trace_end(HC_TRACE_SPAN_CTAP_REQUEST);
 
 	    if (crypto_random_get_requested()) {
 		    int rand_req = crypto_random_get_requested();
@@ -802,7 +808,7 @@ static int process_ctaphid_packet()
             stop_blinking();
             rand_clear_rewind_point();
 	    ctaphid_processing_packet = 0;
-            release_device(SIGNET_SUBSYSTEM);
+            release_resources(CTAP_SUBSYSTEM, CTAP_RESOURCES);
 	    is_busy = 0;
 #endif
      	    break;
@@ -1,4 +1,5 @@
 #include <memory.h>
+#include <stddef.h>
 
 #include "stm32f7xx_hal.h"
 #include "firmware_update_state.h"
@@ -9,15 +10,101 @@
 #include "crc.h"
 #include "main.h"
 
+#include <nettle/sha2.h>
+#include <nettle/hmac.h>
+#include <nettle/eddsa.h>
+
 struct hc_firmware_info g_update_firmware;
 
+//
+// WRITE_FLASH_HC double buffering. One buffer is programmed while the next
+// write is received into the other. A request that arrives with both buffers
+// in use stays active until programming frees one.
+//
+struct flash_pipe_buf {
+	u32 addr;
+	u32 length;
+	u32 crc;
+	u8 data[HC_WRITE_FLASH_MAX_LEN];
+};
+
+static struct {
+	struct flash_pipe_buf buf[2];
+	int programming; //Buffer being programmed or -1
+	int pending; //Buffer waiting to be programmed or -1
+	int failed;
+	struct hc_write_flash_ack ack;
+
+	int waiting;
+	u32 req_addr;
+	u32 req_crc;
+	const u8 *req_data;
+	int req_len;
+} s_flash_pipe = {.programming = -1, .pending = -1};
+
+static int expand_writing();
+
+//
+// Set while a flash write issued here is in flight. Root page syncs share the
+// flash and its completion callback, so writes here only start when the flash
+// is idle and a completion is only counted if it was ours.
+//
+static int s_flash_owned = 0;
+
+//Flash and staging writes share the write completion path so only one may be in flight
+static int flash_pipe_busy()
+{
+	return s_flash_pipe.programming != -1 || s_flash_pipe.pending != -1 || expand_writing();
+}
+
+static void flash_pipe_reset()
+{
+	s_flash_pipe.failed = 0;
+	s_flash_pipe.waiting = 0;
+	memset(&s_flash_pipe.ack, 0, sizeof(s_flash_pipe.ack));
+}
+
+static int get_update_area(u32 *base, u32 *len)
+{
+	switch (flash_get_boot_mode()) {
+	case HC_BOOT_BOOTLOADER_MODE:
+		*base = BOOT_AREA_B;
+		*len = HC_BOOT_AREA_B_LEN;
+		return 1;
+	case HC_BOOT_APPLICATION_MODE:
+		*base = BOOT_AREA_A;
+		*len = HC_BOOT_AREA_A_LEN;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 void update_firmware_cmd(u8 *data, int data_len)
 {
-	if (data_len < sizeof(g_update_firmware)) {
+	if (data_len >= sizeof(g_update_firmware)) {
+		memcpy(&g_update_firmware, data, sizeof(g_update_firmware));
+	} else if (data_len >= sizeof(struct hc_firmware_info_v1)) {
+		const struct hc_firmware_info_v1 *v1 = (const struct hc_firmware_info_v1 *)data;
+		memset(&g_update_firmware, 0, sizeof(g_update_firmware));
+		g_update_firmware.fw_version = v1->fw_version;
+		g_update_firmware.firmware_crc = v1->firmware_crc;
+		g_update_firmware.firmware_len = v1->firmware_len;
+		memcpy(g_update_firmware.firmware_signature, v1->firmware_signature, sizeof(v1->firmware_signature));
+		memcpy(g_update_firmware.firmware_signature_pubkey, v1->firmware_signature_pubkey, sizeof(v1->firmware_signature_pubkey));
+	} else {
 		finish_command_resp(INVALID_INPUT);
 		return;
 	}
-	memcpy(&g_update_firmware, data, sizeof(g_update_firmware));
+}
+
+//Converts a header from before signatures grew to 64 bytes. Callers set the version and size
+static void firmware_header_from_v1(struct hc_firmware_file_header *hdr, const struct hc_firmware_file_header_v1 *v1)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr, v1, offsetof(struct hc_firmware_file_header_v1, A_signature));
+	memcpy(hdr->A_signature, v1->A_signature, sizeof(v1->A_signature));
+	memcpy(hdr->B_signature, v1->B_signature, sizeof(v1->B_signature));
 }
 
 void write_flash_cmd_complete()
@@ -37,8 +124,37 @@ int in_memory_range(u32 addr, u32 base_addr, u32 len)
 	return (addr >= base_addr && addr <= end_addr);
 }
 
+enum flash_staged_phase {
+	FLASH_STAGED_HEADER,
+	FLASH_STAGED_VERIFY,
+	FLASH_STAGED_PROGRAM
+};
+
+static void write_flash_hc_program_complete();
+static void write_flash_hc_resume();
+static void flash_staged_program_complete();
+static void flash_staged_pump();
+
 void firmware_update_write_block_complete()
 {
+	int owned = s_flash_owned;
+	s_flash_owned = 0;
+	if (owned && s_flash_pipe.programming != -1) {
+		write_flash_hc_program_complete();
+		return;
+	}
+	if (owned && active_cmd == FLASH_STAGED_FIRMWARE_HC) {
+		flash_staged_program_complete();
+		return;
+	}
+	if (!owned) {
+		//Someone else's write held the flash. Start what was waiting for it
+		write_flash_hc_resume();
+		if (active_cmd == FLASH_STAGED_FIRMWARE_HC && cmd_data.flash_staged.phase == FLASH_STAGED_PROGRAM) {
+			flash_staged_pump();
+		}
+		return;
+	}
 	switch (g_device_state) {
 	case DS_ERASING_PAGES:
 		cmd_data.erase_flash_pages.index++;
@@ -48,6 +164,7 @@ void firmware_update_write_block_complete()
 			enter_state(DS_FIRMWARE_UPDATE);
 		} else {
 			u8 *addr = (u8 *)flash_sector_to_addr(cmd_data.erase_flash_pages.index);
+			s_flash_owned = 1;
 			flash_write_page(addr, NULL, 0);
 		}
 		break;
@@ -75,30 +192,25 @@ static void erase_flash_pages_cmd(u8 *data, int data_len)
 		finish_command_resp(INVALID_STATE);
 		return;
 	}
+	if (flash_pipe_busy() || !is_flash_idle()) {
+		finish_command_resp(INVALID_STATE);
+		return;
+	}
+	flash_pipe_reset();
 	int temp[] = {cmd_data.erase_flash_pages.max_page -
 		cmd_data.erase_flash_pages.min_page};
 	enter_progressing_state(DS_ERASING_PAGES, 1, temp);
 	finish_command_resp(OKAY);
 	u8 *addr = (u8 *)flash_sector_to_addr(cmd_data.erase_flash_pages.index);
+	s_flash_owned = 1;
 	flash_write_page(addr, NULL, 0);
 }
 
 void write_flash_cmd(u8 *data, int data_len)
 {
-	enum hc_boot_mode mode = flash_get_boot_mode();
-	int write_addr_base = 0;
-	int write_addr_max = 0;
-	int write_addr_len = 0;
-	switch (mode) {
-	case HC_BOOT_BOOTLOADER_MODE:
-		write_addr_base = BOOT_AREA_B;
-		write_addr_len = HC_BOOT_AREA_B_LEN;
-		break;
-	case HC_BOOT_APPLICATION_MODE:
-		write_addr_base = BOOT_AREA_A;
-		write_addr_len = HC_BOOT_AREA_A_LEN;
-		break;
-	default:
+	u32 write_addr_base;
+	u32 write_addr_len;
+	if (!get_update_area(&write_addr_base, &write_addr_len) || flash_pipe_busy() || !is_flash_idle()) {
 		finish_command_resp(INVALID_STATE);
 		return;
 	}
@@ -121,6 +233,622 @@ void write_flash_cmd(u8 *data, int data_len)
 	}
 }
 
+static void write_flash_hc_start()
+{
+	if (s_flash_pipe.programming != -1 || s_flash_pipe.pending == -1 || !is_flash_idle())
+		return;
+	s_flash_pipe.programming = s_flash_pipe.pending;
+	s_flash_pipe.pending = -1;
+	struct flash_pipe_buf *b = s_flash_pipe.buf + s_flash_pipe.programming;
+	s_flash_owned = 1;
+	flash_write((u8 *)b->addr, b->data, b->length);
+}
+
+static void write_flash_hc_respond()
+{
+	finish_command(s_flash_pipe.failed ? WRITE_FAILED : OKAY,
+		(u8 *)&s_flash_pipe.ack, sizeof(s_flash_pipe.ack));
+}
+
+//Buffers the active request if possible. Returns 1 once it has been answered
+static int write_flash_hc_accept()
+{
+	if (!s_flash_pipe.req_len) {
+		if (flash_pipe_busy())
+			return 0;
+		write_flash_hc_respond();
+		return 1;
+	}
+	if (s_flash_pipe.pending != -1)
+		return 0;
+	int idx = (s_flash_pipe.programming == 0) ? 1 : 0;
+	struct flash_pipe_buf *b = s_flash_pipe.buf + idx;
+	b->addr = s_flash_pipe.req_addr;
+	b->crc = s_flash_pipe.req_crc;
+	b->length = s_flash_pipe.req_len;
+	memcpy(b->data, s_flash_pipe.req_data, s_flash_pipe.req_len);
+	s_flash_pipe.pending = idx;
+	write_flash_hc_start();
+	write_flash_hc_respond();
+	return 1;
+}
+
+static void write_flash_hc_program_complete()
+{
+	struct flash_pipe_buf *b = s_flash_pipe.buf + s_flash_pipe.programming;
+	dcache_invalidate((u8 *)b->addr, b->length);
+	s_flash_pipe.ack.addr = b->addr;
+	s_flash_pipe.ack.length = b->length;
+	s_flash_pipe.ack.crc = crc_32((u8 *)b->addr, b->length);
+	if (s_flash_pipe.ack.crc != b->crc) {
+		s_flash_pipe.failed = 1;
+	} else {
+		s_flash_pipe.ack.writes_verified++;
+	}
+	s_flash_pipe.programming = -1;
+	write_flash_hc_resume();
+}
+
+//Programs the pending buffer and takes a request that was waiting for one
+static void write_flash_hc_resume()
+{
+	write_flash_hc_start();
+	if (s_flash_pipe.waiting && active_cmd == WRITE_FLASH_HC && write_flash_hc_accept()) {
+		s_flash_pipe.waiting = 0;
+	}
+}
+
+static void write_flash_hc_cmd(u8 *data, int data_len)
+{
+	u32 base;
+	u32 area_len;
+	if (!get_update_area(&base, &area_len)) {
+		finish_command_resp(INVALID_STATE);
+		return;
+	}
+	if (data_len < HC_WRITE_FLASH_HEADER_SIZE) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	u32 addr = data[0] + (data[1] << 8) + (data[2] << 16) + (data[3] << 24);
+	u32 crc = data[4] + (data[5] << 8) + (data[6] << 16) + (data[7] << 24);
+	data += HC_WRITE_FLASH_HEADER_SIZE;
+	data_len -= HC_WRITE_FLASH_HEADER_SIZE;
+
+	if (data_len > HC_WRITE_FLASH_MAX_LEN || (data_len & 3) ||
+		(data_len && (!in_memory_range(addr, base, area_len) ||
+		 !in_memory_range(addr + data_len - 1, base, area_len)))) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	//Catch transfer errors before they reach flash
+	if (data_len && crc_32(data, data_len) != crc) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	s_flash_pipe.req_addr = addr;
+	s_flash_pipe.req_crc = crc;
+	s_flash_pipe.req_data = data;
+	s_flash_pipe.req_len = data_len;
+	s_flash_pipe.waiting = !write_flash_hc_accept();
+}
+
+//
+// Staged updates. Blocks of the firmware file are written to the eMMC update
+// area first. Flashing reads the header and checks the CRC of both images,
+// the keyed hash of the body and, once a firmware signing key has been
+// provisioned in the root page, the signature of each image. Only then is
+// the boot area that isn't running erased and programmed. The eMMC read of
+// the next block overlaps programming of the current one.
+//
+#define STAGE_HEADER_BLOCK (0)
+#define STAGE_A_FIRST_BLOCK (1)
+#define STAGE_B_FIRST_BLOCK (STAGE_A_FIRST_BLOCK + (HC_BOOT_AREA_A_LEN / BLK_SIZE))
+#define STAGE_END_BLOCK (STAGE_B_FIRST_BLOCK + (HC_BOOT_AREA_B_LEN / BLK_SIZE))
+
+static struct {
+	struct sha256_ctx area_hash; //Digest of the image being verified, as signed
+	struct hmac_sha256_ctx body_hash;
+	u8 A_digest[SHA256_DIGEST_SIZE];
+	u8 B_digest[SHA256_DIGEST_SIZE];
+	int from_v1; //Files from before signatures grew carry neither
+} s_staged_verify;
+
+static void write_firmware_stage_cmd(u8 *data, int data_len)
+{
+	if (data_len != (HC_BLOCK_VERIFY_HEADER_SIZE + BLK_SIZE)) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	int idx = data[0] + (data[1] << 8);
+	u32 crc = data[2] + (data[3] << 8) + (data[4] << 16) + (data[5] << 24);
+	data += HC_BLOCK_VERIFY_HEADER_SIZE;
+	if (idx >= EMMC_DB_FIRMWARE_UPDATE_BLOCKS || flash_pipe_busy() || crc_32(data, BLK_SIZE) != crc) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	memcpy(cmd_data.write_firmware_stage.block, data, BLK_SIZE);
+	write_firmware_stage_block(idx, cmd_data.write_firmware_stage.block);
+}
+
+static void flash_staged_cmd(u8 *data, int data_len)
+{
+	u32 base;
+	u32 area_len;
+	if (!get_update_area(&base, &area_len) || flash_pipe_busy()) {
+		finish_command_resp(INVALID_STATE);
+		return;
+	}
+	cmd_data.flash_staged.flash_base = (u8 *)base;
+	cmd_data.flash_staged.first_block = (base == BOOT_AREA_A) ? STAGE_A_FIRST_BLOCK : STAGE_B_FIRST_BLOCK;
+	cmd_data.flash_staged.n_blocks = area_len / BLK_SIZE;
+	cmd_data.flash_staged.phase = FLASH_STAGED_HEADER;
+	cmd_data.flash_staged.read_issued = STAGE_HEADER_BLOCK;
+	read_firmware_stage_block(STAGE_HEADER_BLOCK, cmd_data.flash_staged.block[0]);
+}
+
+static int flash_staged_header_valid(const struct hc_firmware_file_header *hdr)
+{
+	return hdr->file_prefix == HC_FIRMWARE_FILE_PREFIX &&
+		hdr->file_version == HC_FIRMWARE_FILE_VERSION &&
+		hdr->header_size == sizeof(*hdr) &&
+		hdr->A_len <= HC_BOOT_AREA_A_LEN &&
+		hdr->B_len <= HC_BOOT_AREA_B_LEN &&
+		!memcmp(&hdr->fw_version, &g_update_firmware.fw_version, sizeof(hdr->fw_version));
+}
+
+static int firmware_signing_key(const u8 **pubkey)
+{
+	const u8 *key = (const u8 *)root_page.firmware_signature_pubkey;
+	for (int i = 0; i < HC_FIRMWARE_SIGNATURE_PUBKEY_LEN; i++) {
+		if (key[i]) {
+			*pubkey = key;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Checks the keyed hash of the body and, when a signing key is provisioned,
+// both image signatures. Older files have neither so they are only accepted
+// while no key is provisioned.
+//
+static int flash_staged_authentic(const struct hc_firmware_file_header *hdr)
+{
+	u8 hash[HC_FIRMWARE_HASH_LEN];
+	const u8 *pubkey;
+	int signed_only = firmware_signing_key(&pubkey);
+	hmac_sha256_digest(&s_staged_verify.body_hash, HC_FIRMWARE_HASH_LEN, hash);
+	if (s_staged_verify.from_v1)
+		return !signed_only;
+	if (memcmp(hash, hdr->hash, HC_FIRMWARE_HASH_LEN))
+		return 0;
+	if (!signed_only)
+		return 1;
+	return ed25519_sha512_verify(pubkey, SHA256_DIGEST_SIZE, s_staged_verify.A_digest, hdr->A_signature) &&
+		ed25519_sha512_verify(pubkey, SHA256_DIGEST_SIZE, s_staged_verify.B_digest, hdr->B_signature);
+}
+
+static void flash_staged_pump()
+{
+	int i;
+	if (cmd_data.flash_staged.prog_issued == cmd_data.flash_staged.prog_done &&
+		cmd_data.flash_staged.prog_issued < cmd_data.flash_staged.read_done &&
+		is_flash_idle()) {
+		i = cmd_data.flash_staged.prog_issued++;
+		u8 *dest = cmd_data.flash_staged.flash_base + (i * BLK_SIZE);
+		const u8 *src = cmd_data.flash_staged.block[i & 1];
+		s_flash_owned = 1;
+		//Erase each sector as programming reaches it
+		if ((u32)dest == flash_sector_to_addr(flash_addr_to_sector((u32)dest))) {
+			flash_write_page(dest, src, BLK_SIZE);
+		} else {
+			flash_write(dest, src, BLK_SIZE);
+		}
+	}
+	//A buffer is reused once the block read two ahead of it has been programmed
+	if (cmd_data.flash_staged.read_issued == cmd_data.flash_staged.read_done &&
+		cmd_data.flash_staged.read_issued < cmd_data.flash_staged.n_blocks &&
+		cmd_data.flash_staged.read_issued <= (cmd_data.flash_staged.prog_done + 1)) {
+		i = cmd_data.flash_staged.read_issued++;
+		read_firmware_stage_block(cmd_data.flash_staged.first_block + i, cmd_data.flash_staged.block[i & 1]);
+	}
+}
+
+static void flash_staged_begin_program()
+{
+	cmd_data.flash_staged.phase = FLASH_STAGED_PROGRAM;
+	cmd_data.flash_staged.read_issued = 0;
+	cmd_data.flash_staged.read_done = 0;
+	cmd_data.flash_staged.prog_issued = 0;
+	cmd_data.flash_staged.prog_done = 0;
+	flash_staged_pump();
+}
+
+void flash_staged_read_complete()
+{
+	int idx = cmd_data.flash_staged.read_issued;
+	const u8 *block = cmd_data.flash_staged.block[0];
+	switch (cmd_data.flash_staged.phase) {
+	case FLASH_STAGED_HEADER: {
+		const struct hc_firmware_file_header_v1 *v1 = (const struct hc_firmware_file_header_v1 *)block;
+		if (v1->file_version == HC_FIRMWARE_FILE_VERSION_V1 && v1->header_size == sizeof(*v1)) {
+			firmware_header_from_v1(&cmd_data.flash_staged.header, v1);
+			cmd_data.flash_staged.header.file_version = HC_FIRMWARE_FILE_VERSION;
+			cmd_data.flash_staged.header.header_size = sizeof(cmd_data.flash_staged.header);
+			s_staged_verify.from_v1 = 1;
+		} else {
+			memcpy(&cmd_data.flash_staged.header, block, sizeof(cmd_data.flash_staged.header));
+			s_staged_verify.from_v1 = 0;
+		}
+		if (!flash_staged_header_valid(&cmd_data.flash_staged.header)) {
+			finish_command_resp(INVALID_INPUT);
+			return;
+		}
+		sha256_init(&s_staged_verify.area_hash);
+		hmac_sha256_set_key(&s_staged_verify.body_hash, HC_FIRMWARE_HASH_KEY_LEN,
+			cmd_data.flash_staged.header.hash_key);
+		cmd_data.flash_staged.phase = FLASH_STAGED_VERIFY;
+		idx = STAGE_A_FIRST_BLOCK;
+		break;
+	}
+	case FLASH_STAGED_VERIFY:
+		//Other CRCs run between blocks so the running value is carried here
+		if (idx == STAGE_A_FIRST_BLOCK || idx == STAGE_B_FIRST_BLOCK) {
+			cmd_data.flash_staged.crc = crc_32(block, BLK_SIZE);
+		} else {
+			cmd_data.flash_staged.crc = crc_32_from(cmd_data.flash_staged.crc, block, BLK_SIZE);
+		}
+		sha256_update(&s_staged_verify.area_hash, BLK_SIZE, block);
+		hmac_sha256_update(&s_staged_verify.body_hash, BLK_SIZE, block);
+		if (idx == (STAGE_B_FIRST_BLOCK - 1)) {
+			cmd_data.flash_staged.A_crc = cmd_data.flash_staged.crc;
+			sha256_digest(&s_staged_verify.area_hash, SHA256_DIGEST_SIZE, s_staged_verify.A_digest);
+		} else if (idx == (STAGE_END_BLOCK - 1)) {
+			cmd_data.flash_staged.B_crc = cmd_data.flash_staged.crc;
+			sha256_digest(&s_staged_verify.area_hash, SHA256_DIGEST_SIZE, s_staged_verify.B_digest);
+			if (cmd_data.flash_staged.A_crc != cmd_data.flash_staged.header.A_crc ||
+				cmd_data.flash_staged.B_crc != cmd_data.flash_staged.header.B_crc ||
+				!flash_staged_authentic(&cmd_data.flash_staged.header)) {
+				finish_command_resp(INVALID_INPUT);
+			} else {
+				flash_staged_begin_program();
+			}
+			return;
+		}
+		idx++;
+		break;
+	case FLASH_STAGED_PROGRAM:
+		cmd_data.flash_staged.read_done++;
+		flash_staged_pump();
+		return;
+	}
+	cmd_data.flash_staged.read_issued = idx;
+	read_firmware_stage_block(idx, cmd_data.flash_staged.block[0]);
+}
+
+static void flash_staged_program_complete()
+{
+	cmd_data.flash_staged.prog_done++;
+	if (cmd_data.flash_staged.prog_done < cmd_data.flash_staged.n_blocks) {
+		flash_staged_pump();
+		return;
+	}
+	u32 len = cmd_data.flash_staged.n_blocks * BLK_SIZE;
+	u32 expected = (cmd_data.flash_staged.flash_base == (u8 *)BOOT_AREA_A) ?
+		cmd_data.flash_staged.header.A_crc : cmd_data.flash_staged.header.B_crc;
+	dcache_invalidate(cmd_data.flash_staged.flash_base, len);
+	if (crc_32(cmd_data.flash_staged.flash_base, len) != expected) {
+		finish_command_resp(WRITE_FAILED);
+		return;
+	}
+	//SWITCH_BOOT_MODE checks the new image against this
+	g_update_firmware.firmware_crc = expected;
+	finish_command_resp(OKAY);
+}
+
+//
+// Compressed files are expanded into the staging area as they arrive. Output
+// is double buffered so decoding continues while the previous block is
+// written. A chunk's command stays active until all of it has been decoded.
+// The header block is written last, after the whole body is staged.
+//
+#define EXPAND_HEADER_LEN (sizeof(struct hc_firmware_file_header) + sizeof(struct hc_firmware_compressed_info))
+#define EXPAND_HEADER_LEN_V1 (sizeof(struct hc_firmware_file_header_v1) + sizeof(struct hc_firmware_compressed_info))
+#define EXPAND_HEADER_FIXED_LEN (offsetof(struct hc_firmware_file_header, hash_key))
+#define EXPAND_BODY_LEN (sizeof(struct hc_firmware_file_body))
+
+enum expand_status {
+	EXPAND_NEED_INPUT,
+	EXPAND_STALLED,
+	EXPAND_FINISHED,
+	EXPAND_ERROR
+};
+
+static struct {
+	u8 out[2][BLK_SIZE];
+	u8 window[HC_FIRMWARE_WINDOW_SIZE];
+	union {
+		u8 bytes[EXPAND_HEADER_LEN];
+		struct {
+			struct hc_firmware_file_header file;
+			struct hc_firmware_compressed_info info;
+		} __attribute__((packed));
+	} header;
+	int header_len;
+	u32 file_offset; //Offset in the file expected next
+	int failed;
+
+	const u8 *in;
+	int in_len;
+	int in_pos;
+
+	int op; //Op being decoded or -1
+	int n_args;
+	int arg_idx;
+	int arg_shift;
+	u32 args[2];
+	u32 remaining; //Bytes the current op has left to produce
+
+	u32 out_pos;
+	int out_cur;
+	int out_fill;
+	int out_block;
+	int writing;
+	int header_written;
+} s_expand;
+
+static int expand_writing()
+{
+	return s_expand.writing;
+}
+
+static void expand_reset()
+{
+	s_expand.header_len = 0;
+	s_expand.file_offset = 0;
+	s_expand.failed = 0;
+	s_expand.op = -1;
+	s_expand.remaining = 0;
+	s_expand.out_pos = 0;
+	s_expand.out_cur = 0;
+	s_expand.out_fill = 0;
+	s_expand.out_block = 0;
+	s_expand.header_written = 0;
+}
+
+//Header bytes expected so far. Older files have a shorter header
+static int expand_header_need()
+{
+	if (s_expand.header_len < EXPAND_HEADER_FIXED_LEN)
+		return EXPAND_HEADER_FIXED_LEN;
+	if (s_expand.header.file.file_version == HC_FIRMWARE_FILE_VERSION_COMPRESSED_V1)
+		return EXPAND_HEADER_LEN_V1;
+	return EXPAND_HEADER_LEN;
+}
+
+//Brings a complete header into the current layout. header_len ends at EXPAND_HEADER_LEN
+static void expand_header_upgrade()
+{
+	u8 v1[EXPAND_HEADER_LEN_V1];
+	if (s_expand.header.file.file_version != HC_FIRMWARE_FILE_VERSION_COMPRESSED_V1)
+		return;
+	memcpy(v1, s_expand.header.bytes, sizeof(v1));
+	if (((struct hc_firmware_file_header_v1 *)v1)->header_size != EXPAND_HEADER_LEN_V1) {
+		s_expand.header.file.header_size = 0;
+	} else {
+		firmware_header_from_v1(&s_expand.header.file, (struct hc_firmware_file_header_v1 *)v1);
+		s_expand.header.file.file_version = HC_FIRMWARE_FILE_VERSION_COMPRESSED;
+		s_expand.header.file.header_size = EXPAND_HEADER_LEN;
+	}
+	memcpy(&s_expand.header.info, v1 + sizeof(struct hc_firmware_file_header_v1), sizeof(s_expand.header.info));
+	s_expand.header_len = EXPAND_HEADER_LEN;
+}
+
+static int expand_header_valid()
+{
+	const struct hc_firmware_file_header *hdr = &s_expand.header.file;
+	const struct hc_firmware_compressed_info *info = &s_expand.header.info;
+	if (hdr->file_prefix != HC_FIRMWARE_FILE_PREFIX ||
+		hdr->file_version != HC_FIRMWARE_FILE_VERSION_COMPRESSED ||
+		hdr->header_size != EXPAND_HEADER_LEN ||
+		hdr->A_len > HC_BOOT_AREA_A_LEN ||
+		hdr->B_len > HC_BOOT_AREA_B_LEN ||
+		memcmp(&hdr->fw_version, &g_update_firmware.fw_version, sizeof(hdr->fw_version))) {
+		return 0;
+	}
+	//A delta only applies on top of the exact firmware it was made from
+	if (info->flags & HC_FIRMWARE_DELTA) {
+		return crc_32((u8 *)BOOT_AREA_A, HC_BOOT_AREA_A_LEN) == info->base_A_crc &&
+			crc_32((u8 *)BOOT_AREA_B, HC_BOOT_AREA_B_LEN) == info->base_B_crc;
+	}
+	return 1;
+}
+
+static int expand_op_valid()
+{
+	u32 len = s_expand.args[0];
+	if (len > (EXPAND_BODY_LEN - s_expand.out_pos))
+		return 0;
+	switch (s_expand.op) {
+	case HC_FW_OP_MATCH:
+		return s_expand.args[1] && s_expand.args[1] <= HC_FIRMWARE_WINDOW_SIZE &&
+			s_expand.args[1] <= s_expand.out_pos;
+	case HC_FW_OP_BASE:
+		return (s_expand.header.info.flags & HC_FIRMWARE_DELTA) &&
+			s_expand.args[1] <= EXPAND_BODY_LEN &&
+			len <= (EXPAND_BODY_LEN - s_expand.args[1]);
+	default:
+		return 1;
+	}
+}
+
+//The body of the installed firmware is boot area A followed by boot area B
+static u8 expand_base_byte(u32 offset)
+{
+	if (offset < HC_BOOT_AREA_A_LEN)
+		return ((const u8 *)BOOT_AREA_A)[offset];
+	return ((const u8 *)BOOT_AREA_B)[offset - HC_BOOT_AREA_A_LEN];
+}
+
+//Returns 0 if the previous block is still being written
+static int expand_flush()
+{
+	if (s_expand.writing)
+		return 0;
+	write_firmware_stage_block(STAGE_A_FIRST_BLOCK + s_expand.out_block, s_expand.out[s_expand.out_cur]);
+	s_expand.writing = 1;
+	s_expand.out_block++;
+	s_expand.out_cur ^= 1;
+	s_expand.out_fill = 0;
+	return 1;
+}
+
+static enum expand_status expand_run()
+{
+	while (1) {
+		if (s_expand.out_fill == BLK_SIZE && !expand_flush())
+			return EXPAND_STALLED;
+		if (s_expand.out_pos == EXPAND_BODY_LEN)
+			return (s_expand.in_pos == s_expand.in_len) ? EXPAND_FINISHED : EXPAND_ERROR;
+		if (s_expand.remaining) {
+			u8 b = 0;
+			switch (s_expand.op) {
+			case HC_FW_OP_LITERAL:
+				if (s_expand.in_pos == s_expand.in_len)
+					return EXPAND_NEED_INPUT;
+				b = s_expand.in[s_expand.in_pos++];
+				break;
+			case HC_FW_OP_MATCH:
+				b = s_expand.window[(s_expand.out_pos - s_expand.args[1]) & (HC_FIRMWARE_WINDOW_SIZE - 1)];
+				break;
+			case HC_FW_OP_BASE:
+				b = expand_base_byte(s_expand.args[1]++);
+				break;
+			default:
+				break;
+			}
+			s_expand.out[s_expand.out_cur][s_expand.out_fill++] = b;
+			s_expand.window[s_expand.out_pos & (HC_FIRMWARE_WINDOW_SIZE - 1)] = b;
+			s_expand.out_pos++;
+			if (!--s_expand.remaining)
+				s_expand.op = -1;
+			continue;
+		}
+		if (s_expand.in_pos == s_expand.in_len)
+			return EXPAND_NEED_INPUT;
+		u8 c = s_expand.in[s_expand.in_pos++];
+		if (s_expand.op == -1) {
+			if (c > HC_FW_OP_BASE)
+				return EXPAND_ERROR;
+			s_expand.op = c;
+			s_expand.n_args = (c == HC_FW_OP_LITERAL || c == HC_FW_OP_ZERO) ? 1 : 2;
+			s_expand.arg_idx = 0;
+			s_expand.arg_shift = 0;
+			s_expand.args[0] = 0;
+			s_expand.args[1] = 0;
+			continue;
+		}
+		if (s_expand.arg_shift > 28)
+			return EXPAND_ERROR;
+		s_expand.args[s_expand.arg_idx] |= ((u32)(c & 0x7f)) << s_expand.arg_shift;
+		s_expand.arg_shift += 7;
+		if (c & 0x80)
+			continue;
+		s_expand.arg_shift = 0;
+		if (++s_expand.arg_idx < s_expand.n_args)
+			continue;
+		if (!expand_op_valid())
+			return EXPAND_ERROR;
+		s_expand.remaining = s_expand.args[0];
+		if (!s_expand.remaining)
+			s_expand.op = -1;
+	}
+}
+
+static void write_compressed_firmware_iter()
+{
+	switch (expand_run()) {
+	case EXPAND_NEED_INPUT:
+		finish_command_resp(OKAY);
+		break;
+	case EXPAND_STALLED:
+		//Resumed once the block being written completes
+		break;
+	case EXPAND_FINISHED:
+		if (s_expand.writing)
+			break;
+		if (!s_expand.header_written) {
+			u8 *blk = s_expand.out[s_expand.out_cur];
+			struct hc_firmware_file_header *hdr = (struct hc_firmware_file_header *)blk;
+			memset(blk, 0, BLK_SIZE);
+			memcpy(hdr, &s_expand.header.file, sizeof(*hdr));
+			hdr->file_version = HC_FIRMWARE_FILE_VERSION;
+			hdr->header_size = sizeof(*hdr);
+			write_firmware_stage_block(STAGE_HEADER_BLOCK, blk);
+			s_expand.writing = 1;
+			s_expand.header_written = 1;
+			break;
+		}
+		finish_command_resp(DONE);
+		break;
+	case EXPAND_ERROR:
+		s_expand.failed = 1;
+		finish_command_resp(INVALID_INPUT);
+		break;
+	}
+}
+
+//Staging area writes can finish after the chunk that caused them was answered
+int firmware_stage_write_complete()
+{
+	if (!s_expand.writing)
+		return 0;
+	s_expand.writing = 0;
+	if (active_cmd == WRITE_COMPRESSED_FIRMWARE_HC) {
+		write_compressed_firmware_iter();
+	}
+	return 1;
+}
+
+static void write_compressed_firmware_cmd(u8 *data, int data_len)
+{
+	if (data_len < 4 || data_len > (4 + BLK_SIZE) ||
+		s_flash_pipe.programming != -1 || s_flash_pipe.pending != -1) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	u32 offset = data[0] + (data[1] << 8) + (data[2] << 16) + (data[3] << 24);
+	if (offset == 0 && !s_expand.writing) {
+		expand_reset();
+	} else if (offset != s_expand.file_offset || s_expand.failed) {
+		finish_command_resp(INVALID_INPUT);
+		return;
+	}
+	s_expand.in = data + 4;
+	s_expand.in_len = data_len - 4;
+	s_expand.in_pos = 0;
+	s_expand.file_offset += s_expand.in_len;
+
+	if (s_expand.header_len < EXPAND_HEADER_LEN) {
+		while (s_expand.header_len < expand_header_need() && s_expand.in_pos < s_expand.in_len) {
+			s_expand.header.bytes[s_expand.header_len++] = s_expand.in[s_expand.in_pos++];
+		}
+		if (s_expand.header_len < expand_header_need()) {
+			finish_command_resp(OKAY);
+			return;
+		}
+		expand_header_upgrade();
+		if (!expand_header_valid()) {
+			s_expand.failed = 1;
+			finish_command_resp(INVALID_INPUT);
+			return;
+		}
+	}
+	write_compressed_firmware_iter();
+}
+
 static void reset_device_cmd(u8 *data, int data_len)
 {
 	HAL_NVIC_SystemReset();
@@ -130,6 +858,10 @@ void switch_boot_mode_cmd(u8 *data, int data_len)
 {
 	enum hc_boot_mode mode = flash_get_boot_mode();
 	u32 crc;
+	if (flash_pipe_busy()) {
+		finish_command_resp(INVALID_STATE);
+		return;
+	}
 	switch (mode) {
 	case HC_BOOT_BOOTLOADER_MODE:
 		crc = crc_32((u8 *)BOOT_AREA_B, HC_BOOT_AREA_B_LEN);
@@ -165,6 +897,18 @@ int firmware_update_state(int cmd, u8 *data, int data_len)
 	case WRITE_FLASH:
 		write_flash_cmd(data, data_len);
 		break;
+	case WRITE_FLASH_HC:
+		write_flash_hc_cmd(data, data_len);
+		break;
+	case WRITE_FIRMWARE_STAGE_HC:
+		write_firmware_stage_cmd(data, data_len);
+		break;
+	case FLASH_STAGED_FIRMWARE_HC:
+		flash_staged_cmd(data, data_len);
+		break;
+	case WRITE_COMPRESSED_FIRMWARE_HC:
+		write_compressed_firmware_cmd(data, data_len);
+		break;
 	case SWITCH_BOOT_MODE:
 		switch_boot_mode_cmd(data, data_len);
 		break;
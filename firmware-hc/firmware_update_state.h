@@ -12,4 +12,6 @@ void switch_boot_mode_cmd(u8 *data, int data_len);
 void update_firmware_cmd(u8 *data, int data_len);
 void update_firmware_cmd_complete();
 void write_flash_cmd_complete();
+void flash_staged_read_complete();
+int firmware_stage_write_complete();
 #endif
@@ -1,47 +1,405 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
 typedef unsigned char u8;
 #include "signetdev_hc_common.h"
 #include <zlib.h>
+#include <nettle/sha2.h>
+#include <nettle/hmac.h>
+#include <nettle/eddsa.h>
 
 struct hc_firmware_file_header fw_file_hdr;
-struct hc_firmware_file_body fw_file_body;
+struct hc_firmware_compressed_info fw_compressed_info;
+static u8 *base_body;
 
-int main(int argc, char **argv)
+//Options, shared by every image in a batch
+static int compress_output;
+static const char *base_path;
+static const char *sign_key_path;
+static const char *hash_key_path;
+static u8 sign_key[ED25519_KEY_SIZE];
+static u8 sign_pubkey[ED25519_KEY_SIZE];
+
+#define BODY_LEN (sizeof(struct hc_firmware_file_body))
+#define HASH_BITS (16)
+#define HASH_CHAIN_MAX (64)
+#define MIN_MATCH (4)
+#define MIN_ZERO_RUN (8)
+#define CHUNK_SIZE (1<<16)
+
+static u8 *stream;
+static size_t stream_len;
+static size_t stream_cap;
+
+static void put_byte(u8 b)
+{
+	if (stream_len == stream_cap) {
+		stream_cap = stream_cap ? stream_cap * 2 : 65536;
+		stream = realloc(stream, stream_cap);
+	}
+	stream[stream_len++] = b;
+}
+
+static void put_varint(u32 v)
+{
+	while (v >= 0x80) {
+		put_byte((u8)(v | 0x80));
+		v >>= 7;
+	}
+	put_byte((u8)v);
+}
+
+static void put_literals(const u8 *body, size_t start, size_t end)
+{
+	if (start == end)
+		return;
+	put_byte(HC_FW_OP_LITERAL);
+	put_varint(end - start);
+	while (start < end)
+		put_byte(body[start++]);
+}
+
+static u32 hash4(const u8 *p)
+{
+	u32 v = p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static size_t match_len(const u8 *a, const u8 *b, size_t max)
+{
+	size_t n = 0;
+	while (n < max && a[n] == b[n])
+		n++;
+	return n;
+}
+
+//
+// Greedy compressor. At each position the longest of a zero run, a match in
+// the last HC_FIRMWARE_WINDOW_SIZE bytes and, for deltas, a match anywhere in
+// the base firmware is emitted. Anything shorter than MIN_MATCH is a literal.
+//
+static void compress_body(const u8 *body, const u8 *base)
+{
+	int *head = malloc(sizeof(int) << HASH_BITS);
+	int *prev = malloc(sizeof(int) * BODY_LEN);
+	int *base_head = malloc(sizeof(int) << HASH_BITS);
+	int *base_prev = malloc(sizeof(int) * BODY_LEN);
+	size_t i;
+	memset(head, 0xff, sizeof(int) << HASH_BITS);
+	memset(base_head, 0xff, sizeof(int) << HASH_BITS);
+	if (base) {
+		for (i = 0; i + MIN_MATCH <= BODY_LEN; i++) {
+			u32 h = hash4(base + i);
+			base_prev[i] = base_head[h];
+			base_head[h] = i;
+		}
+	}
+
+	size_t literal_start = 0;
+	i = 0;
+	while (i < BODY_LEN) {
+		size_t remaining = BODY_LEN - i;
+		size_t best_len = 0;
+		size_t best_arg = 0;
+		int best_op = HC_FW_OP_LITERAL;
+
+		size_t zeros = 0;
+		while (zeros < remaining && !body[i + zeros])
+			zeros++;
+		if (zeros >= MIN_ZERO_RUN) {
+			best_len = zeros;
+			best_op = HC_FW_OP_ZERO;
+		}
+		if (remaining >= MIN_MATCH) {
+			u32 h = hash4(body + i);
+			int j = head[h];
+			int chain = 0;
+			while (j >= 0 && (i - j) <= HC_FIRMWARE_WINDOW_SIZE && chain++ < HASH_CHAIN_MAX) {
+				size_t len = match_len(body + i, body + j, remaining);
+				if (len > best_len) {
+					best_len = len;
+					best_arg = i - j;
+					best_op = HC_FW_OP_MATCH;
+				}
+				j = prev[j];
+			}
+			if (base) {
+				size_t len = match_len(body + i, base + i, remaining);
+				if (len > best_len) {
+					best_len = len;
+					best_arg = i;
+					best_op = HC_FW_OP_BASE;
+				}
+				j = base_head[h];
+				chain = 0;
+				while (j >= 0 && chain++ < HASH_CHAIN_MAX) {
+					len = match_len(body + i, base + j, BODY_LEN - j < remaining ? BODY_LEN - j : remaining);
+					if (len > best_len) {
+						best_len = len;
+						best_arg = j;
+						best_op = HC_FW_OP_BASE;
+					}
+					j = base_prev[j];
+				}
+			}
+		}
+		if (best_op == HC_FW_OP_LITERAL || best_len < MIN_MATCH) {
+			best_len = 1;
+			best_op = HC_FW_OP_LITERAL;
+		} else {
+			put_literals(body, literal_start, i);
+			put_byte(best_op);
+			put_varint(best_len);
+			if (best_op != HC_FW_OP_ZERO)
+				put_varint(best_arg);
+		}
+		size_t end = i + best_len;
+		for (; i < end; i++) {
+			if (i + MIN_MATCH <= BODY_LEN) {
+				u32 h = hash4(body + i);
+				prev[i] = head[h];
+				head[h] = i;
+			}
+		}
+		if (best_op != HC_FW_OP_LITERAL)
+			literal_start = i;
+	}
+	put_literals(body, literal_start, BODY_LEN);
+	free(head);
+	free(prev);
+	free(base_head);
+	free(base_prev);
+}
+
+static int read_key_file(const char *path, u8 *key, size_t len)
 {
-	if (argc <= 5)
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	size_t n = fread(key, 1, len, f);
+	fclose(f);
+	return (n == len) ? 0 : -1;
+}
+
+//
+// The base may be an uncompressed file of either layout. Only the fields
+// ahead of the signatures are used and those haven't moved.
+//
+static int read_base_file(const char *path)
+{
+	struct hc_firmware_file_header_v1 base_hdr;
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	base_body = malloc(BODY_LEN);
+	if (!base_body ||
+		fread(&base_hdr, 1, sizeof(base_hdr), f) != sizeof(base_hdr) ||
+		base_hdr.file_prefix != HC_FIRMWARE_FILE_PREFIX ||
+		(base_hdr.file_version != HC_FIRMWARE_FILE_VERSION &&
+		 base_hdr.file_version != HC_FIRMWARE_FILE_VERSION_V1) ||
+		fseek(f, base_hdr.header_size, SEEK_SET) ||
+		fread(base_body, 1, BODY_LEN, f) != BODY_LEN) {
+		free(base_body);
+		base_body = NULL;
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	fw_compressed_info.flags |= HC_FIRMWARE_DELTA;
+	fw_compressed_info.base_version = base_hdr.fw_version;
+	fw_compressed_info.base_A_crc = crc32(0, base_body, HC_BOOT_AREA_A_LEN);
+	fw_compressed_info.base_B_crc = crc32(0, base_body + HC_BOOT_AREA_A_LEN, HC_BOOT_AREA_B_LEN);
+	return 0;
+}
+
+//
+// Reads one image in CHUNK_SIZE pieces, zero padded to the size of its boot
+// area. Each piece is hashed and then either written to 'out' or copied to
+// 'body' for compression. Returns the length of the image or -1.
+//
+static long encode_area(const char *path, size_t area_len, u32 *crc, struct sha256_ctx *area_hash,
+		struct hmac_sha256_ctx *body_hash, FILE *out, u8 *body)
+{
+	static u8 chunk[CHUNK_SIZE];
+	size_t pos = 0;
+	size_t img_len;
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	*crc = crc32(0, NULL, 0);
+	sha256_init(area_hash);
+	while (1) {
+		size_t n = fread(chunk, 1, CHUNK_SIZE, f);
+		if (!n)
+			break;
+		if (n > (area_len - pos)) {
+			fclose(f);
+			return -1;
+		}
+		*crc = crc32(*crc, chunk, n);
+		sha256_update(area_hash, n, chunk);
+		hmac_sha256_update(body_hash, n, chunk);
+		if (out)
+			fwrite(chunk, 1, n, out);
+		else
+			memcpy(body + pos, chunk, n);
+		pos += n;
+	}
+	fclose(f);
+	img_len = pos;
+	memset(chunk, 0, CHUNK_SIZE);
+	while (pos < area_len) {
+		size_t n = (area_len - pos) < CHUNK_SIZE ? (area_len - pos) : CHUNK_SIZE;
+		*crc = crc32(*crc, chunk, n);
+		sha256_update(area_hash, n, chunk);
+		hmac_sha256_update(body_hash, n, chunk);
+		if (out)
+			fwrite(chunk, 1, n, out);
+		else
+			memset(body + pos, 0, n);
+		pos += n;
+	}
+	return img_len;
+}
+
+static void sign_area(struct sha256_ctx *area_hash, u8 *signature)
+{
+	u8 digest[SHA256_DIGEST_SIZE];
+	sha256_digest(area_hash, SHA256_DIGEST_SIZE, digest);
+	if (sign_key_path)
+		ed25519_sha512_sign(sign_pubkey, sign_key, SHA256_DIGEST_SIZE, digest, signature);
+}
+
+static int encode_file(char **args)
+{
+	struct sha256_ctx area_hash;
+	struct hmac_sha256_ctx body_hash;
+	u8 *body = NULL;
+	long szA, szB;
+	u32 crcA, crcB;
+	FILE *fwOut = fopen(args[2],"wb");
+	if (!fwOut)
 		return -1;
-	FILE *fwA = fopen(argv[1],"rb");
-	FILE *fwB = fopen(argv[2],"rb");
-	FILE *fwOut = fopen(argv[3],"wb");
-	fseek(fwA, 0L, SEEK_END);
-	int szA = ftell(fwA);
-	fseek(fwA, 0, SEEK_SET);
-	
-	fseek(fwB, 0L, SEEK_END);
-	int szB = ftell(fwB);
-	fseek(fwB, 0, SEEK_SET);
 
 	memset(&fw_file_hdr, 0, sizeof(fw_file_hdr));
-	memset(&fw_file_body, 0, sizeof(fw_file_body));
-
-	fread(fw_file_body.firmware_A, 1, szA, fwA);
-	fread(fw_file_body.firmware_B, 1, szB, fwB);
-	
-	fw_file_hdr.fw_version.major = atoi(argv[4]);
-	fw_file_hdr.fw_version.minor = atoi(argv[5]);
-	fw_file_hdr.fw_version.step = atoi(argv[6]);
-	fw_file_hdr.fw_version.padding = 0;;
+	fw_file_hdr.fw_version.major = atoi(args[3]);
+	fw_file_hdr.fw_version.minor = atoi(args[4]);
+	fw_file_hdr.fw_version.step = atoi(args[5]);
+	fw_file_hdr.fw_version.padding = 0;
 	fw_file_hdr.file_prefix = HC_FIRMWARE_FILE_PREFIX;
-	fw_file_hdr.file_version = HC_FIRMWARE_FILE_VERSION;
-	fw_file_hdr.header_size = sizeof(fw_file_hdr);
+	fw_file_hdr.file_version = compress_output ? HC_FIRMWARE_FILE_VERSION_COMPRESSED : HC_FIRMWARE_FILE_VERSION;
+	fw_file_hdr.header_size = sizeof(fw_file_hdr) + (compress_output ? sizeof(fw_compressed_info) : 0);
+	if (hash_key_path) {
+		if (read_key_file(hash_key_path, fw_file_hdr.hash_key, HC_FIRMWARE_HASH_KEY_LEN))
+			goto fail;
+	} else if (read_key_file("/dev/urandom", fw_file_hdr.hash_key, HC_FIRMWARE_HASH_KEY_LEN)) {
+		goto fail;
+	}
+	if (sign_key_path)
+		memcpy(fw_file_hdr.signature_pubkey, sign_pubkey, HC_FIRMWARE_SIGNATURE_PUBKEY_LEN);
+	hmac_sha256_set_key(&body_hash, HC_FIRMWARE_HASH_KEY_LEN, fw_file_hdr.hash_key);
+
+	//Uncompressed bodies are streamed out after space for the header
+	if (compress_output) {
+		body = malloc(BODY_LEN);
+		if (!body)
+			goto fail;
+	} else {
+		fseek(fwOut, fw_file_hdr.header_size, SEEK_SET);
+	}
+	szA = encode_area(args[0], HC_BOOT_AREA_A_LEN, &crcA, &area_hash, &body_hash,
+			compress_output ? NULL : fwOut, body);
+	if (szA < 0) {
+		fprintf(stderr, "Can't read %s or it is larger than %d bytes\n", args[0], HC_BOOT_AREA_A_LEN);
+		goto fail;
+	}
+	sign_area(&area_hash, fw_file_hdr.A_signature);
+	szB = encode_area(args[1], HC_BOOT_AREA_B_LEN, &crcB, &area_hash, &body_hash,
+			compress_output ? NULL : fwOut, body ? body + HC_BOOT_AREA_A_LEN : NULL);
+	if (szB < 0) {
+		fprintf(stderr, "Can't read %s or it is larger than %d bytes\n", args[1], HC_BOOT_AREA_B_LEN);
+		goto fail;
+	}
+	sign_area(&area_hash, fw_file_hdr.B_signature);
+	hmac_sha256_digest(&body_hash, HC_FIRMWARE_HASH_LEN, fw_file_hdr.hash);
 	fw_file_hdr.A_len = szA;
-	fw_file_hdr.A_crc = crc32(0, fw_file_body.firmware_A, sizeof(fw_file_body.firmware_A));
+	fw_file_hdr.A_crc = crcA;
 	fw_file_hdr.B_len = szB;
-	fw_file_hdr.B_crc = crc32(0, fw_file_body.firmware_B, sizeof(fw_file_body.firmware_B));
+	fw_file_hdr.B_crc = crcB;
 
+	fseek(fwOut, 0, SEEK_SET);
 	fwrite(&fw_file_hdr, 1, sizeof(fw_file_hdr),fwOut);
-	fwrite(&fw_file_body, 1, sizeof(fw_file_body),fwOut);
+	if (compress_output) {
+		stream_len = 0;
+		compress_body(body, base_body);
+		fwrite(&fw_compressed_info, 1, sizeof(fw_compressed_info),fwOut);
+		fwrite(stream, 1, stream_len, fwOut);
+	}
+	if (ferror(fwOut))
+		goto fail;
+	free(body);
+	if (fclose(fwOut)) {
+		remove(args[2]);
+		return -1;
+	}
+	return 0;
+fail:
+	//Don't leave a truncated image behind
+	free(body);
 	fclose(fwOut);
+	remove(args[2]);
+	return -1;
+}
+
+//
+// Any number of images can be encoded in one run by repeating the six
+// positional arguments. Options apply to all of them.
+//
+int main(int argc, char **argv)
+{
+	char *args[argc];
+	int n_args = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-c")) {
+			compress_output = 1;
+		} else if (!strcmp(argv[i], "-d") && (i + 1) < argc) {
+			compress_output = 1;
+			base_path = argv[++i];
+		} else if (!strcmp(argv[i], "-s") && (i + 1) < argc) {
+			sign_key_path = argv[++i];
+		} else if (!strcmp(argv[i], "-k") && (i + 1) < argc) {
+			hash_key_path = argv[++i];
+		} else if (argv[i][0] == '-' && argv[i][1]) {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return -1;
+		} else {
+			args[n_args++] = argv[i];
+		}
+	}
+	if (!n_args || (n_args % 6)) {
+		fprintf(stderr, "Usage: %s [-c] [-d <base.sfwhc>] [-s <signing key>] [-k <hash key>] "
+			"<fw-a.bin> <fw-b.bin> <out.sfwhc> <major> <minor> <step> ...\n", argv[0]);
+		return -1;
+	}
+	memset(&fw_compressed_info, 0, sizeof(fw_compressed_info));
+	if (base_path && read_base_file(base_path)) {
+		fprintf(stderr, "Can't read base firmware file %s\n", base_path);
+		return -1;
+	}
+	if (sign_key_path) {
+		if (read_key_file(sign_key_path, sign_key, ED25519_KEY_SIZE)) {
+			fprintf(stderr, "Can't read signing key %s\n", sign_key_path);
+			return -1;
+		}
+		ed25519_sha512_public_key(sign_pubkey, sign_key);
+	}
+	for (i = 0; i < n_args; i += 6) {
+		if (encode_file(args + i)) {
+			fprintf(stderr, "Failed to encode %s\n", args[i + 2]);
+			return -1;
+		}
+	}
+	return 0;
 }
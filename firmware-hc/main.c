@@ -12,6 +12,9 @@
 #include "usb_keyboard.h"
 #include "crc.h"
 #include "usbd_msc_scsi.h"
+#include "usbd_msc_uas.h"
+#include "usbd_hid.h"
+#include "usbd_cmd_bulk.h"
 #include "fido2/crypto.h"
 #include "fido2/ctaphid.h"
 #include "memory_layout.h"
@@ -91,7 +94,7 @@ static void MX_DMA_Init(void);
 #define USB_BULK_BUFFER_SIZE (16384)
 #define USB_BULK_BUFFER_COUNT (4)
 
-static uint8_t g_usbBulkBuffer[USB_BULK_BUFFER_SIZE * USB_BULK_BUFFER_COUNT] __attribute__((aligned(16)));
+static uint8_t g_usbBulkBuffer[USB_BULK_BUFFER_SIZE * USB_BULK_BUFFER_COUNT] DMA_BUFFER;
 struct bufferFIFO usbBulkBufferFIFO;
 
 static int g_ms_last_pressed = 0;
@@ -219,7 +222,7 @@ void blink_idle()
 			if (next_timeout_event_secs != g_timeout_event_secs) {
 				g_timeout_event_secs = next_timeout_event_secs;
 				if (g_device_state != DS_DISCONNECTED && g_device_state != DS_RESET) {
-					cmd_event_send(2, &g_timeout_event_secs, sizeof(g_timeout_event_secs));
+					cmd_event_send(HC_EVENT_BUTTON_TIMEOUT, &g_timeout_event_secs, sizeof(g_timeout_event_secs));
 				}
 			}
 		}
@@ -416,11 +419,202 @@ static int emmc_compare_test(const u8 *write_block, u8 *read_block, int blink_of
 	return 0;
 }
 
+static void timer_idle()
+{
+	int ms_count = HAL_GetTick();
+	if (ms_count > g_timer_target && g_timer_target != 0) {
+		timer_timeout();
+		g_timer_target = 0;
+		END_WORK(TIMER_WORK);
+	}
+}
+
+#if ENABLE_MMC_STANDBY
+static void emmc_standby_idle()
+{
+	int ms_count = HAL_GetTick();
+	if (g_emmc_idle_ms != -1 && ms_count > (g_emmc_idle_ms + 1000)) {
+		g_emmc_idle_ms = -1;
+		END_WORK(MMC_IDLE_WORK);
+		emmc_user_queue(EMMC_USER_STANDBY);
+	}
+}
+#endif
+
+static void sync_root_block_idle()
+{
+	if (sync_root_block_pending() && is_flash_idle() && !sync_root_block_writing()) {
+		sync_root_block_immediate();
+	}
+}
+
+static void usb_bulk_buffer_idle()
+{
+	bufferFIFO_idle(&usbBulkBufferFIFO);
+}
+
+static void button_idle()
+{
+	int ms_count = HAL_GetTick();
+	int current_button_state = buttonState() ? 0 : 1;
+
+	if (g_press_pending) {
+		g_press_pending = 0;
+		END_WORK(BUTTON_PRESS_WORK);
+		if (!g_button_state) {
+			switch (resource_owner(RESOURCE_BUTTON)) {
+			case SIGNET_SUBSYSTEM:
+				button_press();
+				break;
+#ifdef ENABLE_FIDO2
+			case CTAP_SUBSYSTEM:
+				ctaphid_press();
+				break;
+#endif
+			case NO_SUBSYSTEM:
+				button_press_unprompted();
+				break;
+			default:
+				break;
+			}
+			g_button_state = 1;
+			BEGIN_WORK(BUTTON_PRESSING_WORK);
+		}
+	}
+	if (!current_button_state && g_button_state && (ms_count - g_ms_last_pressed) > 100) {
+		button_release();
+		g_button_state = 0;
+		END_WORK(BUTTON_PRESSING_WORK);
+	}
+	if (g_button_state && ((ms_count - g_ms_last_pressed) > 2000)) {
+		g_button_state = 0;
+		END_WORK(BUTTON_PRESSING_WORK);
+		switch (resource_owner(RESOURCE_BUTTON)) {
+		case SIGNET_SUBSYSTEM:
+			long_button_press();
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+struct work_handler {
+	int work;
+	void (*handler)();
+};
+
+//
+// Interrupt handlers post work with BEGIN_WORK(). Handlers are listed from
+// highest to lowest priority: storage completions first, then command and
+// CTAP requests, then UI.
+//
+static const struct work_handler s_work_handlers[] = {
+	{BUFFER_FIFO_WORK, usb_bulk_buffer_idle},
+	{USBD_SCSI_WORK, usbd_scsi_idle},
+	{USBD_UAS_WORK, usbd_uas_idle},
+	{MMC_RX_CPLT_WORK | MMC_TX_CPLT_WORK | MMC_TX_DMA_CPLT_WORK | MMC_CARD_BUSY_WORK |
+	 READ_DB_TX_CPLT_WORK | WRITE_DB_TX_WORK, command_idle},
+	{FLASH_WORK, flash_idle},
+	{SYNC_ROOT_BLOCK_WORK, sync_root_block_idle},
+#if ENABLE_MMC_STANDBY
+	{MMC_IDLE_WORK, emmc_standby_idle},
+#endif
+
+	{CMD_RX_WORK, usbd_hid_cmd_rx_idle},
+	{CMD_BULK_RX_WORK, usbd_cmd_bulk_rx_idle},
+	{CMD_STREAM_WORK, cmd_stream_idle},
+#ifdef ENABLE_FIDO2
+	{CTAP_RX_WORK, usbd_hid_fido_rx_idle},
+#endif
+
+	{BUTTON_PRESS_WORK | BUTTON_PRESSING_WORK, button_idle},
+	{KEYBOARD_WORK, usb_keyboard_idle},
+	{TIMER_WORK, timer_idle},
+	{BLINK_WORK, blink_idle}
+};
+
+#define NUM_WORK_HANDLERS (sizeof(s_work_handlers)/sizeof(s_work_handlers[0]))
+
+//
+// Run the highest priority handler with pending work, then look again from
+// the top so work posted meanwhile by a higher priority interrupt goes next.
+// Each handler runs at most once per call so work that stays pending while
+// it waits on something else can't starve lower priorities.
+//
+static void run_work_handlers()
+{
+	u32 ran = 0;
+	int i;
+	do {
+		int work = g_work_to_do;
+		for (i = 0; i < NUM_WORK_HANDLERS; i++) {
+			if ((work & s_work_handlers[i].work) && !(ran & (1 << i))) {
+				ran |= (1 << i);
+				s_work_handlers[i].handler();
+				break;
+			}
+		}
+	} while (i < NUM_WORK_HANDLERS);
+}
+
+#define DMA_BUFFER_REGION_SIZE (128 * 1024)
+#define DMA_BUFFER_SUBREGION_SIZE (DMA_BUFFER_REGION_SIZE / 8)
+
+static void MPU_Config()
+{
+	MPU_Region_InitTypeDef region;
+	int n_subregions = (_edma_buffers - _sdma_buffers + DMA_BUFFER_SUBREGION_SIZE - 1) / DMA_BUFFER_SUBREGION_SIZE;
+
+	HAL_MPU_Disable();
+	region.Enable = MPU_REGION_ENABLE;
+	region.Number = MPU_REGION_NUMBER0;
+	region.BaseAddress = (u32)_sdma_buffers;
+	region.Size = MPU_REGION_SIZE_128KB;
+	//Only cover as much of the region as the DMA buffers use
+	region.SubRegionDisable = (0xff << n_subregions) & 0xff;
+	region.TypeExtField = MPU_TEX_LEVEL1;
+	region.AccessPermission = MPU_REGION_FULL_ACCESS;
+	region.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	region.IsShareable = MPU_ACCESS_SHAREABLE;
+	region.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+	region.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+	HAL_MPU_ConfigRegion(&region);
+	HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+
+#define DCACHE_LINE_SIZE (32)
+
+//The CMSIS *_by_Addr functions don't round to cache lines themselves
+#define DCACHE_OP(op, addr, len) do {\
+		u32 start = ((u32)(addr)) & ~(DCACHE_LINE_SIZE - 1);\
+		u32 end = ((u32)(addr)) + (len);\
+		if ((len) > 0) {\
+			op((uint32_t *)start, end - start);\
+		}\
+	} while (0)
+
+void dcache_clean(const void *addr, int len)
+{
+	DCACHE_OP(SCB_CleanDCache_by_Addr, addr, len);
+}
+
+void dcache_clean_invalidate(void *addr, int len)
+{
+	DCACHE_OP(SCB_CleanInvalidateDCache_by_Addr, addr, len);
+}
+
+void dcache_invalidate(void *addr, int len)
+{
+	DCACHE_OP(SCB_InvalidateDCache_by_Addr, addr, len);
+}
+
 int main (void)
 {
+	memset(_sdma_buffers, 0, _edma_buffers - _sdma_buffers);
+	MPU_Config();
 	SCB_EnableICache();
-	//We don't enable DCACHE tp ensure coherency for DMA transfers
-	//SCB_EnableDCache();
+	SCB_EnableDCache();
 	HAL_Init();
 	SystemClock_Config();
 	MX_GPIO_Init();
@@ -433,7 +627,7 @@ int main (void)
 	MX_AES_Init();
 	MX_SDMMC1_MMC_Init();
 
-	//TODO: move this elsewhere
+	//Cycle counter used by rtc_rand and trace
 	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
 	DWT->CYCCNT = 0;
 	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
@@ -474,6 +668,7 @@ int main (void)
 	usbBulkBufferFIFO.maxBufferSize = USB_BULK_BUFFER_SIZE;
 	usbBulkBufferFIFO.bufferStorage = g_usbBulkBuffer;
 	usbBulkBufferFIFO.bufferCount = USB_BULK_BUFFER_COUNT;
+	usbBulkBufferFIFO.arenaSize = sizeof(g_usbBulkBuffer);
 
 	HAL_Delay(5);
 
@@ -598,13 +793,13 @@ int main (void)
 		__disable_irq();
 		int work_to_do = g_work_to_do;
 #if ENABLE_FIDO2
-		if (!g_ctap_initialized && (rand_avail() >= ctap_init_rand_needed) && device_subsystem_owner() == NO_SUBSYSTEM) {
+		if (!g_ctap_initialized && (rand_avail() >= ctap_init_rand_needed) && resources_idle()) {
 			work_to_do = 1;
 			__enable_irq();
-			if (request_device(CTAP_STARTUP_SUBSYSTEM)) {
+			if (request_resources(CTAP_STARTUP_SUBSYSTEM, ALL_RESOURCES)) {
 				ctap_init_finish();
 				g_ctap_initialized = 1;
-				release_device_request(CTAP_STARTUP_SUBSYSTEM);
+				release_resources(CTAP_STARTUP_SUBSYSTEM, ALL_RESOURCES);
 			}
 		} else if (!work_to_do) {
 			HAL_SuspendTick();
@@ -645,67 +840,7 @@ int main (void)
 			}
 		}
 
-		if (ms_count > g_timer_target && g_timer_target != 0) {
-			timer_timeout();
-			g_timer_target = 0;
-			END_WORK(TIMER_WORK);
-		}
-#if ENABLE_MMC_STANDBY
-		if (g_emmc_idle_ms != -1 && ms_count > (g_emmc_idle_ms + 1000)) {
-			g_emmc_idle_ms = -1;
-			END_WORK(MMC_IDLE_WORK);
-			emmc_user_queue(EMMC_USER_STANDBY);
-		}
-#endif
-		usb_keyboard_idle();
-		blink_idle();
-		command_idle();
-		if (sync_root_block_pending() && is_flash_idle() && !sync_root_block_writing()) {
-			sync_root_block_immediate();
-		}
-		flash_idle();
-		usbd_scsi_idle();
-		int current_button_state = buttonState() ? 0 : 1;
-
-		if (g_press_pending) {
-			g_press_pending = 0;
-			END_WORK(BUTTON_PRESS_WORK);
-			if (!g_button_state) {
-				switch (device_subsystem_owner()) {
-				case SIGNET_SUBSYSTEM:
-					button_press();
-					break;
-#ifdef ENABLE_FIDO2
-				case CTAP_SUBSYSTEM:
-					ctaphid_press();
-					break;
-#endif
-				case NO_SUBSYSTEM:
-					button_press_unprompted();
-					break;
-				default:
-					break;
-				}
-				g_button_state = 1;
-				BEGIN_WORK(BUTTON_PRESSING_WORK);
-			}
-		}
-		if (!current_button_state && g_button_state && (ms_count - g_ms_last_pressed) > 100) {
-			button_release();
-			g_button_state = 0;
-			END_WORK(BUTTON_PRESSING_WORK);
-		}
-		if (g_button_state && ((ms_count - g_ms_last_pressed) > 2000)) {
-			g_button_state = 0;
-			END_WORK(BUTTON_PRESSING_WORK);
-			switch (device_subsystem_owner()) {
-			case SIGNET_SUBSYSTEM:
-				long_button_press();
-				break;
-			default:
-				break;
-			}
-		}
+		run_work_handlers();
 	}
 }
 
@@ -5,6 +5,7 @@
 #include "usbd_core.h"
 #include "usbd_desc.h"
 #include "usbd_multi.h"
+#include "trace.h"
 
 #define LOW_INT_PRIORITY (3)
 #define DEFAULT_INT_PRIORITY (2)
@@ -28,6 +29,22 @@ void assert(int cont);
 void assert_lit(int cont, int l1, int l2);
 void Error_Handler();
 
+//Buffers that USB, SDMMC or CRYP DMA write into. The MPU maps this section
+//as non-cacheable so they don't need cache maintenance.
+#define DMA_BUFFER __attribute__((section(".dma_buffers"), aligned(32)))
+
+extern uint8_t _sdma_buffers[];
+extern uint8_t _edma_buffers[];
+
+static inline int is_dma_buffer(const void *addr)
+{
+	return (const uint8_t *)addr >= _sdma_buffers && (const uint8_t *)addr < _edma_buffers;
+}
+
+void dcache_clean(const void *addr, int len);
+void dcache_clean_invalidate(void *addr, int len);
+void dcache_invalidate(void *addr, int len);
+
 extern PCD_HandleTypeDef hpcd_USB_OTG_HS;
 
 int is_ctap_initialized();
@@ -51,19 +68,26 @@ int is_ctap_initialized();
 #if ENABLE_MMC_STANDBY
 #define MMC_IDLE_WORK (1<<15)
 #endif
+#define BUFFER_FIFO_WORK (1<<16)
+#define MMC_CARD_BUSY_WORK (1<<17)
+#define USBD_UAS_WORK (1<<18)
+#define CMD_RX_WORK (1<<19)
+#define CTAP_RX_WORK (1<<20)
+#define CMD_BULK_RX_WORK (1<<21)
+#define CMD_STREAM_WORK (1<<22)
 
 extern volatile int g_work_to_do;
 
+//Work bits are traced from when they are first set until they are cleared
 #define BEGIN_WORK(w) do {\
-		__disable_irq();\
-		g_work_to_do |= w; \
-		__enable_irq();\
+		int __prev_work = __atomic_fetch_or(&g_work_to_do, (w), __ATOMIC_SEQ_CST);\
+		trace_work_begin((w) & ~__prev_work);\
 	} while (0)
 
 #define END_WORK(w) do {\
-		__disable_irq();\
-		g_work_to_do &= ~w;\
-		__enable_irq();\
+		u32 __now = trace_cycles();\
+		int __prev_work = __atomic_fetch_and(&g_work_to_do, ~(w), __ATOMIC_SEQ_CST);\
+		trace_work_end((w) & __prev_work, __now);\
 	} while (0)
 
 #endif
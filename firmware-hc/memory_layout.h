@@ -19,6 +19,9 @@
 #define MAX_TAG_NAME_LENGTH (16)
 #define MAX_PROFILE_NAME_LENGTH (32)
 #define MAX_PROFILE_TAGS (16)
+//Fixed size of the root page firmware signature slots. Don't derive this from
+//HC_FIRMWARE_SIGNATURE_LEN, changing it moves every root page field after it
+#define ROOT_PAGE_SIGNATURE_WORDS (32)
 
 #define EMMC_SUB_BLOCK_SZ (512)
 #define HC_BLOCK_SZ (1<<14)
@@ -34,8 +37,21 @@
 
 #define NUM_STORAGE_REGIONS (1024)
 #define STORAGE_REGION_SIZE (1<<25)
+
+//
+// Each storage_region_map entry describes one physical region. The upper bits
+// hold the volume that owns the region and the lower bits hold the region's
+// index within that volume. Regions owned by VOL_FREE_SPACE are unallocated.
+//
+#define STORAGE_REGION_INDEX_BITS (10)
+#define STORAGE_REGION_INDEX_MASK ((1<<STORAGE_REGION_INDEX_BITS) - 1)
+#define STORAGE_REGION_ENTRY(vol, idx) ((u16)(((vol) << STORAGE_REGION_INDEX_BITS) | ((idx) & STORAGE_REGION_INDEX_MASK)))
+#define STORAGE_REGION_VOLUME(ent) ((ent) >> STORAGE_REGION_INDEX_BITS)
+#define STORAGE_REGION_INDEX(ent) ((ent) & STORAGE_REGION_INDEX_MASK)
+#define STORAGE_REGION_INVALID (0xffff)
+
 #define MAX_TAGS (16)
-#define MAX_VOLUME_NAME_LEN (32)
+#define MAX_VOLUME_NAME_LEN (HC_VOLUME_NAME_LEN)
 #define MAX_VOLUMES (10) //Includes "free space volume" and "primary volume" which can't be deleted
 #define MAX_SCSI_VOLUMES (2)
 
@@ -82,24 +98,6 @@ enum hc_firmware_upgrade_state {
 	HC_APPLICATION_ONLY_UPGRADED
 };
 
-#define HC_VOLUME_FLAG_VALID (1<<0)
-#define HC_VOLUME_FLAG_READ_ONLY (1<<1)
-#define HC_VOLUME_FLAG_WRITABLE_ON_UNLOCK (1<<2)
-#define HC_VOLUME_FLAG_WRITABLE_ON_REQUEST (1<<3)
-#define HC_VOLUME_FLAG_HIDDEN (1<<4)
-#define HC_VOLUME_FLAG_VISIBLE_ON_UNLOCK (1<<5)
-#define HC_VOLUME_FLAG_VISIBLE_ON_REQUEST (1<<6)
-#define HC_VOLUME_FLAG_ONE_TIME_USE (1<<7)
-#define HC_VOLUME_FLAG_ENCRYPTED (1<<8)
-#define HC_VOLUME_FLAG_USE_KEYSTORE (1<<9)
-#define HC_VOLUME_FLAG_VIRTUAL (1<<10)
-
-struct hc_volume {
-	u32 flags;
-	u32 n_regions;
-	u8 volume_name[MAX_VOLUME_NAME_LEN];
-} __attribute__ ((packed));
-
 #define RK_NUM 15
 
 struct ResidentKeyStore {
@@ -123,8 +121,8 @@ struct hc_device_data {
 	u8 firmware_hash[2][HC_FIRMWARE_HASH_LEN];
 	u32 firmware_A_crc[2];
 	u32 firmware_B_crc[2];
-	u32 firmware_A_signature[2][HC_FIRMWARE_SIGNATURE_LEN];
-	u32 firmware_B_signature[2][HC_FIRMWARE_SIGNATURE_LEN];
+	u32 firmware_A_signature[2][ROOT_PAGE_SIGNATURE_WORDS];
+	u32 firmware_B_signature[2][ROOT_PAGE_SIGNATURE_WORDS];
 	u32 firmware_signature_pubkey[HC_FIRMWARE_SIGNATURE_PUBKEY_LEN];
 	u8 auth_random_cleartext[AUTH_RANDOM_DATA_LEN];
 	struct hcdb_profile_auth_data profile_auth_data[MAX_PROFILES];
@@ -139,4 +137,6 @@ struct hc_device_data {
 	u8 user_data[0];
 } __attribute__((packed));
 
+_Static_assert(ROOT_PAGE_SIGNATURE_WORDS * 4 >= HC_FIRMWARE_SIGNATURE_LEN, "root page signature slot too small");
+
 #endif
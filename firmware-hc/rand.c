@@ -115,7 +115,7 @@ void rand_push(enum rand_src _src, u32 val)
 void rand_update(enum rand_src src)
 {
 
-	switch (device_subsystem_owner()) {
+	switch (resource_owner(RESOURCE_CRYPTO)) {
 	case SIGNET_SUBSYSTEM:
 		cmd_rand_update();
 		break;
@@ -1340,6 +1340,22 @@ HAL_StatusTypeDef HAL_MMC_WriteBlocks_DMA_Initial(MMC_HandleTypeDef *hmmc, const
   * @retval HAL status
   */
 HAL_StatusTypeDef HAL_MMC_Erase(MMC_HandleTypeDef *hmmc, uint32_t BlockStartAdd, uint32_t BlockEndAdd)
+{
+	return HAL_MMC_EraseType(hmmc, BlockStartAdd, BlockEndAdd, MMC_ERASE);
+}
+
+/**
+  * @brief  Erases the specified memory area of the given MMC card with the
+  *         given erase command argument
+  * @note   This API should be followed by a check on the card state through
+  *         HAL_MMC_GetCardState().
+  * @param  hmmc Pointer to MMC handle
+  * @param  BlockStartAdd Start Block address
+  * @param  BlockEndAdd End Block address
+  * @param  EraseType MMC_ERASE, MMC_TRIM, MMC_SECURE_ERASE or MMC_SECURE_TRIM_STEP{1,2}
+  * @retval HAL status
+  */
+HAL_StatusTypeDef HAL_MMC_EraseType(MMC_HandleTypeDef *hmmc, uint32_t BlockStartAdd, uint32_t BlockEndAdd, uint32_t EraseType)
 {
 	uint32_t errorstate = HAL_MMC_ERROR_NONE;
 
@@ -1402,7 +1418,7 @@ HAL_StatusTypeDef HAL_MMC_Erase(MMC_HandleTypeDef *hmmc, uint32_t BlockStartAdd,
 		}
 
 		/* Send CMD38 ERASE */
-		errorstate = SDMMC_CmdErase(hmmc->Instance);
+		errorstate = SDMMC_CmdEraseType(hmmc->Instance, EraseType);
 		if(errorstate != HAL_MMC_ERROR_NONE) {
 			/* Clear all the static flags */
 			__HAL_MMC_CLEAR_FLAG(hmmc, SDMMC_STATIC_FLAGS);
@@ -344,6 +344,18 @@ typedef void (*pMMC_CallbackTypeDef)           (MMC_HandleTypeDef *hmmc);
   * @}
   */
 
+/** @defgroup MMC_Exported_Constansts_Group5 MMC Erase types
+  * @{
+  */
+#define MMC_ERASE                  ((uint32_t)0x00000000U)  /*!< Erase the erase groups covering the range */
+#define MMC_TRIM                   ((uint32_t)0x00000001U)  /*!< Erase the write blocks in the range      */
+#define MMC_SECURE_ERASE           ((uint32_t)0x80000000U)
+#define MMC_SECURE_TRIM_STEP1      ((uint32_t)0x80000001U)
+#define MMC_SECURE_TRIM_STEP2      ((uint32_t)0x80008000U)
+/**
+  * @}
+  */
+
 /**
   * @}
   */
@@ -582,6 +594,7 @@ void HAL_MMC_MspDeInit(MMC_HandleTypeDef *hmmc);
 HAL_StatusTypeDef HAL_MMC_ReadBlocks(MMC_HandleTypeDef *hmmc, uint8_t *pData, uint32_t BlockAdd, uint32_t NumberOfBlocks, uint32_t Timeout);
 HAL_StatusTypeDef HAL_MMC_WriteBlocks(MMC_HandleTypeDef *hmmc, uint8_t *pData, uint32_t BlockAdd, uint32_t NumberOfBlocks, uint32_t Timeout);
 HAL_StatusTypeDef HAL_MMC_Erase(MMC_HandleTypeDef *hmmc, uint32_t BlockStartAdd, uint32_t BlockEndAdd);
+HAL_StatusTypeDef HAL_MMC_EraseType(MMC_HandleTypeDef *hmmc, uint32_t BlockStartAdd, uint32_t BlockEndAdd, uint32_t EraseType);
 /* Non-Blocking mode: IT */
 HAL_StatusTypeDef HAL_MMC_ReadBlocks_IT(MMC_HandleTypeDef *hmmc, uint8_t *pData, uint32_t BlockAdd, uint32_t NumberOfBlocks);
 HAL_StatusTypeDef HAL_MMC_WriteBlocks_IT(MMC_HandleTypeDef *hmmc, uint8_t *pData, uint32_t BlockAdd, uint32_t NumberOfBlocks);
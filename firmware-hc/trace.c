@@ -0,0 +1,159 @@
+#include "trace.h"
+#include "stm32f7xx.h"
+
+#include <string.h>
+
+#if ENABLE_TRACE
+
+//Active spans are tracked in a 32 bit mask
+_Static_assert(HC_TRACE_NUM_SPANS <= 32, "too many trace spans");
+
+static struct {
+	u32 active;
+	u32 n_recorded;
+	u32 start[HC_TRACE_NUM_SPANS];
+	struct hc_trace_span_stats stats[HC_TRACE_NUM_SPANS];
+	struct hc_trace_event events[HC_TRACE_MAX_EVENTS];
+} s_trace;
+
+void trace_reset()
+{
+	u32 primask = __get_PRIMASK();
+	__disable_irq();
+	memset(&s_trace, 0, sizeof(s_trace));
+	__set_PRIMASK(primask);
+}
+
+//Each event claims its slot atomically so recording doesn't need interrupts masked
+static void trace_record(int span, int type, u32 cycles)
+{
+	u32 idx = __atomic_fetch_add(&s_trace.n_recorded, 1, __ATOMIC_RELAXED);
+	struct hc_trace_event *ev = s_trace.events + (idx % HC_TRACE_MAX_EVENTS);
+	ev->cycles = cycles;
+	ev->span = span;
+	ev->type = type;
+	ev->reserved = 0;
+}
+
+static int trace_bucket(u32 cycles)
+{
+	int b = cycles ? (31 - __builtin_clz(cycles)) : 0;
+	b -= HC_TRACE_HIST_SHIFT;
+	if (b < 0)
+		return 0;
+	if (b >= HC_TRACE_HIST_BUCKETS)
+		return HC_TRACE_HIST_BUCKETS - 1;
+	return b;
+}
+
+static void trace_span_stats(int span, u32 cycles)
+{
+	struct hc_trace_span_stats *st = s_trace.stats + span;
+	if (!st->count || cycles < st->min)
+		st->min = cycles;
+	if (cycles > st->max)
+		st->max = cycles;
+	st->count++;
+	st->total += cycles;
+	int b = trace_bucket(cycles);
+	if (st->hist[b] != 0xffff)
+		st->hist[b]++;
+}
+
+//
+// Spans begin and end from both interrupt handlers and the main loop so
+// each update is done with interrupts masked. This is only a few dozen
+// cycles.
+//
+void trace_begin(int span)
+{
+	u32 primask = __get_PRIMASK();
+	__disable_irq();
+	u32 now = DWT->CYCCNT;
+	s_trace.start[span] = now;
+	s_trace.active |= (1 << span);
+	trace_record(span, HC_TRACE_EVENT_BEGIN, now);
+	__set_PRIMASK(primask);
+}
+
+void trace_end(int span)
+{
+	u32 primask = __get_PRIMASK();
+	__disable_irq();
+	u32 now = DWT->CYCCNT;
+	if (s_trace.active & (1 << span)) {
+		s_trace.active &= ~(1 << span);
+		trace_span_stats(span, now - s_trace.start[span]);
+	}
+	trace_record(span, HC_TRACE_EVENT_END, now);
+	__set_PRIMASK(primask);
+}
+
+//
+// Work spans run on every work bit update so they don't mask interrupts. The
+// atomic update of g_work_to_do already tells exactly one caller that it set
+// or cleared a bit, so each span has a single owner between its begin and end.
+// An interrupt setting a bit again right after it was cleared can still race
+// with the end of the previous span and skew that one sample. Ends that see
+// a start time later than their own are left out of the stats.
+//
+void trace_work_begin(int bits)
+{
+	u32 now = DWT->CYCCNT;
+	while (bits) {
+		int n = __builtin_ctz(bits);
+		bits &= bits - 1;
+		if (n < HC_TRACE_SPAN_WORK_COUNT) {
+			s_trace.start[n] = now;
+			trace_record(n, HC_TRACE_EVENT_BEGIN, now);
+		}
+	}
+}
+
+void trace_work_end(int bits, u32 now)
+{
+	while (bits) {
+		int n = __builtin_ctz(bits);
+		bits &= bits - 1;
+		if (n < HC_TRACE_SPAN_WORK_COUNT) {
+			u32 cycles = now - s_trace.start[n];
+			if ((s32)cycles >= 0)
+				trace_span_stats(n, cycles);
+			trace_record(n, HC_TRACE_EVENT_END, now);
+		}
+	}
+}
+
+int trace_read(u8 *dest, int max_len)
+{
+	struct hc_trace_header hdr;
+	int n_events;
+	int first;
+	int len;
+
+	u32 primask = __get_PRIMASK();
+	__disable_irq();
+	n_events = s_trace.n_recorded < HC_TRACE_MAX_EVENTS ? s_trace.n_recorded : HC_TRACE_MAX_EVENTS;
+	len = sizeof(hdr) + sizeof(s_trace.stats) + n_events * sizeof(struct hc_trace_event);
+	if (len > max_len) {
+		__set_PRIMASK(primask);
+		return -1;
+	}
+	hdr.cpu_hz = SystemCoreClock;
+	hdr.n_recorded = s_trace.n_recorded;
+	hdr.n_spans = HC_TRACE_NUM_SPANS;
+	hdr.n_events = n_events;
+	memcpy(dest, &hdr, sizeof(hdr));
+	dest += sizeof(hdr);
+	memcpy(dest, s_trace.stats, sizeof(s_trace.stats));
+	dest += sizeof(s_trace.stats);
+	first = (s_trace.n_recorded - n_events) % HC_TRACE_MAX_EVENTS;
+	for (int i = 0; i < n_events; i++) {
+		memcpy(dest, s_trace.events + ((first + i) % HC_TRACE_MAX_EVENTS), sizeof(struct hc_trace_event));
+		dest += sizeof(struct hc_trace_event);
+	}
+	__set_PRIMASK(primask);
+	return len;
+}
+
+#endif
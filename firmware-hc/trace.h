@@ -0,0 +1,34 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+#include "signetdev_hc_common.h"
+
+//
+// Cycle counting trace of firmware spans. Each span records a DWT cycle count
+// when it begins and ends. Events go into a RAM ring buffer and every span
+// keeps min/max/total and a log2 histogram of its durations. The host reads
+// it all back with the READ_TRACE command. The cycle counter itself is
+// enabled in main().
+//
+#define ENABLE_TRACE 1
+
+#if ENABLE_TRACE
+void trace_reset();
+void trace_begin(int span);
+void trace_end(int span);
+void trace_work_begin(int bits);
+void trace_work_end(int bits, u32 now);
+#define trace_cycles() (DWT->CYCCNT)
+int trace_read(u8 *dest, int max_len);
+#else
+#define trace_reset() do {} while (0)
+#define trace_begin(span) do {} while (0)
+#define trace_end(span) do {} while (0)
+#define trace_work_begin(bits) do {} while (0)
+#define trace_work_end(bits, now) do {} while (0)
+#define trace_cycles() (0)
+#define trace_read(dest, max_len) (0)
+#endif
+
+#endif
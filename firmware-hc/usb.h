@@ -4,6 +4,7 @@
 
 void usb_send_bytes(int ep, const u8 *data, int length);
 int usb_tx_pending(int ep);
+int usb_tx_full(int ep);
 
 #include "usbd_hid.h"
 
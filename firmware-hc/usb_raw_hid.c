@@ -4,50 +4,80 @@
 #include "usb.h"
 #include "commands.h"
 #include "print.h"
-#include "signetdev_common.h"
+#include "signetdev_hc_common.h"
+#include "stm32f7xx_hal.h"
 #include "usbd_multi.h"
 #include "config.h"
 
 #include "usbd_hid.h"
+#include "usbd_cmd_bulk.h"
 
 static const u8 *raw_hid_tx_data = NULL;
+static int raw_hid_tx_packed = 0;
 static int raw_hid_tx_seq = 0;
 static int raw_hid_tx_count = 0;
 
+//A response can wait here while another one is being sent
+static const u8 *raw_hid_tx_next_data = NULL;
+static int raw_hid_tx_next_packed = 0;
+static u16 raw_hid_tx_next_len = 0;
+
+//First packet of a message held until the running command finishes
+static volatile u8 *raw_hid_rx_deferred_data = NULL;
+
 static u8 raw_hid_tx_cmd_packet[HID_CMD_EPIN_SIZE] __attribute__((aligned(16)));
-static u8 raw_hid_tx_event_packet[HID_CMD_EPIN_SIZE] __attribute__((aligned(16)));
+//One event packet can be on the wire while the next one is queued behind it
+static u8 raw_hid_tx_event_packet[2][HID_CMD_EPIN_SIZE] __attribute__((aligned(16)));
+static int raw_hid_tx_event_idx = 0;
+
+struct raw_hid_event {
+	u8 type;
+	u8 data_len;
+	u8 data[HC_EVENT_MAX_DATA_LEN];
+	struct hc_event_info info;
+};
 
-static u8 event_mask = 0;
-static const u8 *event_data[8];
-static int event_data_len[8];
+//
+// Events are queued here and sent ahead of any command response packets.
+// When the queue is full the oldest event is discarded and counted so the
+// host knows to re-read any state it caches.
+//
+static struct raw_hid_event event_queue[HC_EVENT_QUEUE_LEN];
+static int event_queue_head = 0;
+static int event_queue_count = 0;
+static u16 event_seq = 0;
+static u16 event_dropped = 0;
 
 static int maybe_send_raw_hid_event()
 {
-	if (!event_mask)
+	__disable_irq();
+	if (!event_queue_count) {
+		__enable_irq();
 		return 0;
-	if (usb_tx_pending(RAW_HID_TX_ENDPOINT))
-		return 0;
-
-	int i;
-	for (i = 0; i < 8; i++) {
-		if ((event_mask >> i) & 1) {
-			event_mask &= ~(1<<i);
-			raw_hid_tx_event_packet[0] = 0xff;
-			raw_hid_tx_event_packet[RAW_HID_HEADER_SIZE] = i;
-			if (event_data[i]) {
-				raw_hid_tx_event_packet[RAW_HID_HEADER_SIZE + 1] = event_data_len[i];
-				memcpy(raw_hid_tx_event_packet + RAW_HID_HEADER_SIZE + 2, event_data[i], event_data_len[i]);
-			} else {
-				raw_hid_tx_event_packet[RAW_HID_HEADER_SIZE + 1] = 0;
-			}
-			usb_send_bytes(HID_CMD_EPIN_ADDR, raw_hid_tx_event_packet, RAW_HID_PACKET_SIZE);
-			break;
-		}
 	}
+	if (usb_tx_full(RAW_HID_TX_ENDPOINT)) {
+		__enable_irq();
+		return 1;
+	}
+
+	struct raw_hid_event *ev = event_queue + event_queue_head;
+	event_queue_head = (event_queue_head + 1) % HC_EVENT_QUEUE_LEN;
+	event_queue_count--;
+
+	u8 *packet = raw_hid_tx_event_packet[raw_hid_tx_event_idx];
+	u8 *payload = packet + RAW_HID_HEADER_SIZE;
+	raw_hid_tx_event_idx ^= 1;
+	packet[0] = 0xff;
+	payload[0] = ev->type;
+	payload[1] = ev->data_len;
+	memcpy(payload + 2, ev->data, ev->data_len);
+	memcpy(payload + 2 + ev->data_len, &ev->info, sizeof(ev->info));
+	usb_send_bytes(HID_CMD_EPIN_ADDR, packet, RAW_HID_PACKET_SIZE);
+	__enable_irq();
 	return 1;
 }
 
-void cmd_packet_sent();
+static void raw_hid_tx_start(const u8 *data, u16 len, int packed);
 
 void maybe_send_raw_hid_packet()
 {
@@ -58,33 +88,107 @@ void maybe_send_raw_hid_packet()
 		if ((raw_hid_tx_seq + 1) == raw_hid_tx_count) {
 			last = 1;
 		}
-		raw_hid_tx_cmd_packet[0] = (last << 7) | raw_hid_tx_seq;
-		memcpy(raw_hid_tx_cmd_packet + RAW_HID_HEADER_SIZE, raw_hid_tx_data + raw_hid_tx_seq * RAW_HID_PAYLOAD_SIZE, RAW_HID_PAYLOAD_SIZE);
-		usb_send_bytes(HID_CMD_EPIN_ADDR, raw_hid_tx_cmd_packet, HID_CMD_EPIN_SIZE);
+		if (raw_hid_tx_packed) {
+			usb_send_bytes(HID_CMD_EPIN_ADDR, raw_hid_tx_data + raw_hid_tx_seq * RAW_HID_PACKET_SIZE, HID_CMD_EPIN_SIZE);
+		} else {
+			raw_hid_tx_cmd_packet[0] = (last << 7) | raw_hid_tx_seq;
+			memcpy(raw_hid_tx_cmd_packet + RAW_HID_HEADER_SIZE, raw_hid_tx_data + raw_hid_tx_seq * RAW_HID_PAYLOAD_SIZE, RAW_HID_PAYLOAD_SIZE);
+			usb_send_bytes(HID_CMD_EPIN_ADDR, raw_hid_tx_cmd_packet, HID_CMD_EPIN_SIZE);
+		}
 		raw_hid_tx_seq++;
 	} else {
 		raw_hid_tx_seq = 0;
 		raw_hid_tx_count = 0;
 		if (raw_hid_tx_data) {
+			const u8 *sent = raw_hid_tx_data;
 			raw_hid_tx_data = NULL;
-			cmd_packet_sent();
+			if (raw_hid_tx_next_data) {
+				const u8 *next = raw_hid_tx_next_data;
+				raw_hid_tx_next_data = NULL;
+				raw_hid_tx_start(next, raw_hid_tx_next_len, raw_hid_tx_next_packed);
+			}
+			cmd_packet_sent(sent);
 		}
 	}
 }
 
-void cmd_packet_send(const u8 *data, u16 len)
+static void raw_hid_tx_start(const u8 *data, u16 len, int packed)
 {
+	__disable_irq();
+	if (raw_hid_tx_data) {
+		raw_hid_tx_next_data = data;
+		raw_hid_tx_next_len = len;
+		raw_hid_tx_next_packed = packed;
+		__enable_irq();
+		return;
+	}
 	raw_hid_tx_count = (len + RAW_HID_PAYLOAD_SIZE - 1)/RAW_HID_PAYLOAD_SIZE;
 	raw_hid_tx_seq = 0;
 	raw_hid_tx_data = data;
+	raw_hid_tx_packed = packed;
+	__enable_irq();
 	maybe_send_raw_hid_packet();
 }
 
+void cmd_packet_send(const u8 *data, u16 len)
+{
+	if (g_cmd_transport == CMD_TRANSPORT_BULK) {
+		usbd_cmd_bulk_send(data, len);
+		return;
+	}
+	raw_hid_tx_start(data, len, 0);
+}
+
+//
+// Packed buffers hold a message in raw HID packet layout: RAW_HID_HEADER_SIZE
+// bytes are left free in front of every RAW_HID_PAYLOAD_SIZE bytes of message
+// so each packet can be DMA'd straight out of the buffer.
+//
+void raw_hid_packed_write(u8 *buf, int offset, const u8 *src, int len)
+{
+	while (len > 0) {
+		int seq = offset / RAW_HID_PAYLOAD_SIZE;
+		int pos = offset % RAW_HID_PAYLOAD_SIZE;
+		int n = RAW_HID_PAYLOAD_SIZE - pos;
+		if (n > len)
+			n = len;
+		memcpy(buf + seq * RAW_HID_PACKET_SIZE + RAW_HID_HEADER_SIZE + pos, src, n);
+		offset += n;
+		src += n;
+		len -= n;
+	}
+}
+
+void cmd_packet_send_packed(u8 *buf, u16 len)
+{
+	int count = (len + RAW_HID_PAYLOAD_SIZE - 1)/RAW_HID_PAYLOAD_SIZE;
+	for (int seq = 0; seq < count; seq++) {
+		buf[seq * RAW_HID_PACKET_SIZE] = (((seq + 1) == count) << 7) | seq;
+	}
+	raw_hid_tx_start(buf, len, 1);
+}
+
 void cmd_event_send(int event_num, const u8 *data, int data_len)
 {
-	event_mask |= 1<<event_num;
-	event_data[event_num]  = data;
-	event_data_len[event_num] = data_len;
+	if (data_len > HC_EVENT_MAX_DATA_LEN)
+		data_len = HC_EVENT_MAX_DATA_LEN;
+	__disable_irq();
+	if (event_queue_count == HC_EVENT_QUEUE_LEN) {
+		event_queue_head = (event_queue_head + 1) % HC_EVENT_QUEUE_LEN;
+		event_queue_count--;
+		event_dropped++;
+	}
+	struct raw_hid_event *ev = event_queue + ((event_queue_head + event_queue_count) % HC_EVENT_QUEUE_LEN);
+	ev->type = event_num;
+	ev->data_len = data_len;
+	if (data_len)
+		memcpy(ev->data, data, data_len);
+	ev->info.seq = event_seq++;
+	ev->info.dropped = event_dropped;
+	ev->info.ms = HAL_GetTick();
+	event_dropped = 0;
+	event_queue_count++;
+	__enable_irq();
 	maybe_send_raw_hid_event();
 }
 
@@ -93,13 +197,24 @@ void usb_raw_hid_rx(volatile u8 *data, int count)
 	u8 seq = data[0] & 0x7f;
 	int last = (data[0] >> 7) & 0x1;
 	int index = ((int)seq * RAW_HID_PAYLOAD_SIZE);
+	if (seq == 0) {
+		switch (cmd_packet_queue((const u8 *)data + RAW_HID_HEADER_SIZE, last)) {
+		case 1:
+			USBD_HID_rx_resume(INTERFACE_CMD);
+			return;
+		case -1:
+			raw_hid_rx_deferred_data = data;
+			return;
+		}
+		g_cmd_transport = CMD_TRANSPORT_HID;
+	}
 	if ((index + RAW_HID_PAYLOAD_SIZE) > CMD_PACKET_BUF_SIZE) {
 		USBD_HID_rx_resume(INTERFACE_CMD);
+		return;
 	}
-	for(int i = RAW_HID_HEADER_SIZE; i < RAW_HID_PACKET_SIZE; i++) {
-		u8 d = data[i];
-		cmd_packet_buf[index++] = d;
-	}
+	//The USB DMA has finished with the packet so it can be copied as
+	//ordinary memory
+	memcpy(cmd_packet_buf + index, (const u8 *)data + RAW_HID_HEADER_SIZE, RAW_HID_PAYLOAD_SIZE);
 	if (last) {
 		cmd_packet_recv();
 	} else {
@@ -107,6 +222,22 @@ void usb_raw_hid_rx(volatile u8 *data, int count)
 	}
 }
 
+int usb_raw_hid_rx_deferred()
+{
+	return raw_hid_rx_deferred_data != NULL;
+}
+
+//Start queued commands and retry a held packet once a command has finished
+void usb_raw_hid_rx_idle()
+{
+	cmd_queue_next();
+	volatile u8 *data = raw_hid_rx_deferred_data;
+	if (data) {
+		raw_hid_rx_deferred_data = NULL;
+		usb_raw_hid_rx(data, RAW_HID_PACKET_SIZE);
+	}
+}
+
 void usb_raw_hid_tx()
 {
 	maybe_send_raw_hid_packet();
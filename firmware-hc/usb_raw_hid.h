@@ -6,5 +6,9 @@
 void usb_raw_hid_rx(volatile u8 *data, int count);
 void usb_raw_hid_tx();
 void usb_raw_hid_rx_resume();
+void usb_raw_hid_rx_idle();
+int usb_raw_hid_rx_deferred();
+void raw_hid_packed_write(u8 *buf, int offset, const u8 *src, int len);
+void cmd_packet_send_packed(u8 *buf, u16 len);
 
 #endif
@@ -0,0 +1,132 @@
+#include "usbd_cmd_bulk.h"
+#include "usbd_multi.h"
+#include "commands.h"
+#include "signetdev_common_priv.h"
+#include "main.h"
+
+#include <string.h>
+
+extern USBD_HandleTypeDef *g_pdev;
+
+//
+// Vendor bulk transport for the command channel. A command arrives as one
+// transfer and its response goes out of cmd_resp the same way, so there is
+// no per-packet copy or interrupt interval. Transfers land in their own
+// buffer and are only copied to cmd_packet_buf once the command channel is
+// free, so a raw HID command in progress is never overwritten. Commands are
+// answered on the transport they arrived on and events always use the raw
+// HID interface.
+//
+
+//Receives are a whole number of packets so the tail of the buffer can't
+//share a cache line with anything else
+#define CMD_BULK_RX_SIZE (CMD_PACKET_BUF_SIZE & ~(CMD_BULK_EP_SIZE - 1))
+
+static u8 s_cmd_bulk_rx_buf[CMD_BULK_RX_SIZE] __attribute__((aligned(32)));
+
+static struct {
+	volatile int rx_pending;
+	const u8 *tx_data;
+	int tx_zlp;
+	const u8 *tx_next_data;
+	u16 tx_next_len;
+} s_cmd_bulk;
+
+void USBD_CMD_BULK_Init(USBD_HandleTypeDef *pdev)
+{
+	memset(&s_cmd_bulk, 0, sizeof(s_cmd_bulk));
+	USBD_LL_OpenEP(pdev, CMD_BULK_EPOUT_ADDR, USBD_EP_TYPE_BULK, CMD_BULK_EP_SIZE);
+	pdev->ep_out[CMD_BULK_EPOUT_ADDR & 0xFU].is_used = 1U;
+	USBD_LL_OpenEP(pdev, CMD_BULK_EPIN_ADDR, USBD_EP_TYPE_BULK, CMD_BULK_EP_SIZE);
+	pdev->ep_in[CMD_BULK_EPIN_ADDR & 0xFU].is_used = 1U;
+	usbd_cmd_bulk_rx_resume();
+}
+
+void USBD_CMD_BULK_DeInit(USBD_HandleTypeDef *pdev)
+{
+	USBD_LL_CloseEP(pdev, CMD_BULK_EPIN_ADDR);
+	pdev->ep_in[CMD_BULK_EPIN_ADDR & 0xFU].is_used = 0U;
+	USBD_LL_CloseEP(pdev, CMD_BULK_EPOUT_ADDR);
+	pdev->ep_out[CMD_BULK_EPOUT_ADDR & 0xFU].is_used = 0U;
+	if (g_cmd_transport == CMD_TRANSPORT_BULK) {
+		g_cmd_transport = CMD_TRANSPORT_HID;
+	}
+}
+
+void usbd_cmd_bulk_rx_resume()
+{
+	dcache_clean_invalidate(s_cmd_bulk_rx_buf, CMD_BULK_RX_SIZE);
+	USBD_LL_PrepareReceive(g_pdev, CMD_BULK_EPOUT_ADDR, s_cmd_bulk_rx_buf, CMD_BULK_RX_SIZE);
+}
+
+void USBD_CMD_BULK_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+	s_cmd_bulk.rx_pending = 1;
+	BEGIN_WORK(CMD_BULK_RX_WORK);
+}
+
+void usbd_cmd_bulk_rx_idle()
+{
+	END_WORK(CMD_BULK_RX_WORK);
+	if (!s_cmd_bulk.rx_pending)
+		return;
+	dcache_invalidate(s_cmd_bulk_rx_buf, CMD_BULK_RX_SIZE);
+	u32 len = USBD_LL_GetRxDataSize(g_pdev, CMD_BULK_EPOUT_ADDR);
+	u32 msg_len = s_cmd_bulk_rx_buf[0] + (s_cmd_bulk_rx_buf[1] << 8);
+	if (len < CMD_PACKET_HEADER_SIZE || msg_len != len) {
+		//Drop malformed transfers
+		s_cmd_bulk.rx_pending = 0;
+		usbd_cmd_bulk_rx_resume();
+		return;
+	}
+	//Wait for the running command to finish. Like on raw HID, cancel and
+	//disconnect are let through. cmd_packet_sent() retries the transfer
+	int cmd = s_cmd_bulk_rx_buf[2];
+	if (cmd_busy() && cmd != CANCEL_BUTTON_PRESS && cmd != DISCONNECT)
+		return;
+	s_cmd_bulk.rx_pending = 0;
+	memcpy(cmd_packet_buf, s_cmd_bulk_rx_buf, len);
+	g_cmd_transport = CMD_TRANSPORT_BULK;
+	cmd_packet_recv();
+}
+
+int usbd_cmd_bulk_rx_held()
+{
+	return s_cmd_bulk.rx_pending;
+}
+
+void usbd_cmd_bulk_send(const u8 *data, u16 len)
+{
+	__disable_irq();
+	if (s_cmd_bulk.tx_data) {
+		s_cmd_bulk.tx_next_data = data;
+		s_cmd_bulk.tx_next_len = len;
+		__enable_irq();
+		return;
+	}
+	s_cmd_bulk.tx_data = data;
+	//The host reads into a buffer bigger than any response so a transfer
+	//that ends on a packet boundary needs a zero length packet
+	s_cmd_bulk.tx_zlp = (len % CMD_BULK_EP_SIZE) == 0;
+	__enable_irq();
+	USBD_LL_Transmit(g_pdev, CMD_BULK_EPIN_ADDR, data, len);
+}
+
+void USBD_CMD_BULK_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+	if (s_cmd_bulk.tx_zlp) {
+		s_cmd_bulk.tx_zlp = 0;
+		USBD_LL_Transmit(pdev, CMD_BULK_EPIN_ADDR, NULL, 0);
+		return;
+	}
+	const u8 *sent = s_cmd_bulk.tx_data;
+	s_cmd_bulk.tx_data = NULL;
+	if (s_cmd_bulk.tx_next_data) {
+		const u8 *next = s_cmd_bulk.tx_next_data;
+		s_cmd_bulk.tx_next_data = NULL;
+		usbd_cmd_bulk_send(next, s_cmd_bulk.tx_next_len);
+	}
+	if (sent) {
+		cmd_packet_sent(sent);
+	}
+}
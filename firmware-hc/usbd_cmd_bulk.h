@@ -0,0 +1,16 @@
+#ifndef __USBD_CMD_BULK_H
+#define __USBD_CMD_BULK_H
+
+#include "types.h"
+#include "usbd_core.h"
+
+void USBD_CMD_BULK_Init(USBD_HandleTypeDef *pdev);
+void USBD_CMD_BULK_DeInit(USBD_HandleTypeDef *pdev);
+void USBD_CMD_BULK_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
+void USBD_CMD_BULK_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
+void usbd_cmd_bulk_rx_resume();
+void usbd_cmd_bulk_send(const u8 *data, u16 len);
+void usbd_cmd_bulk_rx_idle();
+int usbd_cmd_bulk_rx_held();
+
+#endif
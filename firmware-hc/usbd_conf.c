@@ -1,10 +1,11 @@
 #include "main.h"
 #include "usbd_multi.h"
 #include "usbd_msc.h"
+#include "signetdev_common_priv.h"
 
 #define CURSOR_STEP     5
 
-PCD_HandleTypeDef hpcd;
+PCD_HandleTypeDef hpcd DMA_BUFFER;
 __IO uint32_t remotewakeupon = 0;
 uint8_t HID_Buffer[4];
 extern USBD_HandleTypeDef USBD_Device;
@@ -137,12 +138,14 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 
 	/* Initialize LL Driver */
 	HAL_PCD_Init(&hpcd);
-	HAL_PCDEx_SetRxFiFo(&hpcd, 2048/4);
+	HAL_PCDEx_SetRxFiFo(&hpcd, 1536/4);
 	HAL_PCDEx_SetTxFiFo(&hpcd, 0, (USB_MAX_EP0_SIZE * 1) / 4); //64
 	HAL_PCDEx_SetTxFiFo(&hpcd, HID_KEYBOARD_EPIN_ADDR & 0x7f, (HID_KEYBOARD_EPIN_SIZE * 1) / 4); //64
 	HAL_PCDEx_SetTxFiFo(&hpcd, HID_CMD_EPIN_ADDR & 0x7f, (HID_CMD_EPIN_SIZE * 1) / 4); //512
 	HAL_PCDEx_SetTxFiFo(&hpcd, HID_FIDO_EPIN_ADDR & 0x7f, (HID_FIDO_EPIN_SIZE * 1) / 4); //64
 	HAL_PCDEx_SetTxFiFo(&hpcd, MSC_EPIN_ADDR & 0x7f, (MSC_EPIN_SIZE * 1) / 4); //512
+	HAL_PCDEx_SetTxFiFo(&hpcd, MSC_UAS_STATUS_EPIN_ADDR & 0x7f, (MSC_UAS_EP_SIZE * 1) / 4); //512
+	HAL_PCDEx_SetTxFiFo(&hpcd, CMD_BULK_EPIN_ADDR & 0x7f, (CMD_BULK_EP_SIZE * 1) / 4); //512
 	return USBD_OK;
 }
 
@@ -229,6 +232,10 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
                                     const uint8_t *pbuf,
                                     uint16_t size)
 {
+	//Descriptors and small control responses aren't in .dma_buffers
+	if (!is_dma_buffer(pbuf)) {
+		dcache_clean(pbuf, size);
+	}
 	HAL_PCD_EP_Transmit(pdev->pData, ep_addr, pbuf, size);
 	return USBD_OK;
 }
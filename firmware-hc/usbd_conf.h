@@ -11,6 +11,7 @@ enum usb_interfaces {
 	INTERFACE_CMD,
 	INTERFACE_FIDO,
 	INTERFACE_MSC,
+	INTERFACE_CMD_BULK, //Must match CMD_BULK_INTERFACE
 	INTERFACE_MAX
 };
 
@@ -230,18 +230,41 @@ uint8_t  USBD_HID_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 	return ret;
 }
 
+static volatile int s_hid_rx_pending[INTERFACE_MAX];
+
+//Packets are handled from the main loop. The endpoint isn't re-armed until
+//the handler calls USBD_HID_rx_resume() so rx_buffer stays valid until then.
 void USBD_HID_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-	int rx = 1;
 	int interfaceNum = endpointToInterface(epnum);
-	USBD_HID_HandleTypeDef *hhid = ((USBD_HID_HandleTypeDef *)pdev->pClassData[interfaceNum]);
-	uint8_t *rx_buffer = hhid->rx_buffer;
+	s_hid_rx_pending[interfaceNum] = 1;
 	if (interfaceNum == INTERFACE_CMD) {
-		usb_raw_hid_rx(rx_buffer, HID_CMD_EPIN_SIZE);
+		BEGIN_WORK(CMD_RX_WORK);
+	} else {
+		BEGIN_WORK(CTAP_RX_WORK);
+	}
+}
+
+void usbd_hid_cmd_rx_idle()
+{
+	END_WORK(CMD_RX_WORK);
+	if (s_hid_rx_pending[INTERFACE_CMD]) {
+		s_hid_rx_pending[INTERFACE_CMD] = 0;
+		USBD_HID_HandleTypeDef *hhid = ((USBD_HID_HandleTypeDef *)g_pdev->pClassData[INTERFACE_CMD]);
+		usb_raw_hid_rx(hhid->rx_buffer, HID_CMD_EPIN_SIZE);
+	} else {
+		usb_raw_hid_rx_idle();
 	}
+}
+
+void usbd_hid_fido_rx_idle()
+{
+	END_WORK(CTAP_RX_WORK);
 #ifdef ENABLE_FIDO2
-	else {
-		ctaphid_handle_packet(rx_buffer);
+	if (s_hid_rx_pending[INTERFACE_FIDO]) {
+		s_hid_rx_pending[INTERFACE_FIDO] = 0;
+		USBD_HID_HandleTypeDef *hhid = ((USBD_HID_HandleTypeDef *)g_pdev->pClassData[INTERFACE_FIDO]);
+		ctaphid_handle_packet(hhid->rx_buffer);
 	}
 #endif
 }
@@ -355,6 +378,24 @@ int usb_tx_pending(int ep)
 	}
 }
 
+//Returns true when a report is in flight and another is queued behind it
+int usb_tx_full(int ep)
+{
+	int interfaceNum = endpointToInterface(ep);
+	switch (interfaceNum) {
+	case INTERFACE_CMD:
+	case INTERFACE_KEYBOARD:
+	case INTERFACE_FIDO: {
+		USBD_HID_HandleTypeDef *hhid = ((USBD_HID_HandleTypeDef *)g_pdev->pClassData[interfaceNum]);
+		return hhid->state != HID_IDLE && hhid->tx_report;
+	}
+	break;
+	default:
+		return 0;
+		break;
+	}
+}
+
 void usb_send_bytes(int ep, const u8 *data, int length)
 {
 	int interfaceNum = endpointToInterface(ep);
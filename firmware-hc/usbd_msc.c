@@ -1,5 +1,6 @@
 
 #include "usbd_msc.h"
+#include "usbd_msc_uas.h"
 
 uint8_t  USBD_MSC_Init (USBD_HandleTypeDef *pdev,
                         uint8_t cfgidx);
@@ -243,8 +244,15 @@ uint8_t  USBD_MSC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 			break;
 
 		case USB_REQ_SET_INTERFACE:
-			if (pdev->dev_state == USBD_STATE_CONFIGURED) {
+			if (pdev->dev_state == USBD_STATE_CONFIGURED &&
+			    (req->wValue == MSC_ALT_BOT || req->wValue == MSC_ALT_UAS)) {
 				hmsc->interface = (uint8_t)(req->wValue);
+				if (hmsc->interface == MSC_ALT_UAS) {
+					MSC_UAS_Init(pdev);
+				} else {
+					MSC_UAS_DeInit(pdev);
+					MSC_BOT_Init(pdev);
+				}
 			} else {
 				USBD_CtlError (pdev, req);
 				ret = USBD_FAIL;
@@ -314,7 +322,11 @@ uint8_t  USBD_MSC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 uint8_t  USBD_MSC_DataIn (USBD_HandleTypeDef *pdev,
                           uint8_t epnum)
 {
-	MSC_BOT_DataIn(pdev, epnum);
+	if ((epnum & 0x7f) == (MSC_UAS_STATUS_EPIN_ADDR & 0x7f)) {
+		MSC_UAS_StatusIn(pdev);
+	} else {
+		MSC_BOT_DataIn(pdev, epnum);
+	}
 	return USBD_OK;
 }
 
@@ -328,7 +340,11 @@ uint8_t  USBD_MSC_DataIn (USBD_HandleTypeDef *pdev,
 uint8_t  USBD_MSC_DataOut (USBD_HandleTypeDef *pdev,
                            uint8_t epnum)
 {
-	MSC_BOT_DataOut(pdev, epnum);
+	if ((epnum & 0x7f) == MSC_UAS_CMD_EPOUT_ADDR) {
+		MSC_UAS_CommandOut(pdev);
+	} else {
+		MSC_BOT_DataOut(pdev, epnum);
+	}
 	return USBD_OK;
 }
 
@@ -4,6 +4,7 @@
 #include "usbd_msc_scsi.h"
 #include "usbd_ioreq.h"
 #include "usbd_multi.h"
+#include "usbd_msc_uas.h"
 
 /** @defgroup MSC_BOT_Private_FunctionPrototypes
   * @{
@@ -120,7 +121,9 @@ void MSC_BOT_DataOut (USBD_HandleTypeDef  *pdev,
 
 	switch (hmsc->bot_state) {
 	case USBD_BOT_IDLE:
-		MSC_BOT_CBW_Decode(pdev);
+		if (hmsc->interface != MSC_ALT_UAS) {
+			MSC_BOT_CBW_Decode(pdev);
+		}
 		break;
 
 	case USBD_BOT_DATA_OUT:
@@ -159,27 +162,39 @@ static void  MSC_BOT_CBW_Decode (USBD_HandleTypeDef  *pdev)
 		hmsc->bot_status = USBD_BOT_STATUS_ERROR;
 		MSC_BOT_Abort(pdev);
 	} else {
-		if(SCSI_ProcessCmd(pdev, hmsc->cbw.bLUN, &hmsc->cbw.CB[0]) < 0) {
-			if (hmsc->bot_state == USBD_BOT_NO_DATA) {
-				MSC_BOT_SendCSW (pdev, USBD_CSW_CMD_FAILED);
-			} else {
-				MSC_BOT_Abort(pdev);
-			}
+		MSC_BOT_ProcessCBW(pdev);
+	}
+}
+
+/**
+* @brief  MSC_BOT_ProcessCBW
+*         Run the command in hmsc->cbw. Shared by BOT and UAS
+* @param  pdev: device instance
+* @retval None
+*/
+void MSC_BOT_ProcessCBW (USBD_HandleTypeDef  *pdev)
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
+
+	usbd_scsi_stats_cmd_begin(hmsc->cbw.bLUN, hmsc->cbw.CB[0]);
+	if(SCSI_ProcessCmd(pdev, hmsc->cbw.bLUN, &hmsc->cbw.CB[0]) < 0) {
+		if (hmsc->bot_state == USBD_BOT_NO_DATA) {
+			MSC_BOT_SendCSW (pdev, USBD_CSW_CMD_FAILED);
+		} else {
+			MSC_BOT_Abort(pdev);
 		}
-		/*Burst xfer handled internally*/
-		else if ((hmsc->bot_state != USBD_BOT_DATA_IN) &&
-		         (hmsc->bot_state != USBD_BOT_DATA_OUT) &&
-		         (hmsc->bot_state != USBD_BOT_LAST_DATA_IN) &&
-			 (hmsc->bot_state != USBD_BOT_SEND_DATA)) {
-			if (hmsc->bot_data_length > 0U) {
-				MSC_BOT_SendData(pdev, hmsc->bot_data, hmsc->bot_data_length);
-			} else if (hmsc->bot_data_length == 0U) {
-				MSC_BOT_SendCSW (pdev, USBD_CSW_CMD_PASSED);
-			} else {
-				MSC_BOT_Abort(pdev);
-			}
+	}
+	/*Burst xfer handled internally*/
+	else if ((hmsc->bot_state != USBD_BOT_DATA_IN) &&
+	         (hmsc->bot_state != USBD_BOT_DATA_OUT) &&
+	         (hmsc->bot_state != USBD_BOT_LAST_DATA_IN) &&
+		 (hmsc->bot_state != USBD_BOT_SEND_DATA)) {
+		if (hmsc->bot_data_length > 0U) {
+			MSC_BOT_SendData(pdev, hmsc->bot_data, hmsc->bot_data_length);
+		} else if (hmsc->bot_data_length == 0U) {
+			MSC_BOT_SendCSW (pdev, USBD_CSW_CMD_PASSED);
 		} else {
-			return;
+			MSC_BOT_Abort(pdev);
 		}
 	}
 }
@@ -221,6 +236,12 @@ void  MSC_BOT_SendCSW (USBD_HandleTypeDef  *pdev,
 	hmsc->csw.dSignature = USBD_BOT_CSW_SIGNATURE;
 	hmsc->csw.bStatus = CSW_Status;
 	hmsc->bot_state = USBD_BOT_IDLE;
+	usbd_scsi_stats_cmd_end(CSW_Status, hmsc->cbw.dDataLength - hmsc->csw.dDataResidue);
+
+	if (hmsc->interface == MSC_ALT_UAS) {
+		MSC_UAS_SendStatus(pdev, CSW_Status);
+		return;
+	}
 
 	USBD_LL_Transmit (pdev, MSC_EPIN_ADDR, (uint8_t *)(void *)&hmsc->csw,
 	                  USBD_BOT_CSW_LENGTH);
@@ -241,6 +262,12 @@ static void  MSC_BOT_Abort (USBD_HandleTypeDef  *pdev)
 {
 	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
 
+	//UAS reports failures in the sense IU rather than by stalling the data pipes
+	if (hmsc->interface == MSC_ALT_UAS) {
+		MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+		return;
+	}
+
 	if ((hmsc->cbw.bmFlags == 0U) &&
 	    (hmsc->cbw.dDataLength != 0U) &&
 	    (hmsc->bot_status == USBD_BOT_STATUS_NORMAL)) {
@@ -55,6 +55,7 @@ static u32 g_scsi_num_aes_sector;
 static u32 g_scsi_aes_encrypt;
 static u32 *g_scsi_aes_read;
 static u32 *g_scsi_aes_write;
+static u32 g_scsi_aes_start_cycles;
 static CRYP_ConfigTypeDef g_scsi_aes_crypt_conf;
 static void set_crypt_config();
 
@@ -64,6 +65,12 @@ void usbd_scsi_device_state_change(enum device_state state)
 {
 	for (int i = 0; i < g_num_scsi_volumes; i++) {
 		struct scsi_volume *v = g_scsi_volume + i;
+		//Nothing on the card can be kept or read back while it's being wiped
+		if (state == DS_WIPING) {
+			v->visible = 0;
+			v->writable = 0;
+			continue;
+		}
 		if (!v->flags & HC_VOLUME_FLAG_VALID) {
 			v->visible = 0;
 			v->writable = 0;
@@ -116,31 +123,302 @@ void usbd_scsi_device_state_change(enum device_state state)
 	}
 }
 
+static u16 g_scsi_region_table[NUM_STORAGE_REGIONS];
+static int g_scsi_region_size_shift;
+
+//
+// Returns non-zero if the volume table and region map in the root page describe a
+// consistent layout for a card with g_scsi_num_regions regions
+//
+static int storage_layout_valid(const struct hc_device_data *d)
+{
+	u8 region_seen[NUM_STORAGE_REGIONS/8];
+	u32 n_free = 0;
+
+	if (!(d->volumes[VOL_FREE_SPACE].flags & HC_VOLUME_FLAG_VALID))
+		return 0;
+	for (int i = 0; i < g_scsi_num_regions; i++) {
+		if (STORAGE_REGION_VOLUME(d->storage_region_map[i]) == VOL_FREE_SPACE)
+			n_free++;
+	}
+	if (n_free != d->volumes[VOL_FREE_SPACE].n_regions)
+		return 0;
+	for (int vol = VOL_PRIMARY_VIRTUAL; vol < MAX_VOLUMES; vol++) {
+		const struct hc_volume *v = d->volumes + vol;
+		u32 n_regions = 0;
+		if (!(v->flags & HC_VOLUME_FLAG_VALID))
+			continue;
+		memset(region_seen, 0, sizeof(region_seen));
+		for (int i = 0; i < g_scsi_num_regions; i++) {
+			u16 ent = d->storage_region_map[i];
+			if (STORAGE_REGION_VOLUME(ent) != vol)
+				continue;
+			u32 idx = STORAGE_REGION_INDEX(ent);
+			if (idx >= v->n_regions || (region_seen[idx/8] & (1<<(idx%8))))
+				return 0;
+			region_seen[idx/8] |= (1<<(idx%8));
+			n_regions++;
+		}
+		if (n_regions != v->n_regions)
+			return 0;
+	}
+	return 1;
+}
+
+//
+// Lay out the volumes the way firmware without a region map did: a small
+// unencrypted volume followed by an encrypted volume using the rest of the card.
+// The regions stay in place so existing volume contents remain readable.
+//
+static void storage_layout_default(struct hc_device_data *d)
+{
+	u32 n_primary = (8192/32);
+	memset(d->volumes, 0, sizeof(d->volumes));
+	d->volumes[VOL_FREE_SPACE].flags = HC_VOLUME_FLAG_VALID;
+	d->volumes[VOL_FREE_SPACE].n_regions = 0;
+
+	d->volumes[VOL_PRIMARY_VIRTUAL].flags = HC_VOLUME_FLAG_VALID;
+	d->volumes[VOL_PRIMARY_VIRTUAL].n_regions = n_primary;
+
+	d->volumes[VOL_CLIENT_STORAGE].flags = HC_VOLUME_FLAG_VALID |
+		HC_VOLUME_FLAG_ENCRYPTED |
+		HC_VOLUME_FLAG_HIDDEN |
+		HC_VOLUME_FLAG_VISIBLE_ON_UNLOCK;
+	d->volumes[VOL_CLIENT_STORAGE].n_regions = g_scsi_num_regions - n_primary;
+
+	for (int i = 0; i < NUM_STORAGE_REGIONS; i++) {
+		if (i < n_primary) {
+			d->storage_region_map[i] = STORAGE_REGION_ENTRY(VOL_PRIMARY_VIRTUAL, i);
+		} else if (i < g_scsi_num_regions) {
+			d->storage_region_map[i] = STORAGE_REGION_ENTRY(VOL_CLIENT_STORAGE, i - n_primary);
+		} else {
+			d->storage_region_map[i] = STORAGE_REGION_INVALID;
+		}
+	}
+}
+
+void usbd_scsi_volumes_changed()
+{
+	const struct hc_device_data *d = &root_page;
+	int lun_of_volume[MAX_VOLUMES];
+	int n_luns = 0;
+	int table_offset = 0;
+
+	__disable_irq();
+	for (int vol = 0; vol < MAX_VOLUMES; vol++) {
+		lun_of_volume[vol] = -1;
+	}
+	for (int vol = VOL_PRIMARY_VIRTUAL; vol < MAX_VOLUMES && n_luns < MAX_SCSI_VOLUMES; vol++) {
+		const struct hc_volume *hv = d->volumes + vol;
+		if (!(hv->flags & HC_VOLUME_FLAG_VALID))
+			continue;
+		struct scsi_volume *v = g_scsi_volume + n_luns;
+		if (v->volume_idx != vol || v->n_regions != hv->n_regions || v->flags != hv->flags) {
+			v->media_changed = 1;
+		}
+		v->nr = n_luns;
+		v->flags = hv->flags;
+		v->volume_idx = vol;
+		v->n_regions = hv->n_regions;
+		v->region_table = g_scsi_region_table + table_offset;
+		memcpy(v->volume_name, hv->volume_name, MAX_VOLUME_NAME_LEN);
+		v->visible = (hv->flags & HC_VOLUME_FLAG_HIDDEN) ? 0 : 1;
+		v->writable = (hv->flags & HC_VOLUME_FLAG_READ_ONLY) ? 0 : 1;
+		table_offset += hv->n_regions;
+		lun_of_volume[vol] = n_luns;
+		n_luns++;
+	}
+	for (int i = 0; i < g_scsi_num_regions; i++) {
+		u16 ent = d->storage_region_map[i];
+		int vol = STORAGE_REGION_VOLUME(ent);
+		if (vol >= MAX_VOLUMES || lun_of_volume[vol] < 0)
+			continue;
+		u16 *table = (u16 *)g_scsi_volume[lun_of_volume[vol]].region_table;
+		table[STORAGE_REGION_INDEX(ent)] = i;
+	}
+	for (int i = n_luns; i < g_num_scsi_volumes; i++) {
+		if (g_scsi_volume[i].flags) {
+			g_scsi_volume[i].media_changed = 1;
+		}
+		g_scsi_volume[i].nr = i;
+		g_scsi_volume[i].flags = 0;
+		g_scsi_volume[i].volume_idx = -1;
+		g_scsi_volume[i].n_regions = 0;
+		g_scsi_volume[i].visible = 0;
+		g_scsi_volume[i].writable = 0;
+	}
+	usbd_scsi_device_state_change(g_device_state);
+	__enable_irq();
+}
+
+//
+// Grow or shrink a volume. Growing appends free regions to the end of the volume and
+// shrinking releases the regions at the end of the volume. Regions that remain in the
+// volume keep their position so the volume contents are preserved.
+//
+int usbd_scsi_volume_resize(struct hc_device_data *d, int vol, u32 n_regions)
+{
+	struct hc_volume *v = d->volumes + vol;
+	struct hc_volume *free_space = d->volumes + VOL_FREE_SPACE;
+	if (vol <= VOL_FREE_SPACE || vol >= MAX_VOLUMES)
+		return -1;
+	if (n_regions > v->n_regions) {
+		u32 idx = v->n_regions;
+		if ((n_regions - v->n_regions) > free_space->n_regions)
+			return -1;
+		for (int i = 0; i < g_scsi_num_regions && idx < n_regions; i++) {
+			if (STORAGE_REGION_VOLUME(d->storage_region_map[i]) == VOL_FREE_SPACE) {
+				d->storage_region_map[i] = STORAGE_REGION_ENTRY(vol, idx);
+				idx++;
+			}
+		}
+		free_space->n_regions -= (n_regions - v->n_regions);
+	} else {
+		for (int i = 0; i < g_scsi_num_regions; i++) {
+			u16 ent = d->storage_region_map[i];
+			if (STORAGE_REGION_VOLUME(ent) == vol && STORAGE_REGION_INDEX(ent) >= n_regions) {
+				d->storage_region_map[i] = STORAGE_REGION_ENTRY(VOL_FREE_SPACE, 0);
+			}
+		}
+		free_space->n_regions += (v->n_regions - n_regions);
+	}
+	v->n_regions = n_regions;
+	return 0;
+}
+
 void usbd_scsi_init()
 {
 	u32 nr_blocks  = hmmc1.MmcCard.BlockNbr - (EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ));
 	g_scsi_region_size_blocks = (STORAGE_REGION_SIZE)/hmmc1.MmcCard.BlockSize;
-	g_num_scsi_volumes = 2;
+	g_scsi_region_size_shift = __builtin_ctz(g_scsi_region_size_blocks);
+	g_num_scsi_volumes = MAX_SCSI_VOLUMES;
 	g_scsi_num_regions = nr_blocks / g_scsi_region_size_blocks;
+	if (g_scsi_num_regions > NUM_STORAGE_REGIONS) {
+		g_scsi_num_regions = NUM_STORAGE_REGIONS;
+	}
 
-	g_scsi_volume[0].nr = 2;
-	g_scsi_volume[0].flags = HC_VOLUME_FLAG_VALID;
-	g_scsi_volume[0].region_start = 0;
-	g_scsi_volume[0].n_regions = (8192/32);
-	g_scsi_volume[0].started = 0;
-	g_scsi_volume[0].visible = 1;
-	g_scsi_volume[0].writable = 1;
+	usbd_scsi_root_page_loaded();
+	for (int i = 0; i < g_num_scsi_volumes; i++) {
+		g_scsi_volume[i].started = 0;
+		g_scsi_volume[i].media_changed = 0;
+	}
+}
 
-	g_scsi_volume[1].nr = 2;
-	g_scsi_volume[1].flags = HC_VOLUME_FLAG_VALID |
-		HC_VOLUME_FLAG_ENCRYPTED |
-		HC_VOLUME_FLAG_HIDDEN |
-		HC_VOLUME_FLAG_VISIBLE_ON_UNLOCK;
-	g_scsi_volume[1].region_start = g_scsi_volume[0].n_regions;
-	g_scsi_volume[1].n_regions = g_scsi_num_regions - g_scsi_volume[0].n_regions;
-	g_scsi_volume[1].started = 0;
-	g_scsi_volume[1].visible = 0;
-	g_scsi_volume[1].writable = 1;
+//
+// root_page was reloaded from flash. Firmware without a region map leaves the layout
+// invalid so it is defaulted again before the volume tables are rebuilt from it.
+// Before usbd_scsi_init() the card size isn't known and there is nothing to rebuild
+//
+void usbd_scsi_root_page_loaded()
+{
+	if (!g_scsi_num_regions)
+		return;
+	if (!storage_layout_valid(&root_page)) {
+		storage_layout_default(&root_page);
+	}
+	usbd_scsi_volumes_changed();
+}
+
+//
+// The storage area was wiped. Lay the volumes out the way an erased root page
+// boots and tell the host every LUN changed.
+//
+void usbd_scsi_storage_wiped()
+{
+	storage_layout_default(&root_page);
+	usbd_scsi_volumes_changed();
+	for (int i = 0; i < g_num_scsi_volumes; i++) {
+		g_scsi_volume[i].media_changed = 1;
+	}
+}
+
+static struct {
+	int active;
+	uint8_t lun;
+	uint8_t opcode;
+	u32 start_cycles;
+} s_scsi_stats_cmd;
+
+void usbd_scsi_stats_cmd_begin(uint8_t lun, uint8_t opcode)
+{
+	s_scsi_stats_cmd.active = 1;
+	s_scsi_stats_cmd.lun = lun;
+	s_scsi_stats_cmd.opcode = opcode;
+	s_scsi_stats_cmd.start_cycles = DWT->CYCCNT;
+}
+
+static int scsi_latency_bucket(u32 us)
+{
+	int b = us ? (31 - __builtin_clz(us)) : 0;
+	b -= HC_IO_LATENCY_SHIFT;
+	if (b < 0)
+		return 0;
+	if (b >= HC_IO_LATENCY_BUCKETS)
+		return HC_IO_LATENCY_BUCKETS - 1;
+	return b;
+}
+
+void usbd_scsi_stats_cmd_end(uint8_t status, u32 bytes)
+{
+	if (!s_scsi_stats_cmd.active || s_scsi_stats_cmd.lun >= HC_IO_STATS_MAX_LUNS)
+		return;
+	s_scsi_stats_cmd.active = 0;
+	struct hc_io_lun_stats *st = g_io_stats.lun + s_scsi_stats_cmd.lun;
+	u32 us = (DWT->CYCCNT - s_scsi_stats_cmd.start_cycles) / (SystemCoreClock / 1000000);
+	if (status != USBD_CSW_CMD_PASSED)
+		st->failed_cmds++;
+	switch (s_scsi_stats_cmd.opcode) {
+	case SCSI_READ10:
+		st->read_cmds++;
+		st->read_bytes += bytes;
+		st->read_latency_hist[scsi_latency_bucket(us)]++;
+		break;
+	case SCSI_WRITE10:
+		st->write_cmds++;
+		st->write_bytes += bytes;
+		st->write_latency_hist[scsi_latency_bucket(us)]++;
+		break;
+	default:
+		st->other_cmds++;
+		break;
+	}
+}
+
+//The volume may have been resized or deleted since the host read its capacity
+static int scsi_range_valid(int lun, u64 lba, u64 n_blocks)
+{
+	const struct scsi_volume *v = g_scsi_volume + lun;
+	return (lba + n_blocks) <= ((u64)v->n_regions << g_scsi_region_size_shift);
+}
+
+//Set when a transfer runs past the end of its volume because the volume changed
+static int g_scsi_range_error = 0;
+
+static void scsi_transfer_complete()
+{
+	if (g_scsi_range_error) {
+		USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+		int lun = hmsc->cbw.bLUN;
+		g_scsi_range_error = 0;
+		if (g_scsi_volume[lun].media_changed) {
+			g_scsi_volume[lun].media_changed = 0;
+			SCSI_SenseCode(g_pdev, lun, UNIT_ATTENTION, MEDIUM_HAVE_CHANGED, 0);
+		} else {
+			SCSI_SenseCode(g_pdev, lun, ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE, 0);
+		}
+		MSC_BOT_SendCSW (g_pdev, USBD_CSW_CMD_FAILED);
+	} else {
+		MSC_BOT_SendCSW (g_pdev, USBD_CSW_CMD_PASSED);
+	}
+}
+
+//Callers must check the LBA with scsi_range_valid() first
+static u32 scsi_emmc_block(int lun, u32 lba)
+{
+	const struct scsi_volume *v = g_scsi_volume + lun;
+	return (EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ)) +
+		(v->region_table[lba >> g_scsi_region_size_shift] << g_scsi_region_size_shift) +
+		(lba & (g_scsi_region_size_blocks - 1));
 }
 
 int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd)
@@ -219,6 +497,14 @@ static int8_t SCSI_TestUnitReady(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 		hmsc->bot_state = USBD_BOT_NO_DATA;
 		return -1;
 	}
+
+	if (g_scsi_volume[lun].media_changed) {
+		g_scsi_volume[lun].media_changed = 0;
+		SCSI_SenseCode(pdev, lun, UNIT_ATTENTION, MEDIUM_HAVE_CHANGED, 0);
+		hmsc->bot_data_length = 0U;
+		hmsc->bot_state = USBD_BOT_NO_DATA;
+		return -1;
+	}
 	hmsc->bot_data_length = 0U;
 	return 0;
 }
@@ -453,7 +739,7 @@ static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 void readProcessingComplete(struct bufferFIFO *bf)
 {
 	assert(mmcDataToTransfer == 0);
-	MSC_BOT_SendCSW (g_pdev, USBD_CSW_CMD_PASSED);
+	scsi_transfer_complete();
 }
 
 int g_usb_transmitting = 0;
@@ -494,6 +780,11 @@ static void processMMCReadBuffer(struct bufferFIFO *bf, int readLen, u32 readDat
 	} else {
 		len = bf->maxBufferSize;
 	}
+	//Regions of a volume aren't contiguous on the eMMC so transfers can't span them
+	u32 region_remaining = (g_scsi_region_size_blocks - (mmcBlockAddr & (g_scsi_region_size_blocks - 1))) * 512;
+	if (len > region_remaining) {
+		len = region_remaining;
+	}
 	mmcBufferRead = bufferWrite;
 	mmcStageIdx = stageIdx;
 	mmcReadLen = len;
@@ -526,17 +817,24 @@ static void processDecryptReadBuffer(struct bufferFIFO *bf,
 	g_scsi_aes_write = (u32 *)bufferWrite;
 	g_scsi_aes_encrypt = 0;
 	set_crypt_config();
+	g_scsi_aes_start_cycles = DWT->CYCCNT;
+	trace_begin(HC_TRACE_SPAN_CRYP);
 	HAL_CRYP_Decrypt_DMA(&hcryp, g_scsi_aes_read, 512/4, g_scsi_aes_write);
 }
 
 #endif
 
-void emmc_user_read_storage_rx_complete()
+static void mmc_transfer_advance()
 {
 	mmcDataToTransfer -= mmcReadLen;
 	mmcDataTransferred += mmcReadLen;
 	mmcBlockAddr += mmcReadLen/512;
 	mmcBlocksToTransfer -= mmcReadLen/512;
+}
+
+void emmc_user_read_storage_rx_complete()
+{
+	mmc_transfer_advance();
 
 	if (mmcDataToTransfer == 0) {
 		bufferFIFO_stallStage(&usbBulkBufferFIFO, mmcStageIdx);
@@ -586,7 +884,6 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 			hmsc->bot_state = USBD_BOT_NO_DATA;
 			return -1;
 		}
-		uint32_t len = MIN(hmsc->scsi_blk_len, usbBulkBufferFIFO.maxBufferSize);
 		mmcDataToTransfer = hmsc->scsi_blk_len;
 		mmcBlocksToTransfer = blk_len;
 		mmcBlockAddr = blk_addr;
@@ -598,6 +895,7 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 			usbBulkBufferFIFO.numStages = 3;
 			usbBulkBufferFIFO.processStage[0] = processMMCReadBuffer;
 			usbBulkBufferFIFO.processStage[1] = processDecryptReadBuffer;
+			usbBulkBufferFIFO.inPlace[1] = 1;
 			usbBulkBufferFIFO.processStage[2] = processUSBReadBuffer;
 			usbBulkBufferFIFO.processingComplete = readProcessingComplete;
 		} else {
@@ -612,6 +910,8 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 		usbBulkBufferFIFO.processStage[1] = processUSBReadBuffer;
 		usbBulkBufferFIFO.processingComplete = readProcessingComplete;
 #endif
+		bufferFIFO_configure(&usbBulkBufferFIFO, hmsc->scsi_blk_len);
+		uint32_t len = MIN(hmsc->scsi_blk_len, usbBulkBufferFIFO.maxBufferSize);
 		bufferFIFO_start(&usbBulkBufferFIFO, len);
 		return 0;
 	} else {
@@ -622,17 +922,26 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 void emmc_user_storage_start()
 {
 	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
-	HAL_MMC_CardStateTypeDef cardState;
+	//
+	// Skip the eMMC for the rest of a transfer whose volume shrank or went away
+	// so it can't reach another volume's regions. The command fails at the end
+	//
+	if (!scsi_range_valid(hmsc->cbw.bLUN, mmcBlockAddr, mmcReadLen/512)) {
+		g_scsi_range_error = 1;
+		if (hmsc->bot_state == USBD_BOT_DATA_IN) {
+			memset(mmcBufferRead, 0, mmcReadLen);
+			emmc_user_read_storage_rx_complete();
+		} else {
+			mmc_transfer_advance();
+			emmc_user_write_storage_tx_complete(&hmmc1);
+		}
+		return;
+	}
+	trace_begin(HC_TRACE_SPAN_EMMC_DMA);
 	if (hmsc->bot_state == USBD_BOT_DATA_IN) {
 		int lun = hmsc->cbw.bLUN;
 
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
-
-		u32 blockAddrAdj = mmcBlockAddr +
-			(EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ)) +
-			(g_scsi_volume[lun].region_start * g_scsi_region_size_blocks);
+		u32 blockAddrAdj = scsi_emmc_block(lun, mmcBlockAddr);
 
 		HAL_MMC_ReadBlocks_DMA(&hmmc1, mmcBufferRead,
 				blockAddrAdj,
@@ -640,13 +949,7 @@ void emmc_user_storage_start()
 	} else if (hmsc->bot_state == USBD_BOT_DATA_OUT) {
 		int lun = hmsc->cbw.bLUN;
 
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
-
-		u32 blockAddrAdj = mmcBlockAddr +
-			(EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ)) +
-			(g_scsi_volume[lun].region_start * g_scsi_region_size_blocks);
+		u32 blockAddrAdj = scsi_emmc_block(lun, mmcBlockAddr);
 
 		HAL_MMC_WriteBlocks_DMA_Initial(&hmmc1, mmcBufferWrite, mmcReadLen,
 				blockAddrAdj,
@@ -657,7 +960,7 @@ void emmc_user_storage_start()
 void writeProcessingComplete(struct bufferFIFO *bf)
 {
 	assert(mmcDataToTransfer == 0);
-	MSC_BOT_SendCSW (g_pdev, USBD_CSW_CMD_PASSED);
+	scsi_transfer_complete();
 }
 
 void processUSBWriteBuffer(struct bufferFIFO *bf, int readSize, u32 readData, const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
@@ -669,6 +972,11 @@ void processUSBWriteBuffer(struct bufferFIFO *bf, int readSize, u32 readData, co
 	} else {
 		len = bf->maxBufferSize;
 	}
+	//Regions of a volume aren't contiguous on the eMMC so transfers can't span them
+	u32 region_remaining = STORAGE_REGION_SIZE - (hmsc->scsi_blk_addr & (STORAGE_REGION_SIZE - 1));
+	if (len > region_remaining) {
+		len = region_remaining;
+	}
 	hmsc->stageIdx = stageIdx;
 	hmsc->writeBuffer = bufferWrite;
 	hmsc->writeLen = len;
@@ -707,6 +1015,8 @@ void usbd_scsi_idle()
 		g_scsi_aes_read += 512/4;
 		g_scsi_aes_write += 512/4;
 		if (!g_scsi_num_aes_sector) {
+			trace_end(HC_TRACE_SPAN_CRYP);
+			g_io_stats.aes_busy_cycles += DWT->CYCCNT - g_scsi_aes_start_cycles;
 			g_cryptDataToTransfer -= g_cryptTxLen;
 			if (g_cryptDataToTransfer == 0) {
 				bufferFIFO_stallStage(&usbBulkBufferFIFO, g_cryptStageIdx);
@@ -736,6 +1046,8 @@ void processEncryptWriteBuffer(struct bufferFIFO *bf, int readLen, u32 readData,
 	g_scsi_aes_write = (u32 *)bufferWrite;
 	g_scsi_aes_encrypt = 1;
 	set_crypt_config();
+	g_scsi_aes_start_cycles = DWT->CYCCNT;
+	trace_begin(HC_TRACE_SPAN_CRYP);
 	HAL_CRYP_Encrypt_DMA(&hcryp, g_scsi_aes_read, 512/4, g_scsi_aes_write);
 }
 #endif
@@ -744,10 +1056,7 @@ int mmcTXDmaActive = 0;
 
 void emmc_user_write_storage_tx_dma_complete(MMC_HandleTypeDef *hmmc)
 {
-	mmcDataToTransfer -= mmcReadLen;
-	mmcDataTransferred += mmcReadLen;
-	mmcBlockAddr += mmcReadLen/512;
-	mmcBlocksToTransfer -= mmcReadLen/512;
+	mmc_transfer_advance();
 	HAL_MMC_WriteBlocks_DMA_Cont(&hmmc1, NULL, 0); //HC_TODO: handle return error code
 }
 
@@ -828,7 +1137,6 @@ static int8_t SCSI_Write10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 		hmsc->bot_state = USBD_BOT_DATA_OUT;
 
 		/* Prepare EP to receive first data packet */
-		uint32_t len = MIN(hmsc->scsi_blk_len, usbBulkBufferFIFO.maxBufferSize);
 		mmcDataToTransfer = hmsc->scsi_blk_len;
 		mmcBlocksToTransfer = blk_len;
 		mmcBlockAddr = blk_addr;
@@ -840,6 +1148,7 @@ static int8_t SCSI_Write10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 			usbBulkBufferFIFO.numStages = 3;
 			usbBulkBufferFIFO.processStage[0] = processUSBWriteBuffer;
 			usbBulkBufferFIFO.processStage[1] = processEncryptWriteBuffer;
+			usbBulkBufferFIFO.inPlace[1] = 1;
 			usbBulkBufferFIFO.processStage[2] = processMMCWriteBuffer;
 			usbBulkBufferFIFO.processingComplete = writeProcessingComplete;
 		} else {
@@ -854,6 +1163,8 @@ static int8_t SCSI_Write10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 		usbBulkBufferFIFO.processStage[1] = processMMCWriteBuffer;
 		usbBulkBufferFIFO.processingComplete = writeProcessingComplete;
 #endif
+		bufferFIFO_configure(&usbBulkBufferFIFO, hmsc->scsi_blk_len);
+		uint32_t len = MIN(hmsc->scsi_blk_len, usbBulkBufferFIFO.maxBufferSize);
 		bufferFIFO_start(&usbBulkBufferFIFO, len);
 	} else { /* Write Process ongoing */
 		return SCSI_ProcessWrite(pdev, lun);
@@ -904,7 +1215,14 @@ static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef *pdev, uint8_t lun,
 {
 	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
 
-	if ((blk_offset + blk_nbr) > hmsc->scsi_blk_nbr) {
+	if (g_scsi_volume[lun].media_changed) {
+		g_scsi_volume[lun].media_changed = 0;
+		SCSI_SenseCode(pdev, lun, UNIT_ATTENTION, MEDIUM_HAVE_CHANGED, 0);
+		hmsc->bot_data_length = 0U;
+		hmsc->bot_state = USBD_BOT_NO_DATA;
+		return -1;
+	}
+	if (!scsi_range_valid(lun, blk_offset, blk_nbr)) {
 		SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE, 0);
 		hmsc->bot_data_length = 0U;
 		hmsc->bot_state = USBD_BOT_NO_DATA;
@@ -913,6 +1231,47 @@ static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef *pdev, uint8_t lun,
 	return 0;
 }
 
+//Runs the checks a command makes before its data phase, setting the sense
+//code and returning -1 if it will fail. UAS must announce the data phase
+//with a ready IU before the command runs, so it uses this to answer failing
+//commands with a status IU alone
+int8_t SCSI_CheckCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd)
+{
+	USBD_StorageTypeDef *storage = (USBD_StorageTypeDef *)pdev->pUserData;
+	uint32_t blk_nbr;
+	uint16_t blk_size;
+
+	switch (cmd[0]) {
+	case SCSI_READ10:
+	case SCSI_WRITE10:
+		if (storage->IsReady(lun) != 0) {
+			SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT, 0);
+			return -1;
+		}
+		if (cmd[0] == SCSI_WRITE10 && storage->IsWriteProtected(lun) != 0) {
+			SCSI_SenseCode(pdev, lun, NOT_READY, WRITE_PROTECTED, 0);
+			return -1;
+		}
+		return SCSI_CheckAddressRange(pdev, lun,
+		                              ((uint32_t)cmd[2] << 24) |
+		                              ((uint32_t)cmd[3] << 16) |
+		                              ((uint32_t)cmd[4] << 8) |
+		                              (uint32_t)cmd[5],
+		                              ((uint32_t)cmd[7] << 8) |
+		                              (uint32_t)cmd[8]);
+	case SCSI_READ_CAPACITY10:
+	case SCSI_READ_FORMAT_CAPACITIES:
+		if (storage->GetCapacity(lun, &blk_nbr, &blk_size) != 0) {
+			SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT, 0);
+			return -1;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
 extern PCD_HandleTypeDef hpcd;
 
 static int8_t SCSI_ProcessWrite (USBD_HandleTypeDef  *pdev, uint8_t lun)
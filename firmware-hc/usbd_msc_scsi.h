@@ -109,12 +109,14 @@ extern  uint8_t ReadFormatCapacity_Data [];
 struct scsi_volume {
 	int nr;
 	u32 flags;
-	u32 region_start;
+	int volume_idx;
+	const u16 *region_table; //Maps volume region index to eMMC region index
 	u32 n_regions;
 	u8 volume_name[MAX_VOLUME_NAME_LEN];
 	int started;
 	int visible;
 	int writable;
+	int media_changed;
 };
 
 extern int g_num_scsi_volumes;
@@ -123,9 +125,15 @@ extern int g_scsi_region_size_blocks;
 extern struct scsi_volume g_scsi_volume[MAX_SCSI_VOLUMES];
 
 void usbd_scsi_init();
+void usbd_scsi_volumes_changed();
+void usbd_scsi_root_page_loaded();
+void usbd_scsi_storage_wiped();
+int usbd_scsi_volume_resize(struct hc_device_data *d, int vol, u32 n_regions);
 void usbd_scsi_idle();
 int usbd_scsi_idle_ready();
 void usbd_scsi_device_state_change(enum device_state state);
+void usbd_scsi_stats_cmd_begin(uint8_t lun, uint8_t opcode);
+void usbd_scsi_stats_cmd_end(uint8_t status, u32 bytes);
 
 typedef struct _SENSE_ITEM {
 	char Skey;
@@ -140,6 +148,7 @@ typedef struct _SENSE_ITEM {
 } USBD_SCSI_SenseTypeDef;
 
 int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd);
+int8_t SCSI_CheckCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd);
 
 void SCSI_SenseCode(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t sKey,
                     uint8_t ASC, uint8_t ASCQ);
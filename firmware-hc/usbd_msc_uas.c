@@ -0,0 +1,335 @@
+#include "usbd_msc_uas.h"
+#include "usbd_msc_bot.h"
+#include "usbd_msc.h"
+#include "usbd_msc_scsi.h"
+#include "usbd_multi.h"
+#include "main.h"
+
+#include <string.h>
+
+extern USBD_HandleTypeDef *g_pdev;
+
+//
+// USB 2.0 UAS has no bulk streams. Each command's data phase is announced to
+// the host with a READ READY or WRITE READY IU on the status pipe and the
+// data moves over the same bulk endpoints BOT uses. The gain over BOT is that
+// the host can queue several tagged commands, so the next command is already
+// on the device when the active one completes instead of costing a CBW and
+// CSW round trip per transfer.
+//
+// Command IU's are queued from the USB interrupt. Everything else, including
+// writing to the status pipe, happens from usbd_uas_idle() in the main loop.
+//
+
+enum uas_data_dir {
+	UAS_DATA_NONE,
+	UAS_DATA_IN,
+	UAS_DATA_OUT
+};
+
+static struct {
+	int enabled;
+
+	struct uas_command_iu queue[UAS_MAX_COMMANDS];
+	volatile u32 queue_head;
+	volatile u32 queue_tail;
+
+	union {
+		struct uas_command_iu cmd;
+		struct uas_task_mgmt_iu tm;
+		u8 raw[64];
+	} rx __attribute__((aligned(16)));
+	volatile int rx_paused;
+	volatile int rx_pending;
+	volatile u32 rx_len;
+
+	int active;
+	volatile int active_done;
+	volatile u8 active_status;
+
+	volatile int status_busy;
+	u8 status_buf[sizeof(struct uas_sense_iu)] __attribute__((aligned(16)));
+} s_uas DMA_BUFFER;
+
+static u16 uas_tag(const u8 *tag)
+{
+	return (tag[0] << 8) | tag[1];
+}
+
+static void uas_set_tag(u8 *dst, u16 tag)
+{
+	dst[0] = tag >> 8;
+	dst[1] = tag & 0xff;
+}
+
+static enum uas_data_dir uas_data_direction(USBD_MSC_BOT_HandleTypeDef *hmsc, const u8 *cdb, u32 *len)
+{
+	switch (cdb[0]) {
+	case SCSI_READ10:
+		*len = ((cdb[7] << 8) | cdb[8]) * hmsc->scsi_blk_size;
+		return UAS_DATA_IN;
+	case SCSI_WRITE10:
+		*len = ((cdb[7] << 8) | cdb[8]) * hmsc->scsi_blk_size;
+		return UAS_DATA_OUT;
+	case SCSI_INQUIRY:
+	case SCSI_REQUEST_SENSE:
+	case SCSI_MODE_SENSE6:
+		*len = cdb[4];
+		break;
+	case SCSI_MODE_SENSE10:
+	case SCSI_READ_FORMAT_CAPACITIES:
+		*len = (cdb[7] << 8) | cdb[8];
+		break;
+	case SCSI_READ_CAPACITY10:
+		*len = READ_CAPACITY10_DATA_LEN;
+		break;
+	default:
+		*len = 0;
+		return UAS_DATA_NONE;
+	}
+	return *len ? UAS_DATA_IN : UAS_DATA_NONE;
+}
+
+static void uas_rx_next(USBD_HandleTypeDef *pdev)
+{
+	if ((s_uas.queue_head - s_uas.queue_tail) < UAS_MAX_COMMANDS) {
+		s_uas.rx_paused = 0;
+		USBD_LL_PrepareReceive(pdev, MSC_UAS_CMD_EPOUT_ADDR, s_uas.rx.raw, sizeof(s_uas.rx.raw));
+	} else {
+		s_uas.rx_paused = 1;
+	}
+}
+
+static void uas_send_status_iu(USBD_HandleTypeDef *pdev, int len)
+{
+	s_uas.status_busy = 1;
+	USBD_LL_Transmit(pdev, MSC_UAS_STATUS_EPIN_ADDR, s_uas.status_buf, len);
+}
+
+static void uas_send_ready(USBD_HandleTypeDef *pdev, u8 iu_id, u16 tag)
+{
+	struct uas_ready_iu *iu = (struct uas_ready_iu *)s_uas.status_buf;
+	memset(iu, 0, sizeof(*iu));
+	iu->iu_id = iu_id;
+	uas_set_tag(iu->tag, tag);
+	uas_send_status_iu(pdev, sizeof(*iu));
+}
+
+static void uas_send_sense(USBD_HandleTypeDef *pdev, u16 tag, u8 CSW_Status)
+{
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
+	struct uas_sense_iu *iu = (struct uas_sense_iu *)s_uas.status_buf;
+	int len = sizeof(*iu) - sizeof(iu->sense);
+
+	memset(iu, 0, sizeof(*iu));
+	iu->iu_id = UAS_IU_SENSE;
+	uas_set_tag(iu->tag, tag);
+	if (CSW_Status != USBD_CSW_CMD_PASSED) {
+		//UAS returns sense data with the status so there is no REQUEST SENSE
+		iu->status = UAS_STATUS_CHECK_CONDITION;
+		iu->sense[0] = 0x70U;
+		iu->sense[7] = 10;
+		if (hmsc->scsi_sense_head != hmsc->scsi_sense_tail) {
+			iu->sense[2] = hmsc->scsi_sense[hmsc->scsi_sense_head].Skey;
+			iu->sense[12] = hmsc->scsi_sense[hmsc->scsi_sense_head].w.b.ASC;
+			iu->sense[13] = hmsc->scsi_sense[hmsc->scsi_sense_head].w.b.ASCQ;
+			hmsc->scsi_sense_head++;
+			if (hmsc->scsi_sense_head == SENSE_LIST_DEEPTH) {
+				hmsc->scsi_sense_head = 0U;
+			}
+		} else {
+			iu->sense[2] = ABORTED_COMMAND;
+		}
+		iu->length[1] = sizeof(iu->sense);
+		len = sizeof(*iu);
+	}
+	uas_send_status_iu(pdev, len);
+}
+
+static void uas_send_response(USBD_HandleTypeDef *pdev, u16 tag, u8 response_code)
+{
+	struct uas_response_iu *iu = (struct uas_response_iu *)s_uas.status_buf;
+	memset(iu, 0, sizeof(*iu));
+	iu->iu_id = UAS_IU_RESPONSE;
+	uas_set_tag(iu->tag, tag);
+	iu->response_code = response_code;
+	uas_send_status_iu(pdev, sizeof(*iu));
+}
+
+static void uas_task_management(USBD_HandleTypeDef *pdev)
+{
+	u8 response_code = UAS_RC_INVALID_IU;
+	u16 tag = uas_tag(s_uas.rx.tm.tag);
+
+	if (s_uas.rx.tm.iu_id == UAS_IU_TASK_MGMT && s_uas.rx_len >= sizeof(struct uas_task_mgmt_iu)) {
+		switch (s_uas.rx.tm.function) {
+		case UAS_TM_ABORT_TASK: {
+			//Queued commands can be dropped. The active command is left to
+			//complete since its data phase may already be in flight.
+			u16 task_tag = uas_tag(s_uas.rx.tm.task_tag);
+			for (u32 i = s_uas.queue_tail; i != s_uas.queue_head; i++) {
+				struct uas_command_iu *iu = s_uas.queue + (i % UAS_MAX_COMMANDS);
+				if (iu->iu_id == UAS_IU_COMMAND && uas_tag(iu->tag) == task_tag) {
+					iu->iu_id = 0;
+				}
+			}
+			response_code = UAS_RC_TM_COMPLETE;
+		} break;
+		default:
+			response_code = UAS_RC_TM_NOT_SUPPORTED;
+			break;
+		}
+	}
+	uas_send_response(pdev, tag, response_code);
+}
+
+static void uas_start_command(USBD_HandleTypeDef *pdev)
+{
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
+	struct uas_command_iu *iu = s_uas.queue + (s_uas.queue_tail % UAS_MAX_COMMANDS);
+	u32 len;
+
+	if (iu->iu_id != UAS_IU_COMMAND) {
+		s_uas.queue_tail++;
+		return;
+	}
+
+	//Present the command IU to the SCSI layer as if it were a CBW
+	hmsc->cbw.dSignature = USBD_BOT_CBW_SIGNATURE;
+	hmsc->cbw.dTag = uas_tag(iu->tag);
+	hmsc->cbw.bLUN = iu->lun[1];
+	hmsc->cbw.bCBLength = sizeof(iu->cdb);
+	memcpy(hmsc->cbw.CB, iu->cdb, sizeof(iu->cdb));
+	enum uas_data_dir dir = uas_data_direction(hmsc, iu->cdb, &len);
+	hmsc->cbw.dDataLength = len;
+	hmsc->cbw.bmFlags = (dir == UAS_DATA_IN) ? 0x80U : 0;
+	hmsc->csw.dTag = hmsc->cbw.dTag;
+	hmsc->csw.dDataResidue = len;
+	int bad_lun = iu->lun[0] || iu->lun[1] >= MAX_SCSI_VOLUMES;
+	__DMB();
+	s_uas.queue_tail++;
+
+	s_uas.active = 1;
+	s_uas.active_done = 0;
+	hmsc->bot_state = USBD_BOT_IDLE;
+
+	if (bad_lun) {
+		SCSI_SenseCode(pdev, 0, ILLEGAL_REQUEST, INVALID_FIELED_IN_COMMAND, 0);
+		MSC_UAS_SendStatus(pdev, USBD_CSW_CMD_FAILED);
+		return;
+	}
+	//A command that will fail gets its status IU without a ready IU first
+	if (dir != UAS_DATA_NONE && SCSI_CheckCmd(pdev, hmsc->cbw.bLUN, hmsc->cbw.CB) < 0) {
+		MSC_UAS_SendStatus(pdev, USBD_CSW_CMD_FAILED);
+		return;
+	}
+
+	//A zero block READ10 or WRITE10 has no data phase to announce
+	switch (len ? dir : UAS_DATA_NONE) {
+	case UAS_DATA_IN:
+		uas_send_ready(pdev, UAS_IU_READ_READY, hmsc->cbw.dTag);
+		break;
+	case UAS_DATA_OUT:
+		uas_send_ready(pdev, UAS_IU_WRITE_READY, hmsc->cbw.dTag);
+		break;
+	default:
+		break;
+	}
+	MSC_BOT_ProcessCBW(pdev);
+}
+
+void MSC_UAS_Init(USBD_HandleTypeDef *pdev)
+{
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
+
+	hmsc->bot_state = USBD_BOT_IDLE;
+	hmsc->bot_status = USBD_BOT_STATUS_NORMAL;
+	hmsc->scsi_sense_tail = 0U;
+	hmsc->scsi_sense_head = 0U;
+
+	memset(&s_uas, 0, sizeof(s_uas));
+
+	//Cancel the CBW receive BOT left pending on the data out pipe
+	USBD_LL_CloseEP(pdev, MSC_EPOUT_ADDR);
+	USBD_LL_OpenEP(pdev, MSC_EPOUT_ADDR, USBD_EP_TYPE_BULK, MSC_MAX_HS_PACKET);
+	USBD_LL_FlushEP(pdev, MSC_EPIN_ADDR);
+
+	USBD_LL_OpenEP(pdev, MSC_UAS_CMD_EPOUT_ADDR, USBD_EP_TYPE_BULK, MSC_UAS_EP_SIZE);
+	pdev->ep_out[MSC_UAS_CMD_EPOUT_ADDR & 0xFU].is_used = 1U;
+	USBD_LL_OpenEP(pdev, MSC_UAS_STATUS_EPIN_ADDR, USBD_EP_TYPE_BULK, MSC_UAS_EP_SIZE);
+	pdev->ep_in[MSC_UAS_STATUS_EPIN_ADDR & 0xFU].is_used = 1U;
+
+	s_uas.enabled = 1;
+	uas_rx_next(pdev);
+}
+
+void MSC_UAS_DeInit(USBD_HandleTypeDef *pdev)
+{
+	if (!s_uas.enabled)
+		return;
+	s_uas.enabled = 0;
+	USBD_LL_CloseEP(pdev, MSC_UAS_CMD_EPOUT_ADDR);
+	pdev->ep_out[MSC_UAS_CMD_EPOUT_ADDR & 0xFU].is_used = 0U;
+	USBD_LL_CloseEP(pdev, MSC_UAS_STATUS_EPIN_ADDR);
+	pdev->ep_in[MSC_UAS_STATUS_EPIN_ADDR & 0xFU].is_used = 0U;
+}
+
+void MSC_UAS_CommandOut(USBD_HandleTypeDef *pdev)
+{
+	u32 len = USBD_LL_GetRxDataSize(pdev, MSC_UAS_CMD_EPOUT_ADDR);
+
+	if (s_uas.rx.cmd.iu_id == UAS_IU_COMMAND && len >= sizeof(struct uas_command_iu)) {
+		memcpy(s_uas.queue + (s_uas.queue_head % UAS_MAX_COMMANDS), &s_uas.rx.cmd, sizeof(struct uas_command_iu));
+		__DMB();
+		s_uas.queue_head++;
+		uas_rx_next(pdev);
+	} else {
+		//Task management and malformed IU's are answered from the main loop.
+		//The command pipe stays idle until then.
+		s_uas.rx_len = len;
+		s_uas.rx_pending = 1;
+	}
+	BEGIN_WORK(USBD_UAS_WORK);
+}
+
+void MSC_UAS_StatusIn(USBD_HandleTypeDef *pdev)
+{
+	s_uas.status_busy = 0;
+	BEGIN_WORK(USBD_UAS_WORK);
+}
+
+void MSC_UAS_SendStatus(USBD_HandleTypeDef *pdev, uint8_t CSW_Status)
+{
+	s_uas.active_status = CSW_Status;
+	__DMB();
+	s_uas.active_done = 1;
+	BEGIN_WORK(USBD_UAS_WORK);
+}
+
+void usbd_uas_idle()
+{
+	USBD_HandleTypeDef *pdev = g_pdev;
+	if (!(g_work_to_do & USBD_UAS_WORK))
+		return;
+	END_WORK(USBD_UAS_WORK);
+	if (!s_uas.enabled)
+		return;
+
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
+
+	if (s_uas.active && s_uas.active_done && !s_uas.status_busy) {
+		s_uas.active = 0;
+		uas_send_sense(pdev, hmsc->csw.dTag, s_uas.active_status);
+	}
+	if (s_uas.rx_pending && !s_uas.status_busy) {
+		uas_task_management(pdev);
+		s_uas.rx_pending = 0;
+		uas_rx_next(pdev);
+	}
+	while (!s_uas.active && !s_uas.status_busy && s_uas.queue_head != s_uas.queue_tail) {
+		uas_start_command(pdev);
+	}
+	if (s_uas.rx_paused && !s_uas.rx_pending) {
+		uas_rx_next(pdev);
+	}
+}
@@ -0,0 +1,94 @@
+#ifndef __USBD_MSC_UAS_H
+#define __USBD_MSC_UAS_H
+
+#include "types.h"
+#include "usbd_core.h"
+
+//
+// USB Attached SCSI (UAS) transport. This is exposed as alternate setting 1
+// of the mass storage interface. Alternate setting 0 remains BOT.
+//
+#define MSC_ALT_BOT (0)
+#define MSC_ALT_UAS (1)
+
+#define UAS_PIPE_USAGE_DESC_TYPE (0x24)
+#define UAS_PIPE_USAGE_DESC_SIZ (4)
+#define UAS_PIPE_ID_COMMAND (1)
+#define UAS_PIPE_ID_STATUS (2)
+#define UAS_PIPE_ID_DATA_IN (3)
+#define UAS_PIPE_ID_DATA_OUT (4)
+
+#define UAS_IU_COMMAND (0x01)
+#define UAS_IU_SENSE (0x03)
+#define UAS_IU_RESPONSE (0x04)
+#define UAS_IU_TASK_MGMT (0x05)
+#define UAS_IU_READ_READY (0x06)
+#define UAS_IU_WRITE_READY (0x07)
+
+#define UAS_STATUS_GOOD (0x00)
+#define UAS_STATUS_CHECK_CONDITION (0x02)
+
+#define UAS_TM_ABORT_TASK (0x01)
+
+#define UAS_RC_TM_COMPLETE (0x00)
+#define UAS_RC_INVALID_IU (0x02)
+#define UAS_RC_TM_NOT_SUPPORTED (0x04)
+
+//Number of command IU's that can be queued ahead of the active command
+#define UAS_MAX_COMMANDS (8)
+
+struct uas_command_iu {
+	u8 iu_id;
+	u8 reserved;
+	u8 tag[2];
+	u8 attribute;
+	u8 reserved2;
+	u8 add_cdb_len;
+	u8 reserved3;
+	u8 lun[8];
+	u8 cdb[16];
+} __attribute__((packed));
+
+struct uas_task_mgmt_iu {
+	u8 iu_id;
+	u8 reserved;
+	u8 tag[2];
+	u8 function;
+	u8 reserved2;
+	u8 task_tag[2];
+	u8 lun[8];
+} __attribute__((packed));
+
+struct uas_ready_iu {
+	u8 iu_id;
+	u8 reserved;
+	u8 tag[2];
+} __attribute__((packed));
+
+struct uas_sense_iu {
+	u8 iu_id;
+	u8 reserved;
+	u8 tag[2];
+	u8 status_qualifier[2];
+	u8 status;
+	u8 reserved2[7];
+	u8 length[2];
+	u8 sense[18];
+} __attribute__((packed));
+
+struct uas_response_iu {
+	u8 iu_id;
+	u8 reserved;
+	u8 tag[2];
+	u8 add_response_info[3];
+	u8 response_code;
+} __attribute__((packed));
+
+void MSC_UAS_Init(USBD_HandleTypeDef *pdev);
+void MSC_UAS_DeInit(USBD_HandleTypeDef *pdev);
+void MSC_UAS_CommandOut(USBD_HandleTypeDef *pdev);
+void MSC_UAS_StatusIn(USBD_HandleTypeDef *pdev);
+void MSC_UAS_SendStatus(USBD_HandleTypeDef *pdev, uint8_t CSW_Status);
+void usbd_uas_idle();
+
+#endif
@@ -4,6 +4,9 @@
 #include "usbd_ctlreq.h"
 #include "signetdev_common_priv.h"
 #include "usb_raw_hid.h"
+#include "usbd_msc_uas.h"
+#include "usbd_cmd_bulk.h"
+#include "main.h"
 
 #define LSB(X) ((X) & 0xff)
 #define MSB(X) ((X) >> 8)
@@ -13,6 +16,10 @@ USBD_HandleTypeDef *g_pdev = NULL;
 
 int endpointToInterface(uint8_t epNum)
 {
+	if ((epNum & ~(0x80)) == MSC_UAS_CMD_EPOUT_ADDR)
+		return INTERFACE_MSC;
+	if ((epNum & ~(0x80)) == CMD_BULK_EPOUT_ADDR)
+		return INTERFACE_CMD_BULK;
 	return ((int)(epNum & ~(0x80))) - 1;
 }
 
@@ -308,6 +315,81 @@ static uint8_t USBD_Multi_CfgHSDesc[] __attribute__((aligned (4))) = {
 		0x02,   /*Bulk endpoint type */
 		LOBYTE(MSC_EPOUT_SIZE), HIBYTE(MSC_EPOUT_SIZE),
 		0x00,    /*Polling interval in milliseconds*/
+
+		/********************  Mass Storage UAS interface ********************/
+		0x09,   /* bLength: Interface Descriptor size */
+		USB_DESC_TYPE_INTERFACE,   /* bDescriptorType: */
+		INTERFACE_MSC,   /* bInterfaceNumber: Number of Interface */
+		MSC_ALT_UAS,   /* bAlternateSetting: Alternate setting */
+		0x04,   /* bNumEndpoints*/
+		0x08,   /* bInterfaceClass: MSC Class */
+		0x06,   /* bInterfaceSubClass : SCSI transparent*/
+		0x62,   /* nInterfaceProtocol: UAS */
+		0x0,          /* iInterface: */
+
+		/********************  UAS Endpoints ********************/
+		0x07,   /*Endpoint descriptor length = 7 */
+		USB_DESC_TYPE_ENDPOINT,   /*Endpoint descriptor type */
+		MSC_UAS_CMD_EPOUT_ADDR,   /*Endpoint address (OUT, address 5) */
+		0x02,   /*Bulk endpoint type */
+		LOBYTE(MSC_UAS_EP_SIZE), HIBYTE(MSC_UAS_EP_SIZE),
+		0x00,    /*Polling interval in milliseconds*/
+		UAS_PIPE_USAGE_DESC_SIZ, UAS_PIPE_USAGE_DESC_TYPE, UAS_PIPE_ID_COMMAND, 0x00,
+
+		0x07,   /*Endpoint descriptor length = 7*/
+		USB_DESC_TYPE_ENDPOINT,   /*Endpoint descriptor type */
+		MSC_UAS_STATUS_EPIN_ADDR,   /*Endpoint address (IN, address 5) */
+		0x02,   /*Bulk endpoint type */
+		LOBYTE(MSC_UAS_EP_SIZE), HIBYTE(MSC_UAS_EP_SIZE),
+		0x00,   /*Polling interval in milliseconds */
+		UAS_PIPE_USAGE_DESC_SIZ, UAS_PIPE_USAGE_DESC_TYPE, UAS_PIPE_ID_STATUS, 0x00,
+
+		0x07,   /*Endpoint descriptor length = 7*/
+		USB_DESC_TYPE_ENDPOINT,   /*Endpoint descriptor type */
+		MSC_EPIN_ADDR,   /*Endpoint address (IN, address 4) */
+		0x02,   /*Bulk endpoint type */
+		LOBYTE(MSC_EPIN_SIZE), HIBYTE(MSC_EPIN_SIZE),
+		0x00,   /*Polling interval in milliseconds */
+		UAS_PIPE_USAGE_DESC_SIZ, UAS_PIPE_USAGE_DESC_TYPE, UAS_PIPE_ID_DATA_IN, 0x00,
+
+		0x07,   /*Endpoint descriptor length = 7 */
+		USB_DESC_TYPE_ENDPOINT,   /*Endpoint descriptor type */
+		MSC_EPOUT_ADDR,   /*Endpoint address (OUT, address 4) */
+		0x02,   /*Bulk endpoint type */
+		LOBYTE(MSC_EPOUT_SIZE), HIBYTE(MSC_EPOUT_SIZE),
+		0x00,    /*Polling interval in milliseconds*/
+		UAS_PIPE_USAGE_DESC_SIZ, UAS_PIPE_USAGE_DESC_TYPE, UAS_PIPE_ID_DATA_OUT, 0x00,
+
+	//
+	// Command bulk descriptors
+	//
+	// Interface descriptor, IN endpoint, OUT endpoint
+	//
+		/********************  Command bulk interface ********************/
+		0x09,   /* bLength: Interface Descriptor size */
+		USB_DESC_TYPE_INTERFACE,   /* bDescriptorType: */
+		INTERFACE_CMD_BULK,   /* bInterfaceNumber: Number of Interface */
+		0x00,   /* bAlternateSetting: Alternate setting */
+		0x02,   /* bNumEndpoints*/
+		0xff,   /* bInterfaceClass: Vendor specific */
+		0x00,   /* bInterfaceSubClass */
+		0x00,   /* nInterfaceProtocol */
+		0x0,          /* iInterface: */
+
+		/********************  Command bulk endpoints ********************/
+		0x07,   /*Endpoint descriptor length = 7*/
+		USB_DESC_TYPE_ENDPOINT,   /*Endpoint descriptor type */
+		CMD_BULK_EPIN_ADDR,   /*Endpoint address (IN, address 6) */
+		0x02,   /*Bulk endpoint type */
+		LOBYTE(CMD_BULK_EP_SIZE), HIBYTE(CMD_BULK_EP_SIZE),
+		0x00,   /*Polling interval in milliseconds */
+
+		0x07,   /*Endpoint descriptor length = 7 */
+		USB_DESC_TYPE_ENDPOINT,   /*Endpoint descriptor type */
+		CMD_BULK_EPOUT_ADDR,   /*Endpoint address (OUT, address 6) */
+		0x02,   /*Bulk endpoint type */
+		LOBYTE(CMD_BULK_EP_SIZE), HIBYTE(CMD_BULK_EP_SIZE),
+		0x00,    /*Polling interval in milliseconds*/
 };
 
 
@@ -325,10 +407,10 @@ static uint8_t USBD_Multi_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __attr
 	0x00,
 };
 
-USBD_HID_HandleTypeDef s_cmdHIDClassData __attribute__((aligned(16)));
-static USBD_HID_HandleTypeDef s_fidoHIDClassData __attribute__((aligned(16)));
-static USBD_HID_HandleTypeDef s_keyboardHIDClassData __attribute__((aligned(16)));
-static USBD_MSC_BOT_HandleTypeDef s_SCSIMSCClassData __attribute__((aligned(16)));
+USBD_HID_HandleTypeDef s_cmdHIDClassData DMA_BUFFER;
+static USBD_HID_HandleTypeDef s_fidoHIDClassData DMA_BUFFER;
+static USBD_HID_HandleTypeDef s_keyboardHIDClassData DMA_BUFFER;
+static USBD_MSC_BOT_HandleTypeDef s_SCSIMSCClassData DMA_BUFFER;
 
 static uint8_t  USBD_Multi_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
@@ -350,6 +432,8 @@ static uint8_t  USBD_Multi_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 	s_cmdHIDClassData.packetSize = HID_CMD_EPOUT_SIZE;
 	USBD_LL_PrepareReceive (pdev, HID_CMD_EPOUT_ADDR, s_cmdHIDClassData.rx_buffer, s_cmdHIDClassData.packetSize);
 
+	USBD_CMD_BULK_Init(pdev);
+
 	pdev->pClassData[INTERFACE_FIDO] = &s_fidoHIDClassData;
 	USBD_LL_OpenEP(pdev, HID_FIDO_EPIN_ADDR, USBD_EP_TYPE_INTR, HID_FIDO_EPIN_SIZE);
 	pdev->ep_in[HID_FIDO_EPIN_ADDR & 0xFU].is_used = 1U;
@@ -378,6 +462,8 @@ static uint8_t  USBD_Multi_DeInit (USBD_HandleTypeDef *pdev,
 	pdev->ep_in[MSC_EPIN_ADDR & 0xFU].is_used = 0U;
 	USBD_LL_CloseEP(pdev, MSC_EPOUT_ADDR);
 	pdev->ep_out[MSC_EPOUT_ADDR & 0xFU].is_used = 0U;
+	MSC_UAS_DeInit(pdev);
+	s_SCSIMSCClassData.interface = MSC_ALT_BOT;
 	MSC_BOT_DeInit(pdev);
 
 	/* Close CMD HID EPs */
@@ -386,6 +472,9 @@ static uint8_t  USBD_Multi_DeInit (USBD_HandleTypeDef *pdev,
 	USBD_LL_CloseEP(pdev, HID_CMD_EPOUT_ADDR);
 	pdev->ep_out[HID_CMD_EPOUT_ADDR & 0xFU].is_used = 0U;
 
+	/* Close command bulk EPs */
+	USBD_CMD_BULK_DeInit(pdev);
+
 	/* Close FIDO HID EPs */
 	USBD_LL_CloseEP(pdev, HID_FIDO_EPIN_ADDR);
 	pdev->ep_in[HID_FIDO_EPIN_ADDR & 0xFU].is_used = 0U;
@@ -396,7 +485,7 @@ static uint8_t  USBD_Multi_DeInit (USBD_HandleTypeDef *pdev,
 	USBD_LL_CloseEP(pdev, HID_FIDO_EPIN_ADDR);
 	pdev->ep_in[HID_FIDO_EPIN_ADDR & 0xFU].is_used = 0U;
 
-	for (int i = 0; i < 5; i++) {
+	for (int i = 0; i < INTERFACE_MAX; i++) {
 		if(pdev->pClassData[i] != NULL) {
 			pdev->pClassData[i] = NULL;
 		}
@@ -423,6 +512,10 @@ static uint8_t  USBD_Multi_Setup (USBD_HandleTypeDef *pdev,
 		case INTERFACE_KEYBOARD:
 			return USBD_HID_Setup(pdev, req);
 			break;
+		case INTERFACE_CMD_BULK:
+			//No class or vendor requests
+			USBD_CtlError(pdev, req);
+			return USBD_FAIL;
 		default:
 			break;
 		}
@@ -497,6 +590,9 @@ static uint8_t  USBD_Multi_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
 	case INTERFACE_FIDO: {
 		USBD_HID_DataIn(pdev, epnum);
 	} break;
+	case INTERFACE_CMD_BULK:
+		USBD_CMD_BULK_DataIn(pdev, epnum);
+		break;
 	default:
 		break;
 	}
@@ -517,6 +613,9 @@ static uint8_t  USBD_Multi_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 #endif
 		USBD_HID_DataOut(pdev, epnum);
 		break;
+	case INTERFACE_CMD_BULK:
+		USBD_CMD_BULK_DataOut(pdev, epnum);
+		break;
 	default:
 		break;
 	}
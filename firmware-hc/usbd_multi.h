@@ -29,9 +29,16 @@ extern "C" {
 #define MSC_EPIN_SIZE                (0x200)
 #define MSC_EPOUT_SIZE               (0x200)
 
+//UAS alternate setting. Data IN/OUT pipes are shared with BOT
+#define MSC_UAS_CMD_EPOUT_ADDR       0x05U
+#define MSC_UAS_STATUS_EPIN_ADDR     0x85U
+#define MSC_UAS_EP_SIZE              (0x200)
+
 #define USB_HID_CONFIG_DESC_SIZ       (9 + \
 				((9 + 9 + 7 + 7) * 3) + \
-				((9 + 7 + 7) * 1))
+				((9 + 7 + 7) * 1) + \
+				(9 + ((7 + 4) * 4)) + \
+				(9 + 7 + 7))
 
 #define USB_HID_DESC_SIZ              9U
 
@@ -23,6 +23,36 @@
 
 #define CMD_PACKET_HEADER_SIZE (6)
 
+//
+// Tagged commands. A non-zero tag in byte 5 of a request header lets the
+// host have more than one command outstanding. Responses to tagged commands
+// set CMD_RESP_TAGGED in the response code and carry the tag in the byte
+// following the header. Untagged requests behave as before.
+//
+// Tagged commands run one at a time in arrival order. The exception is a
+// command parked on a button press: while it waits, only GET_DEVICE_STATE
+// and READ_IO_STATS are answered ahead of it. Everything else, including
+// READ_UID and READ_ALL_UIDS, reads the DB through shared command state and
+// waits until the parked command finishes.
+//
+#define CMD_PACKET_TAG_SIZE (1)
+#define CMD_RESP_TAGGED (0x80)
+#define CMD_QUEUE_DEPTH (4)
+#define CMD_MAX_OUTSTANDING (CMD_QUEUE_DEPTH + 1)
+#define CMD_TAGGED_MIN_MAJOR_VERSION (0)
+#define CMD_TAGGED_MIN_MINOR_VERSION (2)
+#define CMD_TAGGED_MIN_STEP_VERSION (3)
+
+//
+// Optional vendor bulk interface that carries whole command and response
+// buffers in single transfers. Responses are sent on the transport the
+// command arrived on. Events are always sent on the raw HID interface.
+//
+#define CMD_BULK_INTERFACE (4)
+#define CMD_BULK_EP_SIZE (512)
+#define CMD_BULK_EPOUT_ADDR (0x06)
+#define CMD_BULK_EPIN_ADDR (0x86)
+
 #ifdef FIRMWARE
 
 #ifdef SIGNET_HC
@@ -185,6 +215,18 @@ enum commands {
 	WRITE_BLOCK_HC,
 	READ_BLOCK_HC,
 	ERASE_BLOCK_HC,
+	CREATE_VOLUME,
+	RESIZE_VOLUME,
+	DELETE_VOLUME,
+	READ_TRACE,
+	READ_IO_STATS,
+	READ_BLOCKS_HC,
+	READ_BLOCK_CRCS_HC,
+	WRITE_BLOCK_VERIFY_HC,
+	WRITE_FLASH_HC,
+	WRITE_FIRMWARE_STAGE_HC,
+	FLASH_STAGED_FIRMWARE_HC,
+	WRITE_COMPRESSED_FIRMWARE_HC,
 };
 
 #endif
@@ -2,7 +2,8 @@
 #define SIGNETDEV_HC_COMMON_H
 
 #define HC_FIRMWARE_SIGNATURE_PUBKEY_LEN (32)
-#define HC_FIRMWARE_SIGNATURE_LEN (32)
+#define HC_FIRMWARE_SIGNATURE_LEN (64)
+#define HC_FIRMWARE_SIGNATURE_LEN_V1 (32) //Before signatures were Ed25519
 #define HC_FIRMWARE_HASH_KEY_LEN (32)
 #define HC_FIRMWARE_HASH_LEN (32)
 #define HC_HASH_FN_SALT_SZ (32)
@@ -39,8 +40,209 @@ struct hc_firmware_info {
 	u8 firmware_signature_pubkey[HC_FIRMWARE_SIGNATURE_PUBKEY_LEN];
 } __attribute__((packed));
 
+//UPDATE_FIRMWARE payload sent by hosts from before signatures grew to 64 bytes
+struct hc_firmware_info_v1 {
+	struct hc_firmware_version fw_version;
+	u32 firmware_crc;
+	u32 firmware_len;
+	u8 firmware_signature[HC_FIRMWARE_SIGNATURE_LEN_V1];
+	u8 firmware_signature_pubkey[HC_FIRMWARE_SIGNATURE_PUBKEY_LEN];
+} __attribute__((packed));
+
+#define HC_VOLUME_NAME_LEN (32)
+
+#define HC_VOLUME_FLAG_VALID (1<<0)
+#define HC_VOLUME_FLAG_READ_ONLY (1<<1)
+#define HC_VOLUME_FLAG_WRITABLE_ON_UNLOCK (1<<2)
+#define HC_VOLUME_FLAG_WRITABLE_ON_REQUEST (1<<3)
+#define HC_VOLUME_FLAG_HIDDEN (1<<4)
+#define HC_VOLUME_FLAG_VISIBLE_ON_UNLOCK (1<<5)
+#define HC_VOLUME_FLAG_VISIBLE_ON_REQUEST (1<<6)
+#define HC_VOLUME_FLAG_ONE_TIME_USE (1<<7)
+#define HC_VOLUME_FLAG_ENCRYPTED (1<<8)
+#define HC_VOLUME_FLAG_USE_KEYSTORE (1<<9)
+#define HC_VOLUME_FLAG_VIRTUAL (1<<10)
+
+//Flags CREATE_VOLUME accepts. Volumes with any other flag are rejected
+#define HC_VOLUME_FLAGS_SUPPORTED (HC_VOLUME_FLAG_VALID | \
+	HC_VOLUME_FLAG_READ_ONLY | \
+	HC_VOLUME_FLAG_HIDDEN | \
+	HC_VOLUME_FLAG_VISIBLE_ON_UNLOCK | \
+	HC_VOLUME_FLAG_ENCRYPTED)
+
+struct hc_volume {
+	u32 flags;
+	u32 n_regions;
+	u8 volume_name[HC_VOLUME_NAME_LEN];
+} __attribute__ ((packed));
+
+//
+// Firmware trace data returned by READ_TRACE. The response is a
+// hc_trace_header followed by n_spans hc_trace_span_stats entries and then
+// n_events hc_trace_event entries, oldest first. Times are in CPU cycles.
+//
+// Spans below HC_TRACE_SPAN_WORK_COUNT measure how long the corresponding
+// main loop work bit stayed set.
+//
+#define HC_TRACE_SPAN_WORK_COUNT (24)
+
+enum hc_trace_span {
+	HC_TRACE_SPAN_EMMC_DMA = HC_TRACE_SPAN_WORK_COUNT,
+	HC_TRACE_SPAN_CRYP,
+	HC_TRACE_SPAN_CTAP_REQUEST,
+	HC_TRACE_SPAN_DB_READ_BLOCK,
+	HC_TRACE_SPAN_DB_WRITE_BLOCK,
+	HC_TRACE_SPAN_DB_STARTUP_SCAN,
+	HC_TRACE_NUM_SPANS
+};
+
+//Bucket n counts spans of [2^(n + SHIFT), 2^(n + SHIFT + 1)) cycles. The first
+//and last buckets also count everything below and above them.
+#define HC_TRACE_HIST_BUCKETS (16)
+#define HC_TRACE_HIST_SHIFT (8)
+#define HC_TRACE_MAX_EVENTS (256)
+
+#define HC_TRACE_EVENT_BEGIN (0)
+#define HC_TRACE_EVENT_END (1)
+
+struct hc_trace_header {
+	u32 cpu_hz;
+	u32 n_recorded; //Total events recorded since the last reset
+	u16 n_spans;
+	u16 n_events;
+} __attribute__((packed));
+
+struct hc_trace_span_stats {
+	u32 count;
+	u32 min;
+	u32 max;
+	u64 total;
+	u16 hist[HC_TRACE_HIST_BUCKETS];
+} __attribute__((packed));
+
+struct hc_trace_event {
+	u32 cycles;
+	u8 span;
+	u8 type;
+	u16 reserved;
+} __attribute__((packed));
+
+//
+// I/O statistics returned by READ_IO_STATS. Latencies are measured from the
+// arrival of a mass storage command until its status is sent. Latency bucket
+// n counts commands taking [2^(n + SHIFT), 2^(n + SHIFT + 1)) microseconds.
+//
+#define HC_IO_STATS_MAX_LUNS (2)
+#define HC_IO_STATS_MAX_STAGES (4)
+#define HC_IO_LATENCY_BUCKETS (16)
+#define HC_IO_LATENCY_SHIFT (5)
+
+struct hc_io_lun_stats {
+	u64 read_bytes;
+	u64 write_bytes;
+	u32 read_cmds;
+	u32 write_cmds;
+	u32 other_cmds;
+	u32 failed_cmds;
+	u32 read_latency_hist[HC_IO_LATENCY_BUCKETS];
+	u32 write_latency_hist[HC_IO_LATENCY_BUCKETS];
+} __attribute__((packed));
+
+struct hc_emmc_wait_stats {
+	u32 count;
+	u32 total_ms;
+	u32 max_ms;
+} __attribute__((packed));
+
+struct hc_io_stats {
+	u32 ms_since_reset;
+	u32 cpu_hz;
+	struct hc_io_lun_stats lun[HC_IO_STATS_MAX_LUNS];
+	u32 fifo_stalls[HC_IO_STATS_MAX_STAGES]; //Times a bulk transfer stage waited on a neighbouring stage
+	struct hc_emmc_wait_stats emmc_storage_wait; //Time from queueing for the eMMC until starting
+	struct hc_emmc_wait_stats emmc_db_wait;
+	u64 aes_busy_cycles;
+	u32 db_cache_hits;
+	u32 db_cache_misses;
+} __attribute__((packed));
+
+//
+// READ_BLOCKS_HC streams a range of blocks while backing up the device. The
+// request is the first block and block count as u16's, optionally followed by
+// a u32 CRC for each block taken from a previous backup. Each block is sent
+// as its own message starting with a struct hc_block_record. Only records
+// with status HC_BLOCK_DATA are followed by the block contents.
+//
+enum hc_block_status {
+	HC_BLOCK_DATA,
+	HC_BLOCK_EMPTY, //Block is unallocated
+	HC_BLOCK_UNCHANGED //Block CRC matches the one given in the request
+};
+
+struct hc_block_record {
+	u16 block_idx;
+	u8 status;
+	u32 crc;
+} __attribute__((packed));
+
+//
+// Restoring only the blocks that differ. READ_BLOCK_CRCS_HC takes the first
+// block and block count as u16's and returns the CRC-32 of each block's
+// contents as a u32. WRITE_BLOCK_VERIFY_HC takes the block index as a u16,
+// the CRC-32 of the block and the block contents. The block is written and
+// read back and the read back CRC is returned as a u32. The response code is
+// WRITE_FAILED if it doesn't match.
+//
+#define HC_BLOCK_VERIFY_HEADER_SIZE (2 + 4)
+
+//
+// WRITE_FLASH_HC programs firmware without waiting on each write. The request
+// is the flash address and CRC-32 of the data as u32's followed by up to
+// HC_WRITE_FLASH_MAX_LEN bytes of data, a multiple of 4 long. The device answers as soon as the data
+// is buffered and programs it in the background, so the host can keep several
+// writes outstanding. Each response is a struct hc_write_flash_ack for the
+// last write that finished programming and a count of all writes that have
+// verified since the pages were erased. A write with no data answers once all
+// programming is done. The response code is WRITE_FAILED once any write has
+// failed to verify.
+//
+#define HC_WRITE_FLASH_HEADER_SIZE (4 + 4)
+#define HC_WRITE_FLASH_MAX_LEN (8192)
+
+struct hc_write_flash_ack {
+	u32 addr;
+	u32 length; //Zero if no write has finished programming
+	u32 crc; //CRC-32 read back from flash
+	u32 writes_verified;
+} __attribute__((packed));
+
+//
+// Unsolicited events sent on the raw HID command endpoint. Each event packet
+// carries [type][data length][data] followed by a struct hc_event_info
+//
+enum hc_event_type {
+	HC_EVENT_BUTTON_PRESS = 1,
+	HC_EVENT_BUTTON_TIMEOUT = 2,
+	HC_EVENT_STATE_CHANGED = 3, //Data is the new device state
+	HC_EVENT_WIPE_NOT_PURGED = 4 //The card couldn't sanitize the wiped area. It was zero filled instead
+};
+
+#define HC_EVENT_MAX_DATA_LEN (8)
+#define HC_EVENT_QUEUE_LEN (16)
+
+//First firmware version that appends struct hc_event_info to events
+#define HC_EVENT_INFO_MIN_MAJOR_VERSION (0)
+#define HC_EVENT_INFO_MIN_MINOR_VERSION (2)
+#define HC_EVENT_INFO_MIN_STEP_VERSION (3)
+
+struct hc_event_info {
+	u16 seq; //Incremented for every event queued
+	u16 dropped; //Events lost to a full queue since the last event was sent
+	u32 ms; //Time the event was queued
+} __attribute__((packed));
+
 #define HC_FIRMWARE_FILE_PREFIX (0x99887766)
-#define HC_FIRMWARE_FILE_VERSION (1)
+#define HC_FIRMWARE_FILE_VERSION (3)
 
 struct hc_firmware_file_header {
 	u32 file_prefix;
@@ -58,13 +260,86 @@ struct hc_firmware_file_header {
 	u8 B_signature[HC_FIRMWARE_SIGNATURE_LEN];
 } __attribute__((packed));
 
+//
+// Files from before signatures grew to 64 bytes. Their header is the same up
+// to A_signature. They are still accepted, with the signatures zero padded.
+//
+#define HC_FIRMWARE_FILE_VERSION_V1 (1)
+#define HC_FIRMWARE_FILE_VERSION_COMPRESSED_V1 (2)
+
+struct hc_firmware_file_header_v1 {
+	u32 file_prefix;
+	u32 file_version;
+	u32 header_size;
+	u8 hash_key[HC_FIRMWARE_HASH_KEY_LEN];
+	u8 hash[HC_FIRMWARE_HASH_LEN];
+	struct hc_firmware_version fw_version;
+	u32 A_crc;
+	u32 B_crc;
+	u32 A_len;
+	u32 B_len;
+	u8 signature_pubkey[HC_FIRMWARE_SIGNATURE_PUBKEY_LEN];
+	u8 A_signature[HC_FIRMWARE_SIGNATURE_LEN_V1];
+	u8 B_signature[HC_FIRMWARE_SIGNATURE_LEN_V1];
+} __attribute__((packed));
+
 struct hc_firmware_file_body {
 	u8 firmware_A[HC_BOOT_AREA_A_LEN];
 	u8 firmware_B[HC_BOOT_AREA_B_LEN];
 } __attribute__((packed));
 
+//
+// Staged firmware updates. WRITE_FIRMWARE_STAGE_HC stores one block of a
+// firmware file in the update area on the eMMC. It takes the same request as
+// WRITE_BLOCK_VERIFY_HC. Block 0 holds the struct hc_firmware_file_header
+// and the struct hc_firmware_file_body follows from block 1.
+// FLASH_STAGED_FIRMWARE_HC checks the staged header and the CRC of both
+// images, then programs the boot area that isn't running from the eMMC.
+// Internal flash is never touched unless the whole file checks out.
+//
+#define HC_FIRMWARE_STAGE_BLOCK_SIZE (16384)
+#define HC_FIRMWARE_STAGE_BLOCKS (1 + (sizeof(struct hc_firmware_file_body) / HC_FIRMWARE_STAGE_BLOCK_SIZE))
+
+//
+// Compressed firmware files have file_version HC_FIRMWARE_FILE_VERSION_COMPRESSED.
+// The header is followed by a struct hc_firmware_compressed_info and a stream
+// of ops that expand to the struct hc_firmware_file_body. A_crc and B_crc
+// describe the expanded body. Each op is an op byte followed by its arguments
+// as LEB128 encoded u32's:
+//
+// HC_FW_OP_LITERAL len: 'len' bytes that follow in the stream
+// HC_FW_OP_ZERO len: 'len' zero bytes
+// HC_FW_OP_MATCH len dist: 'len' bytes copied from 'dist' bytes back in the
+//	output. 'dist' is at most HC_FIRMWARE_WINDOW_SIZE
+// HC_FW_OP_BASE len offset: 'len' bytes copied from 'offset' in the body of
+//	the installed firmware. Only allowed with HC_FIRMWARE_DELTA
+//
+// WRITE_COMPRESSED_FIRMWARE_HC takes the u32 offset of the data in the file
+// followed by up to HC_FIRMWARE_STAGE_BLOCK_SIZE bytes of it. Data must be
+// sent in order and offset 0 starts over. The device expands the file into
+// the staging area as it arrives. It answers DONE once the whole body and
+// header have been staged, ready for FLASH_STAGED_FIRMWARE_HC.
+//
+#define HC_FIRMWARE_FILE_VERSION_COMPRESSED (4)
+#define HC_FIRMWARE_WINDOW_SIZE (4096)
+#define HC_FIRMWARE_DELTA (1)
+
+enum hc_firmware_op {
+	HC_FW_OP_LITERAL,
+	HC_FW_OP_ZERO,
+	HC_FW_OP_MATCH,
+	HC_FW_OP_BASE
+};
+
+struct hc_firmware_compressed_info {
+	u32 flags;
+	struct hc_firmware_version base_version;
+	u32 base_A_crc; //CRC of the installed boot areas a delta applies to
+	u32 base_B_crc;
+} __attribute__((packed));
+
 #define SIGNET_HC_MAJOR_VERSION 0
 #define SIGNET_HC_MINOR_VERSION 2
-#define SIGNET_HC_STEP_VERSION 2
+#define SIGNET_HC_STEP_VERSION 3
 
 #endif
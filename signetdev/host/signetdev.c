@@ -19,11 +19,20 @@ static void *g_command_resp_cb_param = NULL;
 static signetdev_device_event_t g_device_event_cb = NULL;
 static void *g_device_event_cb_param = NULL;
 
+static signetdev_device_event_info_t g_device_event_info_cb = NULL;
+static void *g_device_event_info_cb_param = NULL;
+
 signetdev_conn_err_t g_error_handler = NULL;
 void *g_error_handler_param = NULL;
 
 enum signetdev_device_type g_device_type = SIGNETDEV_DEVICE_NONE;
 
+//Set once the device has reported a firmware version that accepts tagged commands
+int g_tagged_commands = 0;
+
+//Set once the device has reported a firmware version that appends struct hc_event_info to events
+int g_event_info = 0;
+
 unsigned int signetdev_device_block_size()
 {
 	switch (g_device_type) {
@@ -156,6 +165,12 @@ void signetdev_set_device_event_cb(signetdev_device_event_t cb, void *cb_param)
 	g_device_event_cb_param = cb_param;
 }
 
+void signetdev_set_device_event_info_cb(signetdev_device_event_info_t cb, void *cb_param)
+{
+	g_device_event_info_cb = cb;
+	g_device_event_info_cb_param = cb_param;
+}
+
 void signetdev_set_error_handler(signetdev_conn_err_t handler, void *param)
 {
 	g_error_handler = handler;
@@ -268,82 +283,117 @@ static int get_cmd_token()
 	return token_ctr++;
 }
 
-static int execute_command(void *user, int token, int dev_cmd, int api_cmd)
+static int execute_command(const struct signetdev_request *req, void *user, int token, int dev_cmd, int api_cmd)
 {
-	return signetdev_priv_send_message(user, token, dev_cmd,
+	return signetdev_priv_send_message(req, user, token, dev_cmd,
 			api_cmd,
 			0, NULL, 0 /* payload size*/,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-static int execute_command_no_resp(void *user, int token,  int dev_cmd, int api_cmd)
+static int execute_command_no_resp(const struct signetdev_request *req, void *user, int token,  int dev_cmd, int api_cmd)
 {
-	return signetdev_priv_send_message(user, token, dev_cmd,
+	return signetdev_priv_send_message(req, user, token, dev_cmd,
 			api_cmd,
 			0, NULL, 0,
 			SIGNETDEV_PRIV_NO_RESP);
 }
 
-int signetdev_logout(void *user, int *token)
+int signetdev_logout_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token, LOGOUT, SIGNETDEV_CMD_LOGOUT);
+	return execute_command(req, user, *token, LOGOUT, SIGNETDEV_CMD_LOGOUT);
 }
 
-int signetdev_wipe(void *user, int *token)
+int signetdev_logout(void *user, int *token)
+{
+	return signetdev_logout_req(NULL, user, token);
+}
+
+int signetdev_wipe_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		WIPE, SIGNETDEV_CMD_WIPE);
 }
 
-int signetdev_button_wait(void *user, int *token)
+int signetdev_wipe(void *user, int *token)
+{
+	return signetdev_wipe_req(NULL, user, token);
+}
+
+int signetdev_button_wait_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		BUTTON_WAIT, SIGNETDEV_CMD_BUTTON_WAIT);
 }
 
-int signetdev_get_rand_bits(void *user, int *token, int sz)
+int signetdev_button_wait(void *user, int *token)
+{
+	return signetdev_button_wait_req(NULL, user, token);
+}
+
+int signetdev_get_rand_bits_req(const struct signetdev_request *req, void *user, int *token, int sz)
 {
 	uint8_t msg[2];
 	msg[0] = sz & 0xff;
 	msg[1] = sz >> 8;
-	return signetdev_priv_send_message(user, *token,
+	return signetdev_priv_send_message(req, user, *token,
 		GET_RAND_BITS, SIGNETDEV_CMD_GET_RAND_BITS,
 		0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_disconnect(void *user, int *token)
+int signetdev_get_rand_bits(void *user, int *token, int sz)
+{
+	return signetdev_get_rand_bits_req(NULL, user, token, sz);
+}
+
+int signetdev_disconnect_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command_no_resp(user, *token,
+	return execute_command_no_resp(req, user, *token,
 		DISCONNECT, SIGNETDEV_CMD_DISCONNECT);
 }
 
-int signetdev_login(void *user, int *token, u8 *key, unsigned int key_len, int gen_token)
+int signetdev_disconnect(void *user, int *token)
+{
+	return signetdev_disconnect_req(NULL, user, token);
+}
+
+int signetdev_login_req(const struct signetdev_request *req, void *user, int *token, u8 *key, unsigned int key_len, int gen_token)
 {
 	*token = get_cmd_token();
 	uint8_t msg[AES_256_KEY_SIZE + 1];
 	memset(msg, 0, sizeof(msg));
 	memcpy(msg, key, key_len > AES_256_KEY_SIZE ? sizeof(msg) : key_len);
 	msg[AES_256_KEY_SIZE] = gen_token;
-	return signetdev_priv_send_message(user, *token,
+	return signetdev_priv_send_message(req, user, *token,
 		LOGIN, SIGNETDEV_CMD_LOGIN,
 		0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_login_token(void *user, int *api_token, u8 *token)
+int signetdev_login(void *user, int *token, u8 *key, unsigned int key_len, int gen_token)
+{
+	return signetdev_login_req(NULL, user, token, key, key_len, gen_token);
+}
+
+int signetdev_login_token_req(const struct signetdev_request *req, void *user, int *api_token, u8 *token)
 {
 	*api_token = get_cmd_token();
 	uint8_t msg[AES_256_KEY_SIZE];
 	memcpy(msg, token, sizeof(msg));
-	return signetdev_priv_send_message(user, *token,
+	return signetdev_priv_send_message(req, user, *token,
 		LOGIN_TOKEN, SIGNETDEV_CMD_LOGIN_TOKEN,
 		0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_get_progress(void *user, int *token, int progress, int state)
+int signetdev_login_token(void *user, int *api_token, u8 *token)
+{
+	return signetdev_login_token_req(NULL, user, api_token, token);
+}
+
+int signetdev_get_progress_req(const struct signetdev_request *req, void *user, int *token, int progress, int state)
 {
 	uint8_t msg[4];
 	*token = get_cmd_token();
@@ -351,100 +401,160 @@ int signetdev_get_progress(void *user, int *token, int progress, int state)
 	msg[1] = progress >> 8;
 	msg[2] = state & 0xff;
 	msg[3] = state >> 8;
-	return signetdev_priv_send_message(user, *token,
+	return signetdev_priv_send_message(req, user, *token,
 			GET_PROGRESS, SIGNETDEV_CMD_GET_PROGRESS,
 			0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_begin_device_backup(void *user, int *token)
+int signetdev_get_progress(void *user, int *token, int progress, int state)
+{
+	return signetdev_get_progress_req(NULL, user, token, progress, state);
+}
+
+int signetdev_begin_device_backup_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		BACKUP_DEVICE, SIGNETDEV_CMD_BEGIN_DEVICE_BACKUP);
 }
 
-int signetdev_end_device_backup(void *user, int *token)
+int signetdev_begin_device_backup(void *user, int *token)
+{
+	return signetdev_begin_device_backup_req(NULL, user, token);
+}
+
+int signetdev_end_device_backup_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		BACKUP_DEVICE_DONE, SIGNETDEV_CMD_END_DEVICE_BACKUP);
 }
 
-int signetdev_begin_device_restore(void *user, int *token)
+int signetdev_end_device_backup(void *user, int *token)
+{
+	return signetdev_end_device_backup_req(NULL, user, token);
+}
+
+int signetdev_begin_device_restore_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		RESTORE_DEVICE, SIGNETDEV_CMD_BEGIN_DEVICE_RESTORE);
 }
 
-int signetdev_end_device_restore(void *user, int *token)
+int signetdev_begin_device_restore(void *user, int *token)
+{
+	return signetdev_begin_device_restore_req(NULL, user, token);
+}
+
+int signetdev_end_device_restore_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		RESTORE_DEVICE_DONE, SIGNETDEV_CMD_END_DEVICE_RESTORE);
 }
 
-int signetdev_get_device_state(void *user, int *token)
+int signetdev_end_device_restore(void *user, int *token)
+{
+	return signetdev_end_device_restore_req(NULL, user, token);
+}
+
+int signetdev_get_device_state_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token, GET_DEVICE_STATE, SIGNETDEV_CMD_GET_DEVICE_STATE);
+	return execute_command(req, user, *token, GET_DEVICE_STATE, SIGNETDEV_CMD_GET_DEVICE_STATE);
 }
 
-int signetdev_begin_update_firmware(void *user, int *token)
+int signetdev_get_device_state(void *user, int *token)
+{
+	return signetdev_get_device_state_req(NULL, user, token);
+}
+
+int signetdev_begin_update_firmware_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(user, *token,
+	return execute_command(req, user, *token,
 		UPDATE_FIRMWARE, SIGNETDEV_CMD_BEGIN_UPDATE_FIRMWARE);
 }
 
-int signetdev_begin_update_firmware_hc(void *user, int *token, const struct hc_firmware_info *fw_info)
+int signetdev_begin_update_firmware(void *user, int *token)
+{
+	return signetdev_begin_update_firmware_req(NULL, user, token);
+}
+
+int signetdev_begin_update_firmware_hc_req(const struct signetdev_request *req, void *user, int *token, const struct hc_firmware_info *fw_info)
 {
 	*token = get_cmd_token();
 
-	return signetdev_priv_send_message(user, *token,
+	return signetdev_priv_send_message(req, user, *token,
 			UPDATE_FIRMWARE, SIGNETDEV_CMD_BEGIN_UPDATE_FIRMWARE,
 			0, (const u8 *)fw_info, sizeof(*fw_info), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_reset_device(void *user, int *token)
+int signetdev_begin_update_firmware_hc(void *user, int *token, const struct hc_firmware_info *fw_info)
+{
+	return signetdev_begin_update_firmware_hc_req(NULL, user, token, fw_info);
+}
+
+int signetdev_reset_device_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	int rc = execute_command_no_resp(user, *token,
+	int rc = execute_command_no_resp(req, user, *token,
 		RESET_DEVICE, SIGNETDEV_CMD_RESET_DEVICE);
 	return rc;
 }
 
-int signetdev_switch_boot_mode(void *user, int *token)
+int signetdev_reset_device(void *user, int *token)
+{
+	return signetdev_reset_device_req(NULL, user, token);
+}
+
+int signetdev_switch_boot_mode_req(const struct signetdev_request *req, void *user, int *token)
 {
 	*token = get_cmd_token();
-	int rc = execute_command(user, *token,
+	int rc = execute_command(req, user, *token,
 		SWITCH_BOOT_MODE, SIGNETDEV_CMD_SWITCH_BOOT_MODE);
 	return rc;
 }
 
-int signetdev_startup(void *param, int *token)
+int signetdev_switch_boot_mode(void *user, int *token)
+{
+	return signetdev_switch_boot_mode_req(NULL, user, token);
+}
+
+int signetdev_startup_req(const struct signetdev_request *req, void *param, int *token)
 {
 	*token = get_cmd_token();
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			STARTUP, SIGNETDEV_CMD_STARTUP,
 			0, NULL, 0,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
+int signetdev_startup(void *param, int *token)
+{
+	return signetdev_startup_req(NULL, param, token);
+}
+
 int signetdev_has_keyboard()
 {
 	return signetdev_priv_issue_command(SIGNETDEV_CMD_HAS_KEYBOARD, NULL);
 }
 
-int signetdev_enter_mobile_mode(void *param, int *token)
+int signetdev_enter_mobile_mode_req(const struct signetdev_request *req, void *param, int *token)
 {
 	*token = get_cmd_token();
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			ENTER_MOBILE_MODE, SIGNETDEV_CMD_ENTER_MOBILE_MODE,
 			0, NULL, 0,
 			SIGNETDEV_PRIV_NO_RESP);
 }
 
+int signetdev_enter_mobile_mode(void *param, int *token)
+{
+	return signetdev_enter_mobile_mode_req(NULL, param, token);
+}
+
 
 int signetdev_can_type(const u8 *keys, int n_keys)
 {
@@ -470,37 +580,52 @@ int signetdev_can_type_w(const u16 *keys, int n_keys)
 	return 1;
 }
 
-int signetdev_read_cleartext_password(void *param, int *token, int index)
+int signetdev_read_cleartext_password_req(const struct signetdev_request *req, void *param, int *token, int index)
 {
 	u8 data[1] = {index};
 	*token = get_cmd_token();
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			READ_CLEARTEXT_PASSWORD, SIGNETDEV_CMD_READ_CLEARTEXT_PASSWORD,
 			0, data, 1,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_read_cleartext_password_names(void *param, int *token)
+int signetdev_read_cleartext_password(void *param, int *token, int index)
+{
+	return signetdev_read_cleartext_password_req(NULL, param, token, index);
+}
+
+int signetdev_read_cleartext_password_names_req(const struct signetdev_request *req, void *param, int *token)
 {
 	*token = get_cmd_token();
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			READ_CLEARTEXT_PASSWORD_NAMES, SIGNETDEV_CMD_READ_CLEARTEXT_PASSWORD_NAMES,
 			0, NULL, 0,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_write_cleartext_password(void *param, int *token, int index, const struct cleartext_pass *pass)
+int signetdev_read_cleartext_password_names(void *param, int *token)
+{
+	return signetdev_read_cleartext_password_names_req(NULL, param, token);
+}
+
+int signetdev_write_cleartext_password_req(const struct signetdev_request *req, void *param, int *token, int index, const struct cleartext_pass *pass)
 {
 	u8 data[CLEARTEXT_PASS_SIZE + 1];
 	data[0] = index;
 	memcpy(data + 1, pass, CLEARTEXT_PASS_SIZE);
 	*token = get_cmd_token();
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			WRITE_CLEARTEXT_PASSWORD, SIGNETDEV_CMD_WRITE_CLEARTEXT_PASSWORD,
 			0, data, CLEARTEXT_PASS_SIZE + 1,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
+int signetdev_write_cleartext_password(void *param, int *token, int index, const struct cleartext_pass *pass)
+{
+	return signetdev_write_cleartext_password_req(NULL, param, token, index, pass);
+}
+
 
 int signetdev_to_scancodes_w(const u16 *keys, int n_keys, u16 *out, int *out_len_)
 {
@@ -539,7 +664,7 @@ int signetdev_to_scancodes_w(const u16 *keys, int n_keys, u16 *out, int *out_len
 }
 
 
-int signetdev_type(void *param, int *token, const u8 *keys, int n_keys)
+int signetdev_type_req(const struct signetdev_request *req, void *param, int *token, const u8 *keys, int n_keys)
 {
 	*token = get_cmd_token();
 	u8 msg[MAX_CMD_PACKET_PAYLOAD_SIZE];
@@ -577,13 +702,18 @@ int signetdev_type(void *param, int *token, const u8 *keys, int n_keys)
 			}
 		}
 	}
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			TYPE, SIGNETDEV_CMD_TYPE,
 			0, msg, message_size,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_type_w(void *param, int *token, const u16 *keys, int n_keys)
+int signetdev_type(void *param, int *token, const u8 *keys, int n_keys)
+{
+	return signetdev_type_req(NULL, param, token, keys, n_keys);
+}
+
+int signetdev_type_w_req(const struct signetdev_request *req, void *param, int *token, const u16 *keys, int n_keys)
 {
 	*token = get_cmd_token();
 	u8 msg[MAX_CMD_PACKET_PAYLOAD_SIZE];
@@ -621,13 +751,18 @@ int signetdev_type_w(void *param, int *token, const u16 *keys, int n_keys)
 			}
 		}
 	}
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			TYPE, SIGNETDEV_CMD_TYPE,
 			0, msg, message_size,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_type_raw(void *param, int *token, const u8 *codes, int n_keys)
+int signetdev_type_w(void *param, int *token, const u16 *keys, int n_keys)
+{
+	return signetdev_type_w_req(NULL, param, token, keys, n_keys);
+}
+
+int signetdev_type_raw_req(const struct signetdev_request *req, void *param, int *token, const u8 *codes, int n_keys)
 {
 	*token = get_cmd_token();
 	u8 msg[MAX_CMD_PACKET_PAYLOAD_SIZE];
@@ -639,13 +774,18 @@ int signetdev_type_raw(void *param, int *token, const u8 *codes, int n_keys)
 		msg[i * 2 + 0] = codes[i * 2];
 		msg[i * 2 + 1] = codes[i * 2 + 1];
 	}
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			TYPE, SIGNETDEV_CMD_TYPE,
 			0, msg, message_size,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_begin_initialize_device(void *param, int *token,
+int signetdev_type_raw(void *param, int *token, const u8 *codes, int n_keys)
+{
+	return signetdev_type_raw_req(NULL, param, token, codes, n_keys);
+}
+
+int signetdev_begin_initialize_device_req(const struct signetdev_request *req, void *param, int *token,
 					const u8 *key, int key_len,
 					const u8 *hashfn, int hashfn_len,
 					const u8 *salt, int salt_len,
@@ -660,46 +800,228 @@ int signetdev_begin_initialize_device(void *param, int *token,
 	memcpy(msg + AES_256_KEY_SIZE + HASH_FN_SZ, salt, salt_len > SALT_SZ_V2 ? SALT_SZ_V2 : salt_len);
 	memcpy(msg + AES_256_KEY_SIZE + HASH_FN_SZ + SALT_SZ_V2, rand_data, rand_data_len > signetdev_priv_init_rand_data_size() ? signetdev_priv_init_rand_data_size() : rand_data_len);
 
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			INITIALIZE, SIGNETDEV_CMD_BEGIN_INITIALIZE_DEVICE,
 			0, msg, INITIALIZE_CMD_SIZE, SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_read_block(void *param, int *token, unsigned int idx)
+int signetdev_begin_initialize_device(void *param, int *token, const u8 *key, int key_len, const u8 *hashfn, int hashfn_len, const u8 *salt, int salt_len, const u8 *rand_data, int rand_data_len)
+{
+	return signetdev_begin_initialize_device_req(NULL, param, token, key, key_len, hashfn, hashfn_len, salt, salt_len, rand_data, rand_data_len);
+}
+
+int signetdev_read_block_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx)
 {
 	*token = get_cmd_token();
 	if (g_device_type == SIGNETDEV_DEVICE_HC) {
 		u8 msg[] = {(u8)(idx & 0xff), (u8)(idx >> 8)};
-		return signetdev_priv_send_message(param, *token,
+		return signetdev_priv_send_message(req, param, *token,
 				READ_BLOCK_HC, SIGNETDEV_CMD_READ_BLOCK,
 				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 	} else {
 		u8 msg[] = {(u8)(idx)};
-		return signetdev_priv_send_message(param, *token,
+		return signetdev_priv_send_message(req, param, *token,
 				READ_BLOCK, SIGNETDEV_CMD_READ_BLOCK,
 				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 	}
 }
 
-int signetdev_write_block(void *param, int *token, unsigned int idx, const void *buffer)
+int signetdev_read_block(void *param, int *token, unsigned int idx)
+{
+	return signetdev_read_block_req(NULL, param, token, idx);
+}
+
+//
+// Streams blocks [first, first + count) while backing up. If manifest is given
+// it holds the CRC of each block from a previous backup and blocks that still
+// match are reported as HC_BLOCK_UNCHANGED without their contents
+//
+int signetdev_read_blocks_req(const struct signetdev_request *req, void *param, int *token, unsigned int first, unsigned int count, const u32 *manifest)
+{
+	*token = get_cmd_token();
+	u8 msg[4 + MAX_NUM_STORAGE_BLOCKS * 4];
+	unsigned int msg_len = 4;
+	if (count > MAX_NUM_STORAGE_BLOCKS)
+		return SIGNET_ERROR_OVERFLOW;
+	msg[0] = (u8)(first & 0xff);
+	msg[1] = (u8)(first >> 8);
+	msg[2] = (u8)(count & 0xff);
+	msg[3] = (u8)(count >> 8);
+	if (manifest) {
+		unsigned int i;
+		for (i = 0; i < count; i++) {
+			msg[msg_len++] = (u8)(manifest[i] >> 0);
+			msg[msg_len++] = (u8)(manifest[i] >> 8);
+			msg[msg_len++] = (u8)(manifest[i] >> 16);
+			msg[msg_len++] = (u8)(manifest[i] >> 24);
+		}
+	}
+	return signetdev_priv_send_message(req, param, *token,
+				READ_BLOCKS_HC, SIGNETDEV_CMD_READ_BLOCKS,
+				0, msg, msg_len, SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_read_blocks(void *param, int *token, unsigned int first, unsigned int count, const u32 *manifest)
+{
+	return signetdev_read_blocks_req(NULL, param, token, first, count, manifest);
+}
+
+int signetdev_write_block_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx, const void *buffer)
 {
 	*token = get_cmd_token();
 	if (g_device_type == SIGNETDEV_DEVICE_HC) {
 		u8 msg[MAX_BLK_SIZE + 2] = {(u8)(idx & 0xff), (u8)(idx >> 8)};
 		memcpy(msg + 2, buffer, signetdev_device_block_size());
-		return signetdev_priv_send_message(param, *token,
+		return signetdev_priv_send_message(req, param, *token,
 					WRITE_BLOCK_HC, SIGNETDEV_CMD_WRITE_BLOCK,
 					0, msg, signetdev_device_block_size() + 2, SIGNETDEV_PRIV_GET_RESP);
 	} else {
 		u8 msg[MAX_BLK_SIZE + 1] = {(u8)(idx)};
 		memcpy(msg + 1, buffer, signetdev_device_block_size());
-		return signetdev_priv_send_message(param, *token,
+		return signetdev_priv_send_message(req, param, *token,
 					WRITE_BLOCK, SIGNETDEV_CMD_WRITE_BLOCK,
 					0, msg, signetdev_device_block_size() + 1, SIGNETDEV_PRIV_GET_RESP);
 	}
 }
 
-int signetdev_write_flash(void *param, int *token, u32 addr, const void *data, unsigned int data_len)
+int signetdev_write_block(void *param, int *token, unsigned int idx, const void *buffer)
+{
+	return signetdev_write_block_req(NULL, param, token, idx, buffer);
+}
+
+//Same CRC-32 the device computes with its CRC unit
+u32 signetdev_crc32(const void *buffer, unsigned int len)
+{
+	const u8 *data = (const u8 *)buffer;
+	u32 crc = 0xffffffff;
+	unsigned int i;
+	int j;
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+		}
+	}
+	return ~crc;
+}
+
+u32 signetdev_block_crc(const void *buffer)
+{
+	return signetdev_crc32(buffer, signetdev_device_block_size());
+}
+
+int signetdev_read_block_crcs_req(const struct signetdev_request *req, void *param, int *token, unsigned int first, unsigned int count)
+{
+	*token = get_cmd_token();
+	u8 msg[] = {(u8)(first & 0xff), (u8)(first >> 8), (u8)(count & 0xff), (u8)(count >> 8)};
+	return signetdev_priv_send_message(req, param, *token,
+				READ_BLOCK_CRCS_HC, SIGNETDEV_CMD_READ_BLOCK_CRCS,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_read_block_crcs(void *param, int *token, unsigned int first, unsigned int count)
+{
+	return signetdev_read_block_crcs_req(NULL, param, token, first, count);
+}
+
+//Writes a block and has the device read it back and check it in the same command
+int signetdev_write_block_verify_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx, const void *buffer)
+{
+	*token = get_cmd_token();
+	u8 msg[HC_BLOCK_VERIFY_HEADER_SIZE + MAX_BLK_SIZE];
+	u32 crc = signetdev_block_crc(buffer);
+	msg[0] = (u8)(idx & 0xff);
+	msg[1] = (u8)(idx >> 8);
+	msg[2] = (u8)(crc >> 0);
+	msg[3] = (u8)(crc >> 8);
+	msg[4] = (u8)(crc >> 16);
+	msg[5] = (u8)(crc >> 24);
+	memcpy(msg + HC_BLOCK_VERIFY_HEADER_SIZE, buffer, signetdev_device_block_size());
+	return signetdev_priv_send_message(req, param, *token,
+				WRITE_BLOCK_VERIFY_HC, SIGNETDEV_CMD_WRITE_BLOCK_VERIFY,
+				0, msg, HC_BLOCK_VERIFY_HEADER_SIZE + signetdev_device_block_size(), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_write_block_verify(void *param, int *token, unsigned int idx, const void *buffer)
+{
+	return signetdev_write_block_verify_req(NULL, param, token, idx, buffer);
+}
+
+int signetdev_create_volume_req(const struct signetdev_request *req, void *param, int *token, const struct hc_volume *volume)
+{
+	*token = get_cmd_token();
+	return signetdev_priv_send_message(req, param, *token,
+				CREATE_VOLUME, SIGNETDEV_CMD_CREATE_VOLUME,
+				0, (const u8 *)volume, sizeof(struct hc_volume), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_create_volume(void *param, int *token, const struct hc_volume *volume)
+{
+	return signetdev_create_volume_req(NULL, param, token, volume);
+}
+
+int signetdev_resize_volume_req(const struct signetdev_request *req, void *param, int *token, int volume_idx, u32 n_regions)
+{
+	*token = get_cmd_token();
+	u8 msg[5];
+	msg[0] = (u8)volume_idx;
+	msg[1] = (u8)(n_regions >> 0) & 0xff;
+	msg[2] = (u8)(n_regions >> 8) & 0xff;
+	msg[3] = (u8)(n_regions >> 16) & 0xff;
+	msg[4] = (u8)(n_regions >> 24) & 0xff;
+	return signetdev_priv_send_message(req, param, *token,
+				RESIZE_VOLUME, SIGNETDEV_CMD_RESIZE_VOLUME,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_resize_volume(void *param, int *token, int volume_idx, u32 n_regions)
+{
+	return signetdev_resize_volume_req(NULL, param, token, volume_idx, n_regions);
+}
+
+int signetdev_delete_volume_req(const struct signetdev_request *req, void *param, int *token, int volume_idx)
+{
+	*token = get_cmd_token();
+	u8 msg[1] = {(u8)volume_idx};
+	return signetdev_priv_send_message(req, param, *token,
+				DELETE_VOLUME, SIGNETDEV_CMD_DELETE_VOLUME,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_delete_volume(void *param, int *token, int volume_idx)
+{
+	return signetdev_delete_volume_req(NULL, param, token, volume_idx);
+}
+
+int signetdev_read_trace_req(const struct signetdev_request *req, void *param, int *token, int reset)
+{
+	*token = get_cmd_token();
+	u8 msg[1] = {(u8)(reset ? 1 : 0)};
+	return signetdev_priv_send_message(req, param, *token,
+				READ_TRACE, SIGNETDEV_CMD_READ_TRACE,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_read_trace(void *param, int *token, int reset)
+{
+	return signetdev_read_trace_req(NULL, param, token, reset);
+}
+
+int signetdev_read_io_stats_req(const struct signetdev_request *req, void *param, int *token, int reset)
+{
+	*token = get_cmd_token();
+	u8 msg[1] = {(u8)(reset ? 1 : 0)};
+	return signetdev_priv_send_message(req, param, *token,
+				READ_IO_STATS, SIGNETDEV_CMD_READ_IO_STATS,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_read_io_stats(void *param, int *token, int reset)
+{
+	return signetdev_read_io_stats_req(NULL, param, token, reset);
+}
+
+int signetdev_write_flash_req(const struct signetdev_request *req, void *param, int *token, u32 addr, const void *data, unsigned int data_len)
 {
 	*token = get_cmd_token();
 	uint8_t msg[MAX_CMD_PACKET_PAYLOAD_SIZE];
@@ -711,11 +1033,99 @@ int signetdev_write_flash(void *param, int *token, u32 addr, const void *data, u
 	msg[2] = (u8)(addr >> 16) & 0xff;
 	msg[3] = (u8)(addr >> 24) & 0xff;
 	memcpy(msg + 4, data, data_len);
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 				WRITE_FLASH, SIGNETDEV_CMD_WRITE_FLASH,
 				0, msg, 4 + data_len, SIGNETDEV_PRIV_GET_RESP);
 }
 
+int signetdev_write_flash(void *param, int *token, u32 addr, const void *data, unsigned int data_len)
+{
+	return signetdev_write_flash_req(NULL, param, token, addr, data, data_len);
+}
+
+//Data must be a multiple of 4 bytes long. Zero length waits for all writes to finish programming
+int signetdev_write_flash_hc_req(const struct signetdev_request *req, void *param, int *token, u32 addr, const void *data, unsigned int data_len)
+{
+	*token = get_cmd_token();
+	u8 msg[HC_WRITE_FLASH_HEADER_SIZE + HC_WRITE_FLASH_MAX_LEN];
+	if (data_len > HC_WRITE_FLASH_MAX_LEN)
+		return SIGNET_ERROR_OVERFLOW;
+	u32 crc = signetdev_crc32(data, data_len);
+	msg[0] = (u8)(addr >> 0);
+	msg[1] = (u8)(addr >> 8);
+	msg[2] = (u8)(addr >> 16);
+	msg[3] = (u8)(addr >> 24);
+	msg[4] = (u8)(crc >> 0);
+	msg[5] = (u8)(crc >> 8);
+	msg[6] = (u8)(crc >> 16);
+	msg[7] = (u8)(crc >> 24);
+	if (data_len)
+		memcpy(msg + HC_WRITE_FLASH_HEADER_SIZE, data, data_len);
+	return signetdev_priv_send_message(req, param, *token,
+				WRITE_FLASH_HC, SIGNETDEV_CMD_WRITE_FLASH_HC,
+				0, msg, HC_WRITE_FLASH_HEADER_SIZE + data_len, SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_write_flash_hc(void *param, int *token, u32 addr, const void *data, unsigned int data_len)
+{
+	return signetdev_write_flash_hc_req(NULL, param, token, addr, data, data_len);
+}
+
+//Stores one block of a firmware file in the device's update area
+int signetdev_write_firmware_stage_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx, const void *buffer)
+{
+	*token = get_cmd_token();
+	u8 msg[HC_BLOCK_VERIFY_HEADER_SIZE + HC_FIRMWARE_STAGE_BLOCK_SIZE];
+	u32 crc = signetdev_crc32(buffer, HC_FIRMWARE_STAGE_BLOCK_SIZE);
+	msg[0] = (u8)(idx & 0xff);
+	msg[1] = (u8)(idx >> 8);
+	msg[2] = (u8)(crc >> 0);
+	msg[3] = (u8)(crc >> 8);
+	msg[4] = (u8)(crc >> 16);
+	msg[5] = (u8)(crc >> 24);
+	memcpy(msg + HC_BLOCK_VERIFY_HEADER_SIZE, buffer, HC_FIRMWARE_STAGE_BLOCK_SIZE);
+	return signetdev_priv_send_message(req, param, *token,
+				WRITE_FIRMWARE_STAGE_HC, SIGNETDEV_CMD_WRITE_FIRMWARE_STAGE,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_write_firmware_stage(void *param, int *token, unsigned int idx, const void *buffer)
+{
+	return signetdev_write_firmware_stage_req(NULL, param, token, idx, buffer);
+}
+
+int signetdev_flash_staged_firmware_req(const struct signetdev_request *req, void *param, int *token)
+{
+	*token = get_cmd_token();
+	return execute_command(req, param, *token, FLASH_STAGED_FIRMWARE_HC, SIGNETDEV_CMD_FLASH_STAGED_FIRMWARE);
+}
+
+int signetdev_flash_staged_firmware(void *param, int *token)
+{
+	return signetdev_flash_staged_firmware_req(NULL, param, token);
+}
+
+int signetdev_write_compressed_firmware_req(const struct signetdev_request *req, void *param, int *token, unsigned int offset, const void *data, unsigned int len)
+{
+	*token = get_cmd_token();
+	u8 msg[4 + HC_FIRMWARE_STAGE_BLOCK_SIZE];
+	if (len > HC_FIRMWARE_STAGE_BLOCK_SIZE)
+		return SIGNET_ERROR_OVERFLOW;
+	msg[0] = (u8)(offset >> 0);
+	msg[1] = (u8)(offset >> 8);
+	msg[2] = (u8)(offset >> 16);
+	msg[3] = (u8)(offset >> 24);
+	memcpy(msg + 4, data, len);
+	return signetdev_priv_send_message(req, param, *token,
+				WRITE_COMPRESSED_FIRMWARE_HC, SIGNETDEV_CMD_WRITE_COMPRESSED_FIRMWARE,
+				0, msg, 4 + len, SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_write_compressed_firmware(void *param, int *token, unsigned int offset, const void *data, unsigned int len)
+{
+	return signetdev_write_compressed_firmware_req(NULL, param, token, offset, data, len);
+}
+
 int encode_entry_data(unsigned int size, const u8 *data, const u8 *mask, uint8_t *msg, unsigned int msg_sz)
 {
 	unsigned int i;
@@ -736,7 +1146,7 @@ int encode_entry_data(unsigned int size, const u8 *data, const u8 *mask, uint8_t
 	return (int)message_size;
 }
 
-int signetdev_update_uid(void *param, int *token, unsigned int uid, unsigned int size, const u8 *data, const u8 *mask)
+int signetdev_update_uid_req(const struct signetdev_request *req, void *param, int *token, unsigned int uid, unsigned int size, const u8 *data, const u8 *mask)
 {
 	uint8_t msg[MAX_CMD_PACKET_PAYLOAD_SIZE];
 	*token = get_cmd_token();
@@ -752,13 +1162,18 @@ int signetdev_update_uid(void *param, int *token, unsigned int uid, unsigned int
 
 	message_size += k;
 
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 		UPDATE_UID, SIGNETDEV_CMD_UPDATE_UID,
 	        0, msg, (unsigned int)message_size, SIGNETDEV_PRIV_GET_RESP);
 }
 
+int signetdev_update_uid(void *param, int *token, unsigned int uid, unsigned int size, const u8 *data, const u8 *mask)
+{
+	return signetdev_update_uid_req(NULL, param, token, uid, size, data, mask);
+}
+
 
-int signetdev_update_uids(void *param, int *token, unsigned int uid, unsigned int size, const u8 *data, const u8 *mask, unsigned int remaining_uids)
+int signetdev_update_uids_req(const struct signetdev_request *req, void *param, int *token, unsigned int uid, unsigned int size, const u8 *data, const u8 *mask, unsigned int remaining_uids)
 {
 	uint8_t msg[MAX_CMD_PACKET_PAYLOAD_SIZE];
 	*token = get_cmd_token();
@@ -774,34 +1189,49 @@ int signetdev_update_uids(void *param, int *token, unsigned int uid, unsigned in
 
 	message_size += k;
 
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 		UPDATE_UIDS, SIGNETDEV_CMD_UPDATE_UIDS,
 	        remaining_uids, msg, (unsigned int)message_size, SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_read_uid(void *param, int *token, int uid, int masked)
+int signetdev_update_uids(void *param, int *token, unsigned int uid, unsigned int size, const u8 *data, const u8 *mask, unsigned int remaining_uids)
+{
+	return signetdev_update_uids_req(NULL, param, token, uid, size, data, mask, remaining_uids);
+}
+
+int signetdev_read_uid_req(const struct signetdev_request *req, void *param, int *token, int uid, int masked)
 {
 	*token = get_cmd_token();
 	uint8_t msg[3];
 	msg[0] = (uid >> 0) & 0xff;
 	msg[1] = (uid >> 8) & 0xff;
 	msg[2] = (masked) & 0xff;
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 				READ_UID, SIGNETDEV_CMD_READ_UID,
 				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_read_all_uids(void *param, int *token, int masked)
+int signetdev_read_uid(void *param, int *token, int uid, int masked)
+{
+	return signetdev_read_uid_req(NULL, param, token, uid, masked);
+}
+
+int signetdev_read_all_uids_req(const struct signetdev_request *req, void *param, int *token, int masked)
 {
 	*token = get_cmd_token();
 	uint8_t msg[1];
 	msg[0] = masked & 0xff;
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 				READ_ALL_UIDS, SIGNETDEV_CMD_READ_ALL_UIDS,
 				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_change_master_password(void *param, int *token,
+int signetdev_read_all_uids(void *param, int *token, int masked)
+{
+	return signetdev_read_all_uids_req(NULL, param, token, masked);
+}
+
+int signetdev_change_master_password_req(const struct signetdev_request *req, void *param, int *token,
 		u8 *old_key, u32 old_key_len,
 		u8 *new_key, u32 new_key_len,
 		u8 *hashfn, u32 hashfn_len,
@@ -814,32 +1244,50 @@ int signetdev_change_master_password(void *param, int *token,
 	memcpy(msg + AES_256_KEY_SIZE, new_key, new_key_len > AES_256_KEY_SIZE ? AES_256_KEY_SIZE : new_key_len);
 	memcpy(msg + AES_256_KEY_SIZE * 2, hashfn, hashfn_len > HASH_FN_SZ ? HASH_FN_SZ : hashfn_len);
 	memcpy(msg + AES_256_KEY_SIZE * 2 + HASH_FN_SZ, salt, salt_len > SALT_SZ_V2 ? SALT_SZ_V2 : salt_len);
-	return signetdev_priv_send_message(param, *token, CHANGE_MASTER_PASSWORD,
+	return signetdev_priv_send_message(req, param, *token, CHANGE_MASTER_PASSWORD,
 			SIGNETDEV_CMD_CHANGE_MASTER_PASSWORD,
 			0, msg, sizeof(msg),
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_erase_pages(void *param, int *token, unsigned int n_pages, const u8 *page_numbers)
+int signetdev_change_master_password(void *param, int *token, u8 *old_key, u32 old_key_len, u8 *new_key, u32 new_key_len, u8 *hashfn, u32 hashfn_len, u8 *salt, u32 salt_len)
+{
+	return signetdev_change_master_password_req(NULL, param, token, old_key, old_key_len, new_key, new_key_len, hashfn, hashfn_len, salt, salt_len);
+}
+
+int signetdev_erase_pages_req(const struct signetdev_request *req, void *param, int *token, unsigned int n_pages, const u8 *page_numbers)
 {
 	*token = get_cmd_token();
-	return signetdev_priv_send_message(param, *token,
+	return signetdev_priv_send_message(req, param, *token,
 			ERASE_FLASH_PAGES, SIGNETDEV_CMD_ERASE_PAGES,
 			0, page_numbers, n_pages,
 			SIGNETDEV_PRIV_GET_RESP);
 }
 
-int signetdev_erase_pages_hc(void *param, int *token)
+int signetdev_erase_pages(void *param, int *token, unsigned int n_pages, const u8 *page_numbers)
+{
+	return signetdev_erase_pages_req(NULL, param, token, n_pages, page_numbers);
+}
+
+int signetdev_erase_pages_hc_req(const struct signetdev_request *req, void *param, int *token)
 {
 	*token = get_cmd_token();
-	return execute_command(param, *token, ERASE_FLASH_PAGES, SIGNETDEV_CMD_ERASE_PAGES);
+	return execute_command(req, param, *token, ERASE_FLASH_PAGES, SIGNETDEV_CMD_ERASE_PAGES);
+}
+
+int signetdev_erase_pages_hc(void *param, int *token)
+{
+	return signetdev_erase_pages_hc_req(NULL, param, token);
 }
 
-void signetdev_priv_handle_device_event(int event_type, const u8 *resp, int resp_len)
+void signetdev_priv_handle_device_event(int event_type, const u8 *resp, int resp_len, const struct hc_event_info *info)
 {
 	if (g_device_event_cb) {
 		g_device_event_cb(g_device_event_cb_param, event_type, (const void *)resp, resp_len);
 	}
+	if (g_device_event_info_cb) {
+		g_device_event_info_cb(g_device_event_info_cb_param, event_type, (const void *)resp, resp_len, info);
+	}
 }
 
 void signetdev_priv_prepare_message_state(struct tx_message_state *msg, unsigned int dev_cmd, unsigned int messages_remaining, u8 *payload, unsigned int payload_size)
@@ -850,6 +1298,7 @@ void signetdev_priv_prepare_message_state(struct tx_message_state *msg, unsigned
 	msg->msg_buf[2] = (u8)(dev_cmd);
 	msg->msg_buf[3] = (u8)(messages_remaining & 0xff);
 	msg->msg_buf[4] = (u8)(messages_remaining >> 8);
+	msg->msg_buf[5] = 0;
 	msg->msg_packet_seq = 0;
 	msg->msg_packet_count = (msg->msg_size + signetdev_priv_hid_payload_size() - 1)/ signetdev_priv_hid_payload_size();
 	if (payload)
@@ -857,6 +1306,11 @@ void signetdev_priv_prepare_message_state(struct tx_message_state *msg, unsigned
 
 }
 
+void signetdev_priv_tag_message_state(struct tx_message_state *msg, int tag)
+{
+	msg->msg_buf[5] = (u8)tag;
+}
+
 void signetdev_priv_advance_message_state(struct tx_message_state *msg)
 {
 	int pidx = 0;
@@ -875,6 +1329,15 @@ int signetdev_priv_message_packet_count(int msg_sz)
 	return (msg_sz + signetdev_priv_cmd_payload_size() - 1)/ signetdev_priv_cmd_payload_size();
 }
 
+static int fw_version_at_least(const u8 *version, int major, int minor, int step)
+{
+	if (version[0] != major)
+		return version[0] > major;
+	if (version[1] != minor)
+		return version[1] > minor;
+	return version[2] >= step;
+}
+
 static int decode_id(const u8 *resp, unsigned int resp_len, u8 *data, u8 *mask)
 {
 	unsigned int i;
@@ -895,12 +1358,15 @@ static int decode_id(const u8 *resp, unsigned int resp_len, u8 *data, u8 *mask)
 	return 0;
 }
 
-void signetdev_priv_handle_command_resp(void *user, int token,
+void signetdev_priv_handle_command_resp(signetdev_cmd_resp_t done, void *done_param,
+					void *user, int token,
 					int dev_cmd, int api_cmd,
                                         int resp_code, const u8 *resp, unsigned int resp_len,
 					int end_device_state,
 					int expected_messages_remaining)
 {
+	signetdev_cmd_resp_t resp_cb = done ? done : g_command_resp_cb;
+	void *resp_cb_param = done ? done_param : g_command_resp_cb_param;
 	switch (dev_cmd)
 	{
 	case READ_BLOCK_HC:
@@ -908,8 +1374,8 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 		if (resp_len != signetdev_device_block_size()) {
 			signetdev_priv_handle_error();
 			break;
-		} else if (g_command_resp_cb) {
-			g_command_resp_cb(g_command_resp_cb_param,
+		} else if (resp_cb) {
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -920,8 +1386,8 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 		if (resp_code == OKAY && resp_len != CLEARTEXT_PASS_SIZE) {
 			signetdev_priv_handle_error();
 			break;
-		} else if (g_command_resp_cb) {
-			g_command_resp_cb(g_command_resp_cb_param,
+		} else if (resp_cb) {
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -932,8 +1398,8 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 		if (resp_code ==OKAY && resp_len != (CLEARTEXT_PASS_NAME_SIZE + 1) * NUM_CLEARTEXT_PASS) {
 			signetdev_priv_handle_error();
 			break;
-		} else if (g_command_resp_cb) {
-			g_command_resp_cb(g_command_resp_cb_param,
+		} else if (resp_cb) {
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -961,8 +1427,8 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 			signetdev_priv_handle_error();
 			break;
 		}
-		if (g_command_resp_cb)
-			g_command_resp_cb(g_command_resp_cb_param,
+		if (resp_cb)
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -984,12 +1450,139 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 			if (g_device_type == SIGNETDEV_DEVICE_HC) {
 				cb_resp.boot_mode = resp[6];
 				cb_resp.upgrade_state = resp[7];
+				g_tagged_commands = fw_version_at_least(resp, CMD_TAGGED_MIN_MAJOR_VERSION,
+					CMD_TAGGED_MIN_MINOR_VERSION, CMD_TAGGED_MIN_STEP_VERSION);
+				g_event_info = fw_version_at_least(resp, HC_EVENT_INFO_MIN_MAJOR_VERSION,
+					HC_EVENT_INFO_MIN_MINOR_VERSION, HC_EVENT_INFO_MIN_STEP_VERSION);
 			}
 			memcpy(cb_resp.hashfn, resp + signetdev_priv_startup_resp_info_size(), HASH_FN_SZ);
 			memcpy(cb_resp.salt, resp + signetdev_priv_startup_resp_info_size() + HASH_FN_SZ, SALT_SZ_V2);
 		}
-		if (g_command_resp_cb)
-			g_command_resp_cb(g_command_resp_cb_param,
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &cb_resp);
+		} break;
+	case CREATE_VOLUME: {
+		struct signetdev_create_volume_resp_data cb_resp;
+		if (resp_code == OKAY && resp_len != 1) {
+			signetdev_priv_handle_error();
+			break;
+		}
+		cb_resp.volume_idx = (resp_code == OKAY) ? resp[0] : -1;
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &cb_resp);
+		} break;
+	case READ_TRACE: {
+		struct signetdev_read_trace_resp_data cb_resp;
+		memset(&cb_resp, 0, sizeof(cb_resp));
+		if (resp_code == OKAY) {
+			if (resp_len < sizeof(struct hc_trace_header)) {
+				signetdev_priv_handle_error();
+				break;
+			}
+			memcpy(&cb_resp.header, resp, sizeof(struct hc_trace_header));
+			unsigned int stats_len = cb_resp.header.n_spans * sizeof(struct hc_trace_span_stats);
+			unsigned int events_len = cb_resp.header.n_events * sizeof(struct hc_trace_event);
+			if (resp_len != sizeof(struct hc_trace_header) + stats_len + events_len) {
+				signetdev_priv_handle_error();
+				break;
+			}
+			cb_resp.stats = (const struct hc_trace_span_stats *)(resp + sizeof(struct hc_trace_header));
+			cb_resp.events = (const struct hc_trace_event *)(resp + sizeof(struct hc_trace_header) + stats_len);
+		}
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &cb_resp);
+		} break;
+	case READ_BLOCKS_HC: {
+		struct signetdev_read_blocks_resp_data cb_resp;
+		memset(&cb_resp, 0, sizeof(cb_resp));
+		if (resp_code == OKAY) {
+			if (resp_len < sizeof(cb_resp.record)) {
+				signetdev_priv_handle_error();
+				break;
+			}
+			memcpy(&cb_resp.record, resp, sizeof(cb_resp.record));
+			if (cb_resp.record.status == HC_BLOCK_DATA) {
+				if (resp_len != sizeof(cb_resp.record) + signetdev_device_block_size()) {
+					signetdev_priv_handle_error();
+					break;
+				}
+				cb_resp.data = resp + sizeof(cb_resp.record);
+			}
+		}
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &cb_resp);
+		} break;
+	case READ_BLOCK_CRCS_HC: {
+		struct signetdev_read_block_crcs_resp_data cb_resp;
+		memset(&cb_resp, 0, sizeof(cb_resp));
+		if (resp_code == OKAY) {
+			if ((resp_len % 4) || resp_len > sizeof(cb_resp.crc)) {
+				signetdev_priv_handle_error();
+				break;
+			}
+			cb_resp.count = resp_len / 4;
+			memcpy(cb_resp.crc, resp, resp_len);
+		}
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &cb_resp);
+		} break;
+	case WRITE_BLOCK_VERIFY_HC: {
+		u32 crc = 0;
+		if (resp_len == sizeof(crc)) {
+			memcpy(&crc, resp, sizeof(crc));
+		}
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &crc);
+		} break;
+	case WRITE_FLASH_HC: {
+		struct hc_write_flash_ack ack;
+		memset(&ack, 0, sizeof(ack));
+		if (resp_len == sizeof(ack)) {
+			memcpy(&ack, resp, sizeof(ack));
+		}
+		if (resp_cb)
+			resp_cb(resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &ack);
+		} break;
+	case READ_IO_STATS: {
+		struct hc_io_stats cb_resp;
+		memset(&cb_resp, 0, sizeof(cb_resp));
+		if (resp_code == OKAY) {
+			if (resp_len != sizeof(cb_resp)) {
+				signetdev_priv_handle_error();
+				break;
+			}
+			memcpy(&cb_resp, resp, sizeof(cb_resp));
+		}
+		if (resp_cb)
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -999,8 +1592,8 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 		struct signetdev_get_rand_bits_resp_data cb_resp;
 		cb_resp.data = resp;
 		cb_resp.size = resp_len;
-		if (g_command_resp_cb)
-			g_command_resp_cb(g_command_resp_cb_param,
+		if (resp_cb)
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -1026,8 +1619,8 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 				}
 			}
 		}
-		if (g_command_resp_cb)
-			g_command_resp_cb(g_command_resp_cb_param,
+		if (resp_cb)
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
@@ -1052,16 +1645,16 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 				}
 			}
 		}
-		if (g_command_resp_cb)
-			g_command_resp_cb(g_command_resp_cb_param,
+		if (resp_cb)
+			resp_cb(resp_cb_param,
 				user, token, api_cmd,
 				end_device_state,
 				expected_messages_remaining,
 				resp_code, &cb_resp);
 		} break;
 	default:
-		if (g_command_resp_cb)
-			g_command_resp_cb(g_command_resp_cb_param,
+		if (resp_cb)
+			resp_cb(resp_cb_param,
 					  user, token, api_cmd,
 					  end_device_state,
 					  expected_messages_remaining,
@@ -1070,12 +1663,11 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 	}
 }
 
-int signetdev_priv_send_message(void *user, int token, int dev_cmd, int api_cmd, unsigned int messages_remaining, const u8 *payload, unsigned int payload_size, int get_resp)
+int signetdev_priv_send_message(const struct signetdev_request *req, void *user, int token, int dev_cmd, int api_cmd, unsigned int messages_remaining, const u8 *payload, unsigned int payload_size, int get_resp)
 {
-	static u8 s_async_resp[MAX_CMD_PACKET_PAYLOAD_SIZE];
-	static int s_async_resp_code;
-
-	struct send_message_req *r = (struct send_message_req *)malloc(sizeof(struct send_message_req));
+	//Requests that want a response carry the buffer for it
+	struct send_message_req *r = (struct send_message_req *)malloc(sizeof(struct send_message_req) +
+			(get_resp ? MAX_CMD_PACKET_PAYLOAD_SIZE : 0));
 	r->dev_cmd = dev_cmd;
 	r->api_cmd = api_cmd;
 	r->messages_remaining = messages_remaining;
@@ -1089,12 +1681,14 @@ int signetdev_priv_send_message(void *user, int token, int dev_cmd, int api_cmd,
 	r->user = user;
 	r->token = token;
 	if (get_resp) {
-		r->resp = s_async_resp;
-		r->resp_code = &s_async_resp_code;
+		r->resp = r->resp_buf;
+		r->resp_code = &r->resp_code_buf;
 	} else {
 		r->resp = NULL;
 		r->resp_code = NULL;
 	}
+	r->done = req ? req->done : NULL;
+	r->done_param = req ? req->done_param : NULL;
 	r->interrupt = 0;
 	signetdev_priv_issue_command_no_resp(SIGNETDEV_CMD_MESSAGE, r);
 	return 0;
@@ -1113,12 +1707,67 @@ int signetdev_priv_cancel_message(int dev_cmd, const u8 *payload, unsigned int p
 	r->payload_size = payload_size;
 	r->resp = NULL;
 	r->resp_code = NULL;
+	r->done = NULL;
+	r->done_param = NULL;
 	r->interrupt = 1;
 	signetdev_priv_issue_command_no_resp(SIGNETDEV_CMD_CANCEL_MESSAGE, r);
 	return 0;
 }
 
 
+//Finds the message a response header belongs to and strips the tag from the response code
+static struct send_message_req **rx_header_message(struct rx_message_state *state, const u8 *header, int *resp_code)
+{
+	*resp_code = header[2];
+	state->header_size = CMD_PACKET_HEADER_SIZE;
+	if (*resp_code & CMD_RESP_TAGGED) {
+		int tag = header[CMD_PACKET_HEADER_SIZE];
+		*resp_code &= ~CMD_RESP_TAGGED;
+		state->header_size += CMD_PACKET_TAG_SIZE;
+		if (tag >= 1 && tag <= CMD_MAX_OUTSTANDING) {
+			return &state->tagged[tag - 1];
+		}
+		return NULL;
+	}
+	return &state->message;
+}
+
+static void rx_message_complete(struct rx_message_state *state)
+{
+	if (state->expected_messages_remaining == 0) {
+		signetdev_priv_finalize_message(state->current, (int)state->expected_resp_size);
+	} else {
+		signetdev_priv_message_send_resp(*state->current, (int)state->expected_resp_size, state->expected_messages_remaining);
+	}
+}
+
+void signetdev_priv_process_rx_message(struct rx_message_state *state, const u8 *msg, unsigned int len)
+{
+	int resp_code;
+	if (len < CMD_PACKET_HEADER_SIZE) {
+		signetdev_priv_handle_error();
+		return;
+	}
+	state->current = rx_header_message(state, msg, &resp_code);
+	unsigned int msg_len = msg[0] + ((unsigned int)msg[1] << 8);
+	if (msg_len != len || msg_len < state->header_size ||
+	    (msg_len - state->header_size) > MAX_CMD_PACKET_PAYLOAD_SIZE) {
+		signetdev_priv_handle_error();
+		return;
+	}
+	if (!state->current || !*state->current)
+		return;
+	struct send_message_req *message = *state->current;
+	state->expected_resp_size = msg_len - state->header_size;
+	state->expected_messages_remaining = msg[3] + (msg[4] << 8);
+	if (message->resp_code) {
+		*message->resp_code = resp_code;
+	}
+	message->end_device_state = msg[5];
+	memcpy(message->resp, msg + state->header_size, state->expected_resp_size);
+	rx_message_complete(state);
+}
+
 void signetdev_priv_process_rx_packet(struct rx_message_state *state, u8 *rx_packet_buf)
 {
 	int seq = rx_packet_buf[0] & 0x7f;
@@ -1131,33 +1780,42 @@ void signetdev_priv_process_rx_packet(struct rx_message_state *state, u8 *rx_pac
 		int event_type = rx_packet_header[0];
 		int resp_len =  rx_packet_header[1];
 		const void *data = (const void *)(rx_packet_header + 2);
-		signetdev_priv_handle_device_event(event_type, data, resp_len);
-	} else if (state->message) {
+		struct hc_event_info info;
+		if (g_event_info && (2 + resp_len + (int)sizeof(info)) <= signetdev_priv_hid_payload_size()) {
+			memcpy(&info, rx_packet_header + 2 + resp_len, sizeof(info));
+			signetdev_priv_handle_device_event(event_type, data, resp_len, &info);
+		} else {
+			signetdev_priv_handle_device_event(event_type, data, resp_len, NULL);
+		}
+	} else {
 		if (seq == 0) {
-			state->expected_resp_size = rx_packet_header[0] + ((unsigned int)rx_packet_header[1] << 8) - CMD_PACKET_HEADER_SIZE;
+			int resp_code;
+			state->current = rx_header_message(state, rx_packet_header, &resp_code);
+			if (!state->current || !*state->current)
+				return;
+			struct send_message_req *message = *state->current;
+			state->expected_resp_size = rx_packet_header[0] + ((unsigned int)rx_packet_header[1] << 8) - state->header_size;
 			state->expected_messages_remaining = rx_packet_header[3] + (rx_packet_header[4] << 8);
-			if (state->message->resp_code) {
-				*state->message->resp_code = rx_packet_header[2];
+			if (message->resp_code) {
+				*message->resp_code = resp_code;
 			}
-			state->message->end_device_state = rx_packet_header[5];
-			memcpy(state->message->resp,
-				rx_packet_buf + RAW_HID_HEADER_SIZE + CMD_PACKET_HEADER_SIZE,
-				signetdev_priv_hid_payload_size() - CMD_PACKET_HEADER_SIZE);
+			message->end_device_state = rx_packet_header[5];
+			memcpy(message->resp,
+				rx_packet_buf + RAW_HID_HEADER_SIZE + state->header_size,
+				signetdev_priv_hid_payload_size() - state->header_size);
 		} else {
+			if (!state->current || !*state->current)
+				return;
 			size_t to_read = signetdev_priv_hid_payload_size();
-			size_t offset = (signetdev_priv_hid_payload_size() * (size_t)seq) - CMD_PACKET_HEADER_SIZE;
+			size_t offset = (signetdev_priv_hid_payload_size() * (size_t)seq) - state->header_size;
 			if ((offset + to_read) > state->expected_resp_size) {
 				to_read = (state->expected_resp_size - offset);
 			}
 			if (to_read > 0)
-				memcpy(state->message->resp + offset, rx_packet_header, to_read);
+				memcpy((*state->current)->resp + offset, rx_packet_header, to_read);
 		}
 		if (last) {
-			if (state->expected_messages_remaining == 0) {
-				signetdev_priv_finalize_message(&state->message, (int)state->expected_resp_size);
-			} else {
-				signetdev_priv_message_send_resp(state->message, (int)state->expected_resp_size, state->expected_messages_remaining);
-			}
+			rx_message_complete(state);
 		}
 	}
 }
@@ -1174,7 +1832,8 @@ void signetdev_priv_message_send_resp(struct send_message_req *msg, int rc, int
 			resp_len = rc;
 		else
 			resp_code = rc;
-		signetdev_priv_handle_command_resp(msg->user,
+		signetdev_priv_handle_command_resp(msg->done, msg->done_param,
+			       msg->user,
 			       msg->token,
 			       msg->dev_cmd,
 			       msg->api_cmd,
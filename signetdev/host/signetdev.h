@@ -79,6 +79,18 @@ typedef enum signetdev_cmd_id {
 	SIGNETDEV_CMD_READ_CLEARTEXT_PASSWORD,
 	SIGNETDEV_CMD_READ_CLEARTEXT_PASSWORD_NAMES,
 	SIGNETDEV_CMD_WRITE_CLEARTEXT_PASSWORD,
+	SIGNETDEV_CMD_CREATE_VOLUME,
+	SIGNETDEV_CMD_RESIZE_VOLUME,
+	SIGNETDEV_CMD_DELETE_VOLUME,
+	SIGNETDEV_CMD_READ_TRACE,
+	SIGNETDEV_CMD_READ_IO_STATS,
+	SIGNETDEV_CMD_READ_BLOCKS,
+	SIGNETDEV_CMD_READ_BLOCK_CRCS,
+	SIGNETDEV_CMD_WRITE_BLOCK_VERIFY,
+	SIGNETDEV_CMD_WRITE_FLASH_HC,
+	SIGNETDEV_CMD_WRITE_FIRMWARE_STAGE,
+	SIGNETDEV_CMD_FLASH_STAGED_FIRMWARE,
+	SIGNETDEV_CMD_WRITE_COMPRESSED_FIRMWARE,
 	SIGNETDEV_NUM_COMMANDS
 } signetdev_cmd_id_t;
 
@@ -118,11 +130,25 @@ int signetdev_begin_initialize_device(void *param, int *token,
                                         const u8 *rand_data, int rand_data_len);
 int signetdev_disconnect(void *user, int *token);
 int signetdev_read_block(void *param, int *token, unsigned int idx);
+int signetdev_read_blocks(void *param, int *token, unsigned int first, unsigned int count, const u32 *manifest);
 int signetdev_write_block(void *param, int *token, unsigned int idx, const void *buffer);
+int signetdev_read_block_crcs(void *param, int *token, unsigned int first, unsigned int count);
+int signetdev_write_block_verify(void *param, int *token, unsigned int idx, const void *buffer);
+u32 signetdev_block_crc(const void *buffer);
+u32 signetdev_crc32(const void *buffer, unsigned int len);
 int signetdev_get_rand_bits(void *param, int *token, int sz);
 int signetdev_write_flash(void *param, int *token, u32 addr, const void *data, unsigned int data_len);
+int signetdev_write_flash_hc(void *param, int *token, u32 addr, const void *data, unsigned int data_len);
+int signetdev_write_firmware_stage(void *param, int *token, unsigned int idx, const void *buffer);
+int signetdev_write_compressed_firmware(void *param, int *token, unsigned int offset, const void *data, unsigned int len);
+int signetdev_flash_staged_firmware(void *param, int *token);
 int signetdev_erase_pages(void *param, int *token, unsigned int n_pages, const u8 *page_numbers);
 int signetdev_erase_pages_hc(void *param, int *token);
+int signetdev_create_volume(void *param, int *token, const struct hc_volume *volume);
+int signetdev_resize_volume(void *param, int *token, int volume_idx, u32 n_regions);
+int signetdev_delete_volume(void *param, int *token, int volume_idx);
+int signetdev_read_trace(void *param, int *token, int reset);
+int signetdev_read_io_stats(void *param, int *token, int reset);
 
 int signetdev_update_uid(void *user, int *token, unsigned int id, unsigned int size, const u8 *data, const u8 *mask);
 int signetdev_update_uids(void *user, int *token, unsigned int id, unsigned int size, const u8 *data, const u8 *mask, unsigned int entries_remaining);
@@ -130,6 +156,16 @@ int signetdev_read_uid(void *param, int *token, int uid, int masked);
 int signetdev_read_all_uids(void *param, int *token, int masked);
 int signetdev_has_keyboard();
 
+struct signetdev_create_volume_resp_data {
+	int volume_idx;
+};
+
+struct signetdev_read_trace_resp_data {
+	struct hc_trace_header header;
+	const struct hc_trace_span_stats *stats;
+	const struct hc_trace_event *events;
+};
+
 struct signetdev_get_rand_bits_resp_data {
 	int size;
 	const u8 *data;
@@ -142,6 +178,17 @@ struct signetdev_read_all_uids_resp_data {
         u8 mask[MAX_CMD_PACKET_PAYLOAD_SIZE];
 };
 
+//data points to the block contents when record.status is HC_BLOCK_DATA
+struct signetdev_read_blocks_resp_data {
+	struct hc_block_record record;
+	const u8 *data;
+};
+
+struct signetdev_read_block_crcs_resp_data {
+	int count;
+	u32 crc[MAX_NUM_STORAGE_BLOCKS];
+};
+
 struct signetdev_read_uid_resp_data {
 	int size;
         u8 data[MAX_CMD_PACKET_PAYLOAD_SIZE];
@@ -181,12 +228,84 @@ int signetdev_filter_window_messasage(UINT uMsg, WPARAM wParam, LPARAM lParam);
 typedef void (*signetdev_cmd_resp_t)(void *cb_param, void *cmd_user_param, int cmd_token, int end_device_state, int messages_remaining, int cmd, int resp_code, const void *resp_data);
 typedef void (*signetdev_device_event_t)(void *cb_param, int event_type, const void *resp_data, int resp_len);
 
+//
+// Same as signetdev_device_event_t but also passes the event's sequence number,
+// drop count and timestamp. info is NULL for firmware that doesn't send them.
+// A gap in the sequence or a non-zero drop count means events were lost and
+// any cached device state should be re-read.
+//
+typedef void (*signetdev_device_event_info_t)(void *cb_param, int event_type, const void *resp_data, int resp_len, const struct hc_event_info *info);
+
 
 void signetdev_set_device_opened_cb(void (*device_opened)(enum signetdev_device_type, void *), void *param);
 void signetdev_set_device_closed_cb(void (*device_closed)(void *), void *param);
 void signetdev_set_command_resp_cb(signetdev_cmd_resp_t cmd_resp_cb, void *cb_param);
 void signetdev_set_device_event_cb(signetdev_device_event_t device_event_cb, void *cb_param);
 
+//
+// Each command has a _req variant taking a request. Its response goes to
+// req->done instead of the command response callback, so commands issued from
+// the same thread can complete to different places. 'req' is only read during
+// the call and may be NULL, which is the same as calling the plain command.
+// Each command owns its response buffer, so any number can be outstanding at
+// once. 'done' runs on the transaction thread.
+//
+struct signetdev_request {
+	signetdev_cmd_resp_t done;
+	void *done_param;
+};
+
+int signetdev_write_cleartext_password_req(const struct signetdev_request *req, void *param, int *token, int index, const struct cleartext_pass *data);
+int signetdev_read_cleartext_password_req(const struct signetdev_request *req, void *param, int *token, int index);
+int signetdev_read_cleartext_password_names_req(const struct signetdev_request *req, void *param, int *token);
+int signetdev_enter_mobile_mode_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_get_device_state_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_logout_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_login_req(const struct signetdev_request *req, void *user, int *token, u8 *key, unsigned int key_len, int gen_token);
+int signetdev_login_token_req(const struct signetdev_request *req, void *user, int *api_token, u8 *login_token);
+int signetdev_begin_update_firmware_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_begin_update_firmware_hc_req(const struct signetdev_request *req, void *user, int *token, const struct hc_firmware_info *fw_info);
+int signetdev_reset_device_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_switch_boot_mode_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_get_progress_req(const struct signetdev_request *req, void *user, int *token, int progress, int state);
+int signetdev_wipe_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_begin_device_backup_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_end_device_backup_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_begin_device_restore_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_end_device_restore_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_startup_req(const struct signetdev_request *req, void *param, int *token);
+int signetdev_type_req(const struct signetdev_request *req, void *param, int *token, const u8 *keys, int n_keys);
+int signetdev_type_w_req(const struct signetdev_request *req, void *param, int *token, const u16 *keys, int n_keys);
+int signetdev_type_raw_req(const struct signetdev_request *req, void *param, int *token, const u8 *codes, int n_keys);
+int signetdev_button_wait_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_change_master_password_req(const struct signetdev_request *req, void *param, int *token, u8 *old_key, u32 old_key_len, u8 *new_key, u32 new_key_len, u8 *hashfn, u32 hashfn_len, u8 *salt, u32 salt_len);
+int signetdev_begin_initialize_device_req(const struct signetdev_request *req, void *param, int *token, const u8 *key, int key_len, const u8 *hashfn, int hashfn_len, const u8 *salt, int salt_len, const u8 *rand_data, int rand_data_len);
+int signetdev_disconnect_req(const struct signetdev_request *req, void *user, int *token);
+int signetdev_read_block_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx);
+int signetdev_read_blocks_req(const struct signetdev_request *req, void *param, int *token, unsigned int first, unsigned int count, const u32 *manifest);
+int signetdev_write_block_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx, const void *buffer);
+int signetdev_read_block_crcs_req(const struct signetdev_request *req, void *param, int *token, unsigned int first, unsigned int count);
+int signetdev_write_block_verify_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx, const void *buffer);
+int signetdev_get_rand_bits_req(const struct signetdev_request *req, void *param, int *token, int sz);
+int signetdev_write_flash_req(const struct signetdev_request *req, void *param, int *token, u32 addr, const void *data, unsigned int data_len);
+int signetdev_write_flash_hc_req(const struct signetdev_request *req, void *param, int *token, u32 addr, const void *data, unsigned int data_len);
+int signetdev_write_firmware_stage_req(const struct signetdev_request *req, void *param, int *token, unsigned int idx, const void *buffer);
+int signetdev_write_compressed_firmware_req(const struct signetdev_request *req, void *param, int *token, unsigned int offset, const void *data, unsigned int len);
+int signetdev_flash_staged_firmware_req(const struct signetdev_request *req, void *param, int *token);
+int signetdev_erase_pages_req(const struct signetdev_request *req, void *param, int *token, unsigned int n_pages, const u8 *page_numbers);
+int signetdev_erase_pages_hc_req(const struct signetdev_request *req, void *param, int *token);
+int signetdev_create_volume_req(const struct signetdev_request *req, void *param, int *token, const struct hc_volume *volume);
+int signetdev_resize_volume_req(const struct signetdev_request *req, void *param, int *token, int volume_idx, u32 n_regions);
+int signetdev_delete_volume_req(const struct signetdev_request *req, void *param, int *token, int volume_idx);
+int signetdev_read_trace_req(const struct signetdev_request *req, void *param, int *token, int reset);
+int signetdev_read_io_stats_req(const struct signetdev_request *req, void *param, int *token, int reset);
+int signetdev_update_uid_req(const struct signetdev_request *req, void *user, int *token, unsigned int id, unsigned int size, const u8 *data, const u8 *mask);
+int signetdev_update_uids_req(const struct signetdev_request *req, void *user, int *token, unsigned int id, unsigned int size, const u8 *data, const u8 *mask, unsigned int entries_remaining);
+int signetdev_read_uid_req(const struct signetdev_request *req, void *param, int *token, int uid, int masked);
+int signetdev_read_all_uids_req(const struct signetdev_request *req, void *param, int *token, int masked);
+
+void signetdev_set_device_event_info_cb(signetdev_device_event_info_t device_event_info_cb, void *cb_param);
+
 int signetdev_emulate_init(const char *filename);
 int signetdev_emulate_begin();
 void signetdev_emulate_end();
@@ -5,10 +5,14 @@
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <assert.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,8 +27,17 @@ static int g_emulating;
 static int g_poll_fd = -1;
 static int g_inotify_fd = -1;
 
+//Bulk reads are a whole number of packets and can hold any response
+#define BULK_RX_BUF_SIZE (((MAX_CMD_PACKET_BUF_SIZE + CMD_BULK_EP_SIZE - 1) / CMD_BULK_EP_SIZE) * CMD_BULK_EP_SIZE)
+
 struct signetdev_connection {
 	int fd;
+	int bulk_fd;
+	int bulk_tx_busy;
+	int bulk_rx_busy;
+	struct usbdevfs_urb bulk_tx_urb;
+	struct usbdevfs_urb bulk_rx_urb;
+	u8 bulk_rx_buf[BULK_RX_BUF_SIZE];
 	struct send_message_req *tail_message;
 	struct send_message_req *head_message;
 	struct send_message_req *tail_cancel_message;
@@ -36,6 +49,186 @@ struct signetdev_connection {
 
 struct signetdev_connection g_connection;
 
+//
+// Commands reach the transaction thread through a bounded lock-free ring
+// that any thread may push to. Each slot's sequence number tells producers
+// when it is free and the consumer when it has been filled. The eventfd is
+// only written when the transaction thread has said it is about to sleep,
+// so a busy thread takes commands without any syscalls. Results of
+// synchronous commands come back through a second ring and eventfd.
+//
+// Producers that find the ring full block on not_full until the consumer
+// frees a slot. The transaction thread can't wait on itself, so when a
+// callback it runs issues a command into a full ring the command goes on a
+// local overflow list instead.
+//
+#define COMMAND_RING_SIZE (256)
+
+struct command_ring_slot {
+	atomic_uint seq;
+	int command;
+	void *p;
+};
+
+struct command_ring {
+	struct command_ring_slot slots[COMMAND_RING_SIZE];
+	atomic_uint head; //Next slot to fill
+	atomic_uint tail; //Next slot to take
+	atomic_int waiting; //Consumer is, or is about to be, blocked on event_fd
+	atomic_int blocked; //Producers waiting on not_full
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	int event_fd;
+};
+
+struct command_overflow {
+	int command;
+	void *p;
+	struct command_overflow *next;
+};
+
+static struct command_ring g_command_ring;
+static struct command_ring g_command_resp_ring;
+
+//Only touched by the transaction thread
+static struct command_overflow *g_command_overflow_head = NULL;
+static struct command_overflow *g_command_overflow_tail = NULL;
+
+//Synchronous commands are issued one at a time so results can't be swapped
+static pthread_mutex_t g_command_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void command_ring_setup(struct command_ring *ring, int flags)
+{
+	unsigned int i;
+	for (i = 0; i < COMMAND_RING_SIZE; i++)
+		atomic_init(&ring->slots[i].seq, i);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiting, 0);
+	atomic_init(&ring->blocked, 0);
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->not_full, NULL);
+	ring->event_fd = eventfd(0, flags);
+	if (ring->event_fd == -1) {
+		perror("Signet device: Could not open eventfd!");
+		exit(-1);
+	}
+}
+
+void command_ring_init()
+{
+	command_ring_setup(&g_command_ring, EFD_NONBLOCK);
+	command_ring_setup(&g_command_resp_ring, 0);
+}
+
+static void command_ring_wake(struct command_ring *ring)
+{
+	u64 one = 1;
+	int err __attribute__((unused));
+	err = write(ring->event_fd, &one, sizeof(one));
+}
+
+//Returns -1 if the ring is full
+static int command_ring_try_push(struct command_ring *ring, int command, void *p)
+{
+	unsigned int pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct command_ring_slot *slot;
+	while (1) {
+		slot = &ring->slots[pos % COMMAND_RING_SIZE];
+		unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		int diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+	slot->command = command;
+	slot->p = p;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+static void command_overflow_push(int command, void *p)
+{
+	struct command_overflow *o = (struct command_overflow *)malloc(sizeof(struct command_overflow));
+	o->command = command;
+	o->p = p;
+	o->next = NULL;
+	if (g_command_overflow_tail)
+		g_command_overflow_tail->next = o;
+	else
+		g_command_overflow_head = o;
+	g_command_overflow_tail = o;
+}
+
+static void command_ring_push(struct command_ring *ring, int command, void *p)
+{
+	if (pthread_equal(pthread_self(), worker_thread)) {
+		//Keep the order of commands already on the overflow list
+		if (g_command_overflow_head || command_ring_try_push(ring, command, p))
+			command_overflow_push(command, p);
+		return;
+	}
+	if (command_ring_try_push(ring, command, p)) {
+		pthread_mutex_lock(&ring->lock);
+		atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+		//Pairs with the fence in command_ring_pop()
+		atomic_thread_fence(memory_order_seq_cst);
+		while (command_ring_try_push(ring, command, p)) {
+			command_ring_wake(ring);
+			pthread_cond_wait(&ring->not_full, &ring->lock);
+		}
+		atomic_fetch_sub_explicit(&ring->blocked, 1, memory_order_relaxed);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	//Pairs with the fence in command_ring_sleep()
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->waiting, memory_order_relaxed) &&
+	    atomic_exchange_explicit(&ring->waiting, 0, memory_order_relaxed)) {
+		command_ring_wake(ring);
+	}
+}
+
+//Returns 0 if the ring is empty
+static int command_ring_pop(struct command_ring *ring, int *command, void **p)
+{
+	unsigned int pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	struct command_ring_slot *slot = &ring->slots[pos % COMMAND_RING_SIZE];
+	unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+	if ((int)(seq - (pos + 1)) < 0)
+		return 0;
+	*command = slot->command;
+	*p = slot->p;
+	atomic_store_explicit(&slot->seq, pos + COMMAND_RING_SIZE, memory_order_release);
+	atomic_store_explicit(&ring->tail, pos + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->blocked, memory_order_relaxed)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->not_full);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	return 1;
+}
+
+//Announces that the consumer will block. Returns 0 if there is work instead
+static int command_ring_sleep(struct command_ring *ring)
+{
+	atomic_store_explicit(&ring->waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	unsigned int pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int seq = atomic_load_explicit(&ring->slots[pos % COMMAND_RING_SIZE].seq, memory_order_acquire);
+	if ((int)(seq - (pos + 1)) >= 0) {
+		atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+		return 0;
+	}
+	return 1;
+}
+
 static struct send_message_req **pending_message()
 {
 	struct signetdev_connection *conn = &g_connection;
@@ -48,9 +241,54 @@ static struct send_message_req **pending_message()
 	return msg;
 }
 
+static void finalize_tagged_messages(int rc)
+{
+	struct signetdev_connection *conn = &g_connection;
+	int i;
+	for (i = 0; i < CMD_MAX_OUTSTANDING; i++) {
+		if (conn->rx_state.tagged[i]) {
+			if (conn->tx_state.message == conn->rx_state.tagged[i])
+				conn->tx_state.message = NULL;
+			signetdev_priv_finalize_message(&conn->rx_state.tagged[i], rc);
+		}
+	}
+}
+
+static struct send_message_req **free_tag_slot(struct signetdev_connection *conn)
+{
+	int i;
+	for (i = 0; i < CMD_MAX_OUTSTANDING; i++) {
+		if (!conn->rx_state.tagged[i])
+			return &conn->rx_state.tagged[i];
+	}
+	return NULL;
+}
+
+static int tagged_messages_outstanding(struct signetdev_connection *conn)
+{
+	int i;
+	for (i = 0; i < CMD_MAX_OUTSTANDING; i++) {
+		if (conn->rx_state.tagged[i])
+			return 1;
+	}
+	return 0;
+}
+
+static void close_bulk()
+{
+	struct signetdev_connection *conn = &g_connection;
+	if (conn->bulk_fd >= 0) {
+		close(conn->bulk_fd);
+		conn->bulk_fd = -1;
+	}
+	conn->bulk_tx_busy = 0;
+	conn->bulk_rx_busy = 0;
+}
+
 void signetdev_priv_handle_error()
 {
 	struct signetdev_connection *conn = &g_connection;
+	close_bulk();
 	if (conn->fd != -1) {
 		close(conn->fd);
 		conn->fd  = -1;
@@ -62,18 +300,24 @@ void signetdev_priv_handle_error()
 
 static int command_response(int rc)
 {
-	char resp = rc;
-	return write(g_command_resp_pipe[1], &resp, 1);
+	//Only one synchronous command is outstanding so this can't fill up
+	int err __attribute__((unused));
+	err = command_ring_try_push(&g_command_resp_ring, rc, NULL);
+	assert(!err);
+	command_ring_wake(&g_command_resp_ring);
+	return 0;
 }
 
 static void handle_exit(void *arg)
 {
 	struct signetdev_connection *conn = &g_connection;
 	(void)arg;
+	finalize_tagged_messages(SIGNET_ERROR_QUIT);
 	struct send_message_req **msg = pending_message();
 	if (msg) {
 		signetdev_priv_finalize_message(msg, SIGNET_ERROR_QUIT);
 	}
+	close_bulk();
 	if (conn->fd != -1)
 		close(conn->fd);
 	if (g_poll_fd != -1)
@@ -87,6 +331,7 @@ static void handle_exit(void *arg)
 static void handle_error()
 {
 	struct signetdev_connection *conn = &g_connection;
+	close_bulk();
 	if (conn->fd >= 0) {
 		close(conn->fd);
 		conn->fd = -1;
@@ -95,6 +340,7 @@ static void handle_error()
 	if (g_error_handler) {
 		g_error_handler(g_error_handler_param);
 	}
+	finalize_tagged_messages(SIGNET_ERROR_DISCONNECT);
 	struct send_message_req **msg = pending_message();
 	if (msg) {
 		struct send_message_req *temp = *msg;
@@ -144,6 +390,91 @@ static int attempt_raw_hid_read()
 	return 0;
 }
 
+static int attempt_bulk_io()
+{
+	struct signetdev_connection *conn = &g_connection;
+	struct usbdevfs_urb *urb;
+	int progress = 0;
+
+	while (ioctl(conn->bulk_fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+		progress = 1;
+		if (urb->status) {
+			handle_error();
+			return 1;
+		}
+		if (urb == &conn->bulk_tx_urb) {
+			conn->bulk_tx_busy = 0;
+			if (!conn->tx_state.message->resp) {
+				signetdev_priv_finalize_message(&conn->tx_state.message, conn->tx_state.msg_size);
+			} else {
+				conn->tx_state.message = NULL;
+			}
+		} else {
+			conn->bulk_rx_busy = 0;
+			signetdev_priv_process_rx_message(&conn->rx_state, conn->bulk_rx_buf, (unsigned int)urb->actual_length);
+			if (conn->bulk_fd < 0)
+				return 1;
+		}
+	}
+	if (errno != EAGAIN) {
+		handle_error();
+		return 1;
+	}
+
+	//Keep a read queued so responses don't wait on the host
+	if (!conn->bulk_rx_busy) {
+		memset(&conn->bulk_rx_urb, 0, sizeof(conn->bulk_rx_urb));
+		conn->bulk_rx_urb.type = USBDEVFS_URB_TYPE_BULK;
+		conn->bulk_rx_urb.endpoint = CMD_BULK_EPIN_ADDR;
+		conn->bulk_rx_urb.buffer = conn->bulk_rx_buf;
+		conn->bulk_rx_urb.buffer_length = BULK_RX_BUF_SIZE;
+		if (ioctl(conn->bulk_fd, USBDEVFS_SUBMITURB, &conn->bulk_rx_urb)) {
+			handle_error();
+			return 1;
+		}
+		conn->bulk_rx_busy = 1;
+	}
+
+	//The whole message goes out in one transfer
+	if (conn->tx_state.message && !conn->bulk_tx_busy) {
+		memset(&conn->bulk_tx_urb, 0, sizeof(conn->bulk_tx_urb));
+		conn->bulk_tx_urb.type = USBDEVFS_URB_TYPE_BULK;
+		conn->bulk_tx_urb.endpoint = CMD_BULK_EPOUT_ADDR;
+		conn->bulk_tx_urb.buffer = conn->tx_state.msg_buf;
+		conn->bulk_tx_urb.buffer_length = (int)conn->tx_state.msg_size;
+		if ((conn->tx_state.msg_size % CMD_BULK_EP_SIZE) == 0)
+			conn->bulk_tx_urb.flags = USBDEVFS_URB_ZERO_PACKET;
+		if (ioctl(conn->bulk_fd, USBDEVFS_SUBMITURB, &conn->bulk_tx_urb)) {
+			handle_error();
+			return 1;
+		}
+		conn->bulk_tx_busy = 1;
+	}
+	return !progress;
+}
+
+//Claims the command bulk interface. Firmware without one stays on raw HID
+static void attempt_open_bulk()
+{
+	struct signetdev_connection *conn = &g_connection;
+	unsigned int iface = CMD_BULK_INTERFACE;
+	int fd = open("/dev/signet-hc-bulk", O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		return;
+	if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &iface)) {
+		close(fd);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(g_poll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		return;
+	}
+	conn->bulk_fd = fd;
+}
+
 static int attempt_open_connection()
 {
 	struct signetdev_connection *conn = &g_connection;
@@ -163,6 +494,9 @@ static int attempt_open_connection()
 	if (fd >= 0) {
 		memset(conn, 0, sizeof(g_connection));
 		conn->fd = fd;
+		conn->bulk_fd = -1;
+		g_tagged_commands = 0;
+		g_event_info = 0;
 		g_device_type = is_hc ? SIGNETDEV_DEVICE_HC : SIGNETDEV_DEVICE_ORIGINAL;
 		struct epoll_event ev;
 		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
@@ -170,6 +504,8 @@ static int attempt_open_connection()
 		int rc = epoll_ctl(g_poll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
 		if (rc)
 			pthread_exit(NULL);
+		if (is_hc)
+			attempt_open_bulk();
 		g_opening_connection = 0;
 		return g_device_type;
 	} else {
@@ -202,6 +538,7 @@ static void handle_command(int command, void *p)
 		break;
 	case SIGNETDEV_CMD_CLOSE:
 		g_opening_connection = 0;
+		close_bulk();
 		if (conn->fd >= 0) {
 			epoll_ctl(g_poll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
 			close(conn->fd);
@@ -244,25 +581,27 @@ static void handle_command(int command, void *p)
 	}
 }
 
-static void command_pipe_io_iter()
+static void command_ring_io_iter()
 {
-	int done = 0;
-	while (!done) {
-		intptr_t v[2];
-		int rc = read(g_command_pipe[0], v, sizeof(intptr_t) * 2);
-		if (rc == sizeof(intptr_t) * 2) {
-			handle_command(v[0], (void *)v[1]);
-		} else if (rc == -1 && errno == EAGAIN) {
-			done = 1;
-		} else {
-			handle_error();
-		}
+	int command;
+	void *p;
+	while (command_ring_pop(&g_command_ring, &command, &p)) {
+		handle_command(command, p);
+	}
+	while (g_command_overflow_head) {
+		struct command_overflow *o = g_command_overflow_head;
+		g_command_overflow_head = o->next;
+		if (!g_command_overflow_head)
+			g_command_overflow_tail = NULL;
+		handle_command(o->command, o->p);
+		free(o);
 	}
 }
 
 static int raw_hid_io(struct signetdev_connection *conn)
 {
 	if (!conn->tx_state.message && (conn->head_message || conn->head_cancel_message)) {
+		int tag = 0;
 		if (conn->head_cancel_message) {
 			conn->tx_state.message = conn->head_cancel_message;
 			conn->head_cancel_message = conn->head_cancel_message->next;
@@ -270,13 +609,30 @@ static int raw_hid_io(struct signetdev_connection *conn)
 				conn->tail_cancel_message = NULL;
 			}
 		} else if (!conn->rx_state.message) {
-			conn->tx_state.message = conn->head_message;
-			if (conn->head_message->resp) {
-				conn->rx_state.message = conn->head_message;
+			//Single message commands with a response can be tagged and
+			//sent while others are outstanding. Everything else waits
+			//until the device has answered all tagged commands
+			struct send_message_req *head = conn->head_message;
+			struct send_message_req **slot = NULL;
+			if (g_tagged_commands && conn->bulk_fd < 0 && head->resp && !head->messages_remaining) {
+				slot = free_tag_slot(conn);
 			}
-			conn->head_message = conn->head_message->next;
-			if (!conn->head_message) {
-				conn->tail_message = NULL;
+			if (slot) {
+				tag = (int)(slot - conn->rx_state.tagged) + 1;
+				*slot = head;
+			} else if (!tagged_messages_outstanding(conn)) {
+				if (head->resp) {
+					conn->rx_state.message = head;
+				}
+			} else {
+				head = NULL;
+			}
+			if (head) {
+				conn->tx_state.message = head;
+				conn->head_message = head->next;
+				if (!conn->head_message) {
+					conn->tail_message = NULL;
+				}
 			}
 		}
 		if (conn->tx_state.message) {
@@ -285,9 +641,13 @@ static int raw_hid_io(struct signetdev_connection *conn)
 					 conn->tx_state.message->messages_remaining,
 					 conn->tx_state.message->payload,
 					 conn->tx_state.message->payload_size);
+			signetdev_priv_tag_message_state(&conn->tx_state, tag);
 		}
 	}
 
+	if (conn->bulk_fd >= 0) {
+		return attempt_raw_hid_read() && attempt_bulk_io();
+	}
 	return attempt_raw_hid_read() && attempt_raw_hid_write();
 }
 
@@ -334,20 +694,21 @@ void *transaction_thread(void *arg)
 	struct signetdev_connection *conn = &g_connection;
 	g_opening_connection = 0;
 	conn->fd = -1;
+	conn->bulk_fd = -1;
 	g_device_type = SIGNETDEV_DEVICE_NONE;
 	pthread_cleanup_push(handle_exit, NULL);
 
 	g_poll_fd = epoll_create1(0);
 
-	struct epoll_event ev_pipe;
+	struct epoll_event ev_command;
 	struct epoll_event ev_inotify;
 	int rc;
 
 	(void)arg;
 
-	ev_pipe.events = EPOLLIN | EPOLLET;
-	ev_pipe.data.fd = g_command_pipe[0];
-	rc = epoll_ctl(g_poll_fd, EPOLL_CTL_ADD, g_command_pipe[0], &ev_pipe);
+	ev_command.events = EPOLLIN | EPOLLET;
+	ev_command.data.fd = g_command_ring.event_fd;
+	rc = epoll_ctl(g_poll_fd, EPOLL_CTL_ADD, g_command_ring.event_fd, &ev_command);
 	if (rc)
 		pthread_exit(NULL);
 
@@ -362,18 +723,28 @@ void *transaction_thread(void *arg)
 		pthread_exit(NULL);
 
 	while (1) {
-		command_pipe_io_iter();
+		command_ring_io_iter();
 		if (conn->fd != -1) {
 			raw_hid_io_iter();
 		}
+		if (g_command_overflow_head || !command_ring_sleep(&g_command_ring))
+			continue;
 		int nfds = epoll_wait(g_poll_fd, events, 8, -1);
+		atomic_store_explicit(&g_command_ring.waiting, 0, memory_order_relaxed);
 		int i;
 		for (i = 0; i < nfds; i++) {
+			if (events[i].data.fd == g_command_ring.event_fd) {
+				u64 count;
+				rc = read(g_command_ring.event_fd, &count, sizeof(count));
+			}
 			if (events[i].data.fd == g_inotify_fd) {
 				inotify_fd_readable();
 			}
 			if (events[i].data.fd == conn->fd && (events[i].events & EPOLLERR)) {
 				handle_error();
+			} else if (conn->bulk_fd >= 0 && events[i].data.fd == conn->bulk_fd &&
+				   (events[i].events & (EPOLLERR | EPOLLHUP))) {
+				handle_error();
 			}
 		}
 	}
@@ -384,17 +755,20 @@ void *transaction_thread(void *arg)
 
 int signetdev_priv_issue_command(int command, void *p)
 {
-	int err __attribute__((unused)); // TODO add error handling
-	intptr_t v[2] = {command, (intptr_t)p};
-	err = write(g_command_pipe[1], v, sizeof(intptr_t) * 2);
-	char cmd_resp;
-	err = read(g_command_resp_pipe[0], &cmd_resp, 1);
+	int cmd_resp = -1;
+	void *unused;
+	pthread_mutex_lock(&g_command_sync_lock);
+	command_ring_push(&g_command_ring, command, p);
+	while (!command_ring_pop(&g_command_resp_ring, &cmd_resp, &unused)) {
+		u64 count;
+		if (read(g_command_resp_ring.event_fd, &count, sizeof(count)) == -1 && errno != EINTR)
+			break;
+	}
+	pthread_mutex_unlock(&g_command_sync_lock);
 	return cmd_resp;
 }
 
 void signetdev_priv_issue_command_no_resp(int command, void *p)
 {
-	intptr_t v[2] = {command, (intptr_t)p};
-	int err __attribute__((unused)); // TODO return int and do error handling in callers
-	err = write(g_command_pipe[1], v, sizeof(intptr_t) * 2);
+	command_ring_push(&g_command_ring, command, p);
 }
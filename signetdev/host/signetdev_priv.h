@@ -6,8 +6,8 @@
 void signetdev_priv_platform_init();
 void signetdev_priv_platform_deinit();
 void signetdev_priv_handle_error();
-void signetdev_priv_handle_command_resp(void *user, int token, int dev_cmd, int api_cmd, int resp_code, const u8 *resp, unsigned int resp_len, int end_device_state, int expected_messages_remaining);
-void signetdev_priv_handle_device_event(int event_type, const u8 *resp, int resp_len);
+void signetdev_priv_handle_command_resp(signetdev_cmd_resp_t done, void *done_param, void *user, int token, int dev_cmd, int api_cmd, int resp_code, const u8 *resp, unsigned int resp_len, int end_device_state, int expected_messages_remaining);
+void signetdev_priv_handle_device_event(int event_type, const u8 *resp, int resp_len, const struct hc_event_info *info);
 
 enum signetdev_commands {
 	SIGNETDEV_CMD_OPEN,
@@ -36,7 +36,11 @@ struct send_message_req {
 	int token;
 	int interrupt;
 	int end_device_state;
+	signetdev_cmd_resp_t done; //Overrides the command response callback when set
+	void *done_param;
 	struct send_message_req *next;
+	int resp_code_buf;
+	u8 resp_buf[]; //Response storage when one is wanted
 };
 
 struct attach_message {
@@ -61,9 +65,15 @@ struct rx_message_state {
 	int resp_code;
         int resp_buffer[MAX_CMD_PACKET_BUF_SIZE];
 	struct send_message_req *message;
+	//Messages sent with tag (i + 1). Responses are never interleaved so
+	//the rest of the state is shared
+	struct send_message_req *tagged[CMD_MAX_OUTSTANDING];
+	struct send_message_req **current;
+	unsigned int header_size;
 };
 
 void signetdev_priv_prepare_message_state(struct tx_message_state *msg, unsigned int dev_cmd, unsigned int messages_remaining, u8 *payload, unsigned int payload_size);
+void signetdev_priv_tag_message_state(struct tx_message_state *msg, int tag);
 void signetdev_priv_advance_message_state(struct tx_message_state *msg);
 
 extern void (*g_device_opened_cb)(enum signetdev_device_type dev_type, void *);
@@ -75,11 +85,12 @@ extern void *g_device_closed_cb_param;
 #define SIGNETDEV_PRIV_GET_RESP 1
 #define SIGNETDEV_PRIV_NO_RESP 0
 
-int signetdev_priv_send_message(void *user, int token,  int dev_cmd, int api_cmd, unsigned int messages_remaining, const u8 *payload, unsigned int payload_size, int get_resp);
+int signetdev_priv_send_message(const struct signetdev_request *req, void *user, int token,  int dev_cmd, int api_cmd, unsigned int messages_remaining, const u8 *payload, unsigned int payload_size, int get_resp);
 void signetdev_priv_message_send_resp(struct send_message_req *msg, int rc, int expected_messages_remaining);
 void signetdev_priv_free_message(struct send_message_req **req);
 void signetdev_priv_finalize_message(struct send_message_req **msg ,int rc);
 void signetdev_priv_process_rx_packet(struct rx_message_state *state, u8 *rx_packet_buf);
+void signetdev_priv_process_rx_message(struct rx_message_state *state, const u8 *msg, unsigned int len);
 int signetdev_priv_cancel_message(int dev_cmd, const u8 *payload, unsigned int payload_size);
 
 void signetdev_priv_issue_command_no_resp(int command, void *p);
@@ -90,5 +101,7 @@ int signetdev_emulate_handle_message_priv(struct send_message_req *msg);
 extern signetdev_conn_err_t g_error_handler;
 extern void *g_error_handler_param;
 enum signetdev_device_type g_device_type;
+extern int g_tagged_commands;
+extern int g_event_info;
 
 #endif
@@ -24,11 +24,15 @@ void signetdev_close_connection()
 
 void signetdev_priv_platform_init()
 {
+#ifdef SIGNETDEV_COMMAND_RING
+	command_ring_init();
+#else
 	if (pipe(g_command_pipe) == -1 || pipe(g_command_resp_pipe) == -1) {
 		perror("Signet device: Could not open pipe!");
 		exit(-1);
 	}
 	fcntl(g_command_pipe[0], F_SETFL, O_NONBLOCK);
+#endif
 	pthread_create(&worker_thread, NULL, transaction_thread, NULL);
 }
 
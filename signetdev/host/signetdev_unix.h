@@ -7,6 +7,12 @@
 //Platform specific
 void *transaction_thread(void *arg);
 
+//Linux passes commands to the transaction thread through a ring instead of a pipe
+#if defined(__linux__) && !defined(__ANDROID__)
+#define SIGNETDEV_COMMAND_RING
+void command_ring_init();
+#endif
+
 extern pthread_t worker_thread;
 extern int g_command_pipe[];
 extern int g_command_resp_pipe[];
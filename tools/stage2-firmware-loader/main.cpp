@@ -3,6 +3,7 @@
 #include <QJsonObject>
 #include <QJsonDocument>
 #include <QTimer>
+#include <QMap>
 
 extern "C" {
 #include "signetdev/host/signetdev.h"
@@ -19,6 +20,18 @@ QList<fwSection> fwSections;
 QList<fwSection>::iterator writingSectionIter;
 unsigned int writingAddr;
 unsigned int writingSize;
+enum signetdev_device_type deviceType;
+
+//
+// HC devices program each write in the background so several are kept in
+// flight. Responses carry the CRC the device read back for the last write it
+// programmed, which is checked against the CRC of the data that was sent.
+//
+#define FLASH_WRITE_WINDOW (4)
+QMap<unsigned int, quint32> sentWriteCrcs;
+int writesSent;
+int writesOutstanding;
+bool flushing;
 
 void deviceClosedS(void *user)
 {
@@ -39,14 +52,25 @@ void sendFirmwareWriteCmd()
 	unsigned int section_lma = writingSectionIter->lma;
 	unsigned int section_size = writingSectionIter->size;
 	unsigned int section_end = section_lma + section_size;
-	unsigned int write_size = 1024;
+	unsigned int write_size = (deviceType == SIGNETDEV_DEVICE_HC) ? HC_WRITE_FLASH_MAX_LEN : 1024;
 	if ((writingAddr + write_size) >= section_end) {
 		write_size = section_end - writingAddr;
 		advance = true;
 	}
 	void *data = writingSectionIter->contents.data() + (writingAddr - section_lma);
 
-	::signetdev_write_flash(NULL, &token, writingAddr, data, write_size);
+	if (deviceType == SIGNETDEV_DEVICE_HC) {
+		//Flash is programmed a word at a time
+		QByteArray padded((const char *)data, write_size);
+		while (padded.size() & 3)
+			padded.append((char)0xff);
+		sentWriteCrcs[writingAddr] = ::signetdev_crc32(padded.data(), padded.size());
+		::signetdev_write_flash_hc(NULL, &token, writingAddr, padded.data(), padded.size());
+		writesSent++;
+		writesOutstanding++;
+	} else {
+		::signetdev_write_flash(NULL, &token, writingAddr, data, write_size);
+	}
 	if (advance) {
 		writingSectionIter++;
 		if (writingSectionIter != fwSections.end()) {
@@ -58,12 +82,38 @@ void sendFirmwareWriteCmd()
 	writingSize = write_size;
 }
 
+void fillFirmwareWriteWindow()
+{
+	int token;
+	while (writingSectionIter != fwSections.end() && writesOutstanding < FLASH_WRITE_WINDOW) {
+		sendFirmwareWriteCmd();
+	}
+	if (writingSectionIter == fwSections.end() && !writesOutstanding && !flushing) {
+		//An empty write answers once everything has been programmed
+		::signetdev_write_flash_hc(NULL, &token, 0, NULL, 0);
+		writesOutstanding++;
+		flushing = true;
+	}
+}
+
 void signetCmdResponse(void *cb_param, void *cmd_user_param, int cmd_token, int cmd, int end_device_state, int messages_remaining, int resp_code, void *resp_data)
 {
 	int token;
 	switch(cmd) {
 	case SIGNETDEV_CMD_STARTUP: {
-		::signetdev_begin_update_firmware(NULL, &token);
+		if (deviceType == SIGNETDEV_DEVICE_HC) {
+			struct hc_firmware_info fw_info;
+			QByteArray image;
+			memset(&fw_info, 0, sizeof(fw_info));
+			for (auto iter = fwSections.begin(); iter != fwSections.end(); iter++) {
+				image.append(iter->contents);
+			}
+			fw_info.firmware_len = image.size();
+			fw_info.firmware_crc = ::signetdev_crc32(image.data(), image.size());
+			::signetdev_begin_update_firmware_hc(NULL, &token, &fw_info);
+		} else {
+			::signetdev_begin_update_firmware(NULL, &token);
+		}
 	} break;
 	case SIGNETDEV_CMD_BEGIN_UPDATE_FIRMWARE: {
 		QByteArray erase_pages_;
@@ -77,6 +127,11 @@ void signetCmdResponse(void *cb_param, void *cmd_user_param, int cmd_token, int
 
 		printf("Starting to program...\n", resp_code);
 
+		if (deviceType == SIGNETDEV_DEVICE_HC) {
+			::signetdev_erase_pages_hc(NULL, &token);
+			break;
+		}
+
 		for (auto iter = fwSections.begin(); iter != fwSections.end(); iter++) {
 			const fwSection &section = (*iter);
 			unsigned int lma = section.lma;
@@ -113,12 +168,40 @@ void signetCmdResponse(void *cb_param, void *cmd_user_param, int cmd_token, int
 			}
 		}
 		break;
+	case SIGNETDEV_CMD_WRITE_FLASH_HC: {
+		const struct hc_write_flash_ack *ack = (const struct hc_write_flash_ack *)resp_data;
+		writesOutstanding--;
+		bool crc_ok = !ack->length || (sentWriteCrcs.value(ack->addr) == ack->crc);
+		if (resp_code != OKAY || !crc_ok) {
+			printf("Write failed at 0x%x. Code %d\n", ack->addr, resp_code);
+			QCoreApplication::quit();
+			return;
+		}
+		if (flushing) {
+			if ((int)ack->writes_verified != writesSent) {
+				printf("Only %d of %d writes verified\n", ack->writes_verified, writesSent);
+				QCoreApplication::quit();
+				return;
+			}
+			::signetdev_reset_device(NULL, &token);
+		} else {
+			fillFirmwareWriteWindow();
+		}
+	} break;
 	case SIGNETDEV_CMD_GET_PROGRESS: {
 		signetdev_get_progress_resp_data *resp = (signetdev_get_progress_resp_data *)resp_data;
 		if (end_device_state == FIRMWARE_UPDATE) {
 			writingSectionIter = fwSections.begin();
 			writingAddr = writingSectionIter->lma;
-			sendFirmwareWriteCmd();
+			if (deviceType == SIGNETDEV_DEVICE_HC) {
+				sentWriteCrcs.clear();
+				writesSent = 0;
+				writesOutstanding = 0;
+				flushing = false;
+				fillFirmwareWriteWindow();
+			} else {
+				sendFirmwareWriteCmd();
+			}
 		} else {
 			::signetdev_get_progress(NULL, &token, resp->total_progress, ERASING_PAGES);
 		}
@@ -200,13 +283,13 @@ int main(int argc, char *argv[])
 
 	::signetdev_initialize_api();
 
-	int rc = ::signetdev_open_connection();
+	deviceType = ::signetdev_open_connection();
 
 	::signetdev_set_command_resp_cb(signetCmdResponse, NULL);
 	::signetdev_set_device_closed_cb(deviceClosedS, NULL);
 	::signetdev_set_error_handler(connectionErrorS, NULL);
 
-	if (rc == OKAY) {
+	if (deviceType != SIGNETDEV_DEVICE_NONE) {
 		::signetdev_startup(NULL, &token);
 		return a.exec();
 	}